@@ -0,0 +1,532 @@
+/*
+ * tdigest_bench.c - micro-benchmark of the internal t-digest routines
+ *
+ * This includes tdigest.c directly, so that it can call the static functions
+ * (adding values, compaction, computing percentiles, ...) without a running
+ * server, and measure the cost of each of them separately. The few backend
+ * functions actually used by those routines are provided below, palloc and
+ * friends come from libpgcommon (frontend variant). The remaining backend
+ * functions referenced by tdigest.c are listed in BENCH_STUBS (see the
+ * Makefile) and resolved to bench_unavailable(), which fails loudly. So
+ * calling other SQL-callable functions is not possible, and the link fails
+ * when tdigest.c starts using a backend function not listed there.
+ *
+ * Requires PostgreSQL 13 or newer headers (because of the error reporting
+ * functions), and is built by "make bench" (see the Makefile).
+ *
+ * Usage: tdigest_bench [-n values] [-c compression[,...]] [-d dist[,...]]
+ *                      [-e exact_threshold] [-D]
+ */
+#include "tdigest.c"
+
+#include <getopt.h>
+#include <time.h>
+
+/* backend functions / variables used by the benchmarked routines */
+
+MemoryContext CurrentMemoryContext = NULL;
+MemoryContext TopMemoryContext = NULL;
+
+/* referenced by the shared memory code, never used by the benchmark */
+LWLockPadded *MainLWLockArray = NULL;
+bool		process_shared_preload_libraries_in_progress = false;
+shmem_startup_hook_type shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+shmem_request_hook_type shmem_request_hook = NULL;
+#endif
+
+static int	bench_elevel = 0;
+
+/* target of all the backend functions listed in BENCH_STUBS (Makefile) */
+void		bench_unavailable(void);
+
+void
+bench_unavailable(void)
+{
+	fprintf(stderr, "ERROR: backend function not available in the benchmark\n");
+	exit(1);
+}
+
+int
+AggCheckCallContext(FunctionCallInfo fcinfo, MemoryContext *aggcontext)
+{
+	if (aggcontext)
+		*aggcontext = CurrentMemoryContext;
+
+	return AGG_CONTEXT_AGGREGATE;
+}
+
+bool
+errstart(int elevel, const char *domain)
+{
+	bench_elevel = elevel;
+	return (elevel >= ERROR);
+}
+
+#if PG_VERSION_NUM >= 140000
+bool
+errstart_cold(int elevel, const char *domain)
+{
+	return errstart(elevel, domain);
+}
+#endif
+
+void
+errfinish(const char *filename, int lineno, const char *funcname)
+{
+	fprintf(stderr, "ERROR at %s:%d (%s)\n", filename, lineno, funcname);
+
+	if (bench_elevel >= ERROR)
+		exit(1);
+}
+
+/* the benchmark only works with plain (not toasted) in-memory values */
+struct varlena *
+pg_detoast_datum(struct varlena *datum)
+{
+	if (VARATT_IS_EXTENDED(datum))
+		bench_unavailable();
+
+	return datum;
+}
+
+#ifdef USE_ASSERT_CHECKING
+#if PG_VERSION_NUM >= 160000
+void
+ExceptionalCondition(const char *conditionName,
+					 const char *fileName, int lineNumber)
+#else
+void
+ExceptionalCondition(const char *conditionName, const char *errorType,
+					 const char *fileName, int lineNumber)
+#endif
+{
+	fprintf(stderr, "TRAP: failed Assert(\"%s\"), File: \"%s\", Line: %d\n",
+			conditionName, fileName, lineNumber);
+	abort();
+}
+#endif
+
+int
+errcode(int sqlerrcode)
+{
+	return 0;
+}
+
+int
+errmsg(const char *fmt,...)
+{
+	va_list		args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+
+	return 0;
+}
+
+int
+errmsg_internal(const char *fmt,...)
+{
+	va_list		args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+
+	return 0;
+}
+
+/* benchmark itself */
+
+#define BENCH_MAX_ITEMS	16
+
+typedef enum
+{
+	DIST_UNIFORM,
+	DIST_NORMAL,
+	DIST_EXPONENTIAL,
+	DIST_SORTED,
+	DIST_REVERSED,
+	DIST_DISCRETE
+} bench_dist_t;
+
+static const char *dist_names[] = {
+	"uniform", "normal", "exponential", "sorted", "reversed", "discrete"
+};
+
+static uint64 rng_state = 0x2545F4914F6CDD1DULL;
+
+/* xorshift64*, so that the results are reproducible everywhere */
+static double
+bench_random(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double *
+bench_generate(bench_dist_t dist, int nvalues)
+{
+	int		i;
+	double *values = palloc(sizeof(double) * nvalues);
+
+	for (i = 0; i < nvalues; i++)
+	{
+		switch (dist)
+		{
+			case DIST_UNIFORM:
+				values[i] = bench_random();
+				break;
+			case DIST_NORMAL:
+				/* Box-Muller (the random value must not be 0) */
+				values[i] = sqrt(-2.0 * log(1.0 - bench_random())) *
+							cos(2.0 * M_PI * bench_random());
+				break;
+			case DIST_EXPONENTIAL:
+				values[i] = -log(1.0 - bench_random());
+				break;
+			case DIST_SORTED:
+				values[i] = (double) i / nvalues;
+				break;
+			case DIST_REVERSED:
+				values[i] = (double) (nvalues - i) / nvalues;
+				break;
+			case DIST_DISCRETE:
+				values[i] = floor(bench_random() * 100);
+				break;
+		}
+	}
+
+	return values;
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench_report(const char *dist, int compression, const char *op,
+			 double elapsed, int64 nops)
+{
+	printf("%-12s %6d  %-12s %12.1f ns/op  (" INT64_FORMAT " ops)\n",
+		   dist, compression, op, elapsed / nops, nops);
+}
+
+static void
+bench_free_state(tdigest_aggstate_t *state)
+{
+	if (state->centroids != INLINE_BUFFER(state))
+		pfree(state->centroids);
+	pfree(state);
+}
+
+/* call a SQL-callable function with a single argument */
+static Datum
+bench_call1(PGFunction func, Datum arg)
+{
+	LOCAL_FCINFO(fcinfo, 1);
+	Datum		result;
+
+	InitFunctionCallInfoData(*fcinfo, NULL, 1, InvalidOid, NULL, NULL);
+
+	fcinfo->args[0].value = arg;
+	fcinfo->args[0].isnull = false;
+
+	result = (*func) (fcinfo);
+
+	Assert(!fcinfo->isnull);
+
+	return result;
+}
+
+/* call tdigest_combine on a pair of aggregate states */
+static tdigest_aggstate_t *
+bench_combine(tdigest_aggstate_t *dst, tdigest_aggstate_t *src)
+{
+	LOCAL_FCINFO(fcinfo, 2);
+
+	InitFunctionCallInfoData(*fcinfo, NULL, 2, InvalidOid, NULL, NULL);
+
+	fcinfo->args[0].value = PointerGetDatum(dst);
+	fcinfo->args[0].isnull = false;
+	fcinfo->args[1].value = PointerGetDatum(src);
+	fcinfo->args[1].isnull = false;
+
+	return (tdigest_aggstate_t *) DatumGetPointer(tdigest_combine(fcinfo));
+}
+
+static tdigest_aggstate_t *
+bench_build(double *values, int nvalues, int compression)
+{
+	int		i;
+	tdigest_aggstate_t *state;
+
+	state = tdigest_aggstate_allocate(1, 0, compression);
+	state->percentiles[0] = 0.99;
+
+	for (i = 0; i < nvalues; i++)
+		tdigest_add(state, values[i]);
+
+	return state;
+}
+
+static void
+bench_run(bench_dist_t dist, int compression, int nvalues)
+{
+	int		i;
+	int		nloops;
+	double	start,
+			elapsed;
+	double	result;
+	double *values;
+	const char *name = dist_names[dist];
+	tdigest_aggstate_t *state;
+	tdigest_t  *digest;
+	int		nraw;
+
+	values = bench_generate(dist, nvalues);
+
+	/* add: values added to the aggregate state (including compactions) */
+	start = bench_now();
+	state = bench_build(values, nvalues, compression);
+	elapsed = bench_now() - start;
+
+	bench_report(name, compression, "add", elapsed, nvalues);
+
+	digest = tdigest_aggstate_to_digest(state, true);
+
+	/*
+	 * compact: compaction of a full buffer, with the compacted centroids
+	 * followed by unsorted values (just like during the aggregation)
+	 */
+	nraw = Min(BUFFER_SIZE(compression) - digest->ncentroids, nvalues);
+	nloops = Max(1, nvalues / nraw);
+	elapsed = 0;
+
+	for (i = 0; i < nloops; i++)
+	{
+		int		j;
+		double *raw = &values[(int64) i * nraw % (nvalues - nraw + 1)];
+
+		bench_free_state(state);
+		state = tdigest_aggstate_allocate(1, 0, compression);
+		tdigest_enlarge(state, digest->ncentroids + nraw);
+
+		for (j = 0; j < digest->ncentroids; j++)
+			state->centroids[j] = digest->centroids[j];
+
+		for (j = 0; j < nraw; j++)
+		{
+			state->centroids[digest->ncentroids + j].mean = raw[j];
+			state->centroids[digest->ncentroids + j].count = 1;
+		}
+
+		state->ncentroids = digest->ncentroids + nraw;
+		state->ncompacted = digest->ncentroids;
+		state->count = digest->count + nraw;
+
+		start = bench_now();
+		tdigest_compact(state);
+		elapsed += bench_now() - start;
+	}
+
+	bench_report(name, compression, "compact", elapsed, nloops);
+
+	/* quantile: single percentile from a compacted state */
+	bench_free_state(state);
+	state = tdigest_aggstate_allocate(1, 0, compression);
+	state->percentiles[0] = 0.99;
+	tdigest_add_digest_centroids(state, digest);
+
+	nloops = 100000;
+	start = bench_now();
+	for (i = 0; i < nloops; i++)
+		tdigest_compute_quantiles(state, state->percentiles,
+								  state->npercentiles, &result);
+	elapsed = bench_now() - start;
+
+	bench_report(name, compression, "quantile", elapsed, nloops);
+
+	/* merge: combining partial aggregate states (as in parallel queries) */
+	nloops = 1000;
+	elapsed = 0;
+	for (i = 0; i < nloops; i++)
+	{
+		tdigest_aggstate_t *src = tdigest_aggstate_allocate(1, 0, compression);
+
+		tdigest_add_digest_centroids(src, digest);
+
+		start = bench_now();
+		state = bench_combine(state, src);
+		elapsed += bench_now() - start;
+
+		bench_free_state(src);
+	}
+
+	bench_report(name, compression, "merge", elapsed, nloops);
+
+	/* serial / deserial of the aggregate state */
+	tdigest_compact(state);
+
+	nloops = 10000;
+	start = bench_now();
+	for (i = 0; i < nloops; i++)
+		pfree(DatumGetPointer(bench_call1(tdigest_serial, PointerGetDatum(state))));
+	elapsed = bench_now() - start;
+
+	bench_report(name, compression, "serial", elapsed, nloops);
+
+	{
+		Datum	serialized = bench_call1(tdigest_serial, PointerGetDatum(state));
+
+		elapsed = 0;
+		for (i = 0; i < nloops; i++)
+		{
+			tdigest_aggstate_t *tmp;
+
+			start = bench_now();
+			tmp = (tdigest_aggstate_t *) DatumGetPointer(bench_call1(tdigest_deserial, serialized));
+			elapsed += bench_now() - start;
+
+			bench_free_state(tmp);
+		}
+
+		bench_report(name, compression, "deserial", elapsed, nloops);
+
+		pfree(DatumGetPointer(serialized));
+	}
+
+	/* in / out of the t-digest type */
+	{
+		char   *str = DatumGetCString(bench_call1(tdigest_out, PointerGetDatum(digest)));
+
+		nloops = 1000;
+		start = bench_now();
+		for (i = 0; i < nloops; i++)
+			pfree(DatumGetPointer(bench_call1(tdigest_out, PointerGetDatum(digest))));
+		elapsed = bench_now() - start;
+
+		bench_report(name, compression, "out", elapsed, nloops);
+
+		start = bench_now();
+		for (i = 0; i < nloops; i++)
+			pfree(DatumGetPointer(bench_call1(tdigest_in, CStringGetDatum(str))));
+		elapsed = bench_now() - start;
+
+		bench_report(name, compression, "in", elapsed, nloops);
+
+		pfree(str);
+	}
+
+	bench_free_state(state);
+	pfree(digest);
+	pfree(values);
+}
+
+/* parse a comma-separated list of compressions or distributions */
+static int
+bench_parse_list(char *str, int *items, bool dists)
+{
+	int		n = 0;
+	char   *tok;
+
+	for (tok = strtok(str, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		if (n == BENCH_MAX_ITEMS)
+		{
+			fprintf(stderr, "too many items in list\n");
+			exit(1);
+		}
+
+		if (dists)
+		{
+			int		i;
+
+			for (i = 0; i < lengthof(dist_names); i++)
+				if (strcmp(tok, dist_names[i]) == 0)
+					break;
+
+			if (i == lengthof(dist_names))
+			{
+				fprintf(stderr, "unknown distribution \"%s\"\n", tok);
+				exit(1);
+			}
+
+			items[n++] = i;
+		}
+		else
+		{
+			items[n] = atoi(tok);
+
+			if (items[n] < MIN_COMPRESSION || items[n] > MAX_COMPRESSION)
+			{
+				fprintf(stderr, "invalid compression \"%s\"\n", tok);
+				exit(1);
+			}
+
+			n++;
+		}
+	}
+
+	return n;
+}
+
+int
+main(int argc, char **argv)
+{
+	int		c, i, j;
+	int		nvalues = 1000000;
+	int		compressions[BENCH_MAX_ITEMS] = {100, 1000};
+	int		ncompressions = 2;
+	int		dists[BENCH_MAX_ITEMS] = {DIST_UNIFORM, DIST_NORMAL, DIST_EXPONENTIAL, DIST_SORTED};
+	int		ndists = 4;
+
+	while ((c = getopt(argc, argv, "n:c:d:e:D")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				nvalues = atoi(optarg);
+				if (nvalues <= 0)
+				{
+					fprintf(stderr, "invalid number of values \"%s\"\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'c':
+				ncompressions = bench_parse_list(optarg, compressions, false);
+				break;
+			case 'd':
+				ndists = bench_parse_list(optarg, dists, true);
+				break;
+			case 'e':
+				tdigest_exact_threshold = atoi(optarg);
+				break;
+			case 'D':
+				tdigest_deduplicate = true;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n values] [-c compression[,...]] [-d dist[,...]] [-e exact_threshold] [-D]\n",
+						argv[0]);
+				exit(1);
+		}
+	}
+
+	for (i = 0; i < ndists; i++)
+		for (j = 0; j < ncompressions; j++)
+			bench_run(dists[i], compressions[j], nvalues);
+
+	return 0;
+}
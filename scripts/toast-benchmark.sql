@@ -0,0 +1,31 @@
+-- Compare the I/O needed to access the header of t-digests stored out of
+-- line (count, min, max, ...), which only fetches the first TOAST chunk, to
+-- functions that need to detoast the whole digest.
+
+drop table if exists toast_digests;
+create table toast_digests (g int, d tdigest);
+
+-- 1000 digests with compression 1000, large enough to be stored out of line
+insert into toast_digests select g, tdigest(v, 1000)
+  from (select mod(i, 1000) as g, random() as v from generate_series(1,10000000) s(i)) foo
+ group by g;
+
+vacuum analyze toast_digests;
+
+-- size of the digests and of the table (heap + TOAST)
+select avg(pg_column_size(d)) as avg_digest_size,
+       pg_size_pretty(pg_relation_size('toast_digests')) as heap_size,
+       pg_size_pretty(pg_table_size('toast_digests') - pg_relation_size('toast_digests')) as toast_size
+  from toast_digests;
+
+-- header-only access (should read only a small fraction of the TOAST table)
+explain (analyze, buffers, costs off) select sum(tdigest_count(d)) from toast_digests;
+explain (analyze, buffers, costs off) select min(tdigest_min(d)), max(tdigest_max(d)) from toast_digests;
+explain (analyze, buffers, costs off) select sum(tdigest_sum(d)) / sum(tdigest_count(d)) from toast_digests;
+
+-- access to the whole digest (has to read all TOAST chunks)
+explain (analyze, buffers, costs off) select avg(tdigest_digest_percentile(d, 0.5)) from toast_digests;
+explain (analyze, buffers, costs off) select sum(tdigest_digest_sum(d, 0.0, 1.0)) from toast_digests;
+
+-- TOAST blocks accessed by the queries above
+select toast_blks_read, toast_blks_hit from pg_statio_user_tables where relname = 'toast_digests';
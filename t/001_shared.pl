@@ -0,0 +1,124 @@
+# Shared t-digests need the library loaded using shared_preload_libraries,
+# so this can't be tested by the regular regression tests (those only check
+# the error when the library is not preloaded).
+
+use strict;
+use warnings;
+
+use Test::More;
+
+# PostgreSQL::Test::Cluster is PG 15+, older releases have PostgresNode
+my $node;
+
+if (eval { require PostgreSQL::Test::Cluster; 1 })
+{
+	$node = PostgreSQL::Test::Cluster->new('shared');
+}
+else
+{
+	require PostgresNode;
+	$node = PostgresNode::get_new_node('shared');
+}
+
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'tdigest'
+tdigest.shm_max_digests = 2
+tdigest.shm_compression = 100
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION tdigest');
+
+# each psql call is a separate session, so everything we see was merged
+# into the shared t-digest at commit (and not just into the local buffer)
+sub shm_count
+{
+	my ($name) = @_;
+
+	return $node->safe_psql('postgres',
+		"SELECT coalesce(tdigest_count(tdigest_shm_get('$name')), 0)");
+}
+
+# values added by a committed transaction are visible to other sessions
+$node->safe_psql('postgres',
+	"SELECT tdigest_shm_add('latency', i) FROM generate_series(1, 10000) s(i)");
+is(shm_count('latency'), '10000', 'values from the first commit');
+
+# values from multiple transactions (and sessions) accumulate
+$node->safe_psql('postgres', q{
+BEGIN;
+SELECT tdigest_shm_add('latency', i) FROM generate_series(1, 500) s(i);
+COMMIT;
+BEGIN;
+SELECT tdigest_shm_add('latency', i) FROM generate_series(501, 1000) s(i);
+COMMIT;
+});
+is(shm_count('latency'), '11000', 'values from separate commits');
+
+$node->safe_psql('postgres',
+	"SELECT tdigest_shm_add('latency', 10000 + i) FROM generate_series(1, 100) s(i)");
+is(shm_count('latency'), '11100', 'values from another session');
+
+# values still in the local buffer of an aborted transaction are discarded
+$node->safe_psql('postgres', q{
+BEGIN;
+SELECT tdigest_shm_add('latency', i) FROM generate_series(1, 100) s(i);
+ROLLBACK;
+});
+is(shm_count('latency'), '11100', 'values from an aborted transaction');
+
+# a session sees its own values before commit, because tdigest_shm_get
+# merges the local buffer (and so those values survive a rollback)
+is( $node->safe_psql('postgres', q{
+BEGIN;
+DO $$ BEGIN PERFORM tdigest_shm_add('latency', 1.0); END $$;
+SELECT tdigest_count(tdigest_shm_get('latency'));
+ROLLBACK;
+}),
+	'11101',
+	'own values visible before commit');
+is(shm_count('latency'), '11101', 'merged values are kept after rollback');
+
+# min/max are exact, the median is roughly right
+is( $node->safe_psql('postgres', q{
+SELECT tdigest_min(d), tdigest_max(d), abs(tdigest_percentile(d, 0.5) - 4550) < 100
+  FROM (SELECT tdigest_shm_get('latency') AS d) foo
+}),
+	'1|10100|t',
+	'min, max and median of the shared t-digest');
+
+# reset returns the current digest, and leaves the t-digest empty
+is( $node->safe_psql('postgres',
+		"SELECT tdigest_count(tdigest_shm_get('latency', true))"),
+	'11101',
+	'get and reset the shared t-digest');
+is(shm_count('latency'), '0', 'shared t-digest empty after reset');
+
+$node->safe_psql('postgres',
+	"SELECT tdigest_shm_add('latency', i) FROM generate_series(1, 10) s(i)");
+is(shm_count('latency'), '10', 'values added after reset');
+
+# the number of shared t-digests is limited by tdigest.shm_max_digests
+$node->safe_psql('postgres', "SELECT tdigest_shm_add('other', 1.0)");
+
+my ($ret, $stdout, $stderr) = $node->psql('postgres',
+	"SELECT tdigest_shm_add('third', 1.0)");
+like($stderr, qr/too many shared t-digests/, 'too many shared t-digests');
+
+# dropping releases the entry for other t-digests
+is( $node->safe_psql('postgres', "SELECT tdigest_shm_drop('other')"),
+	't', 'drop an existing shared t-digest');
+is( $node->safe_psql('postgres', "SELECT tdigest_shm_drop('other')"),
+	'f', 'drop a shared t-digest that does not exist');
+
+$node->safe_psql('postgres', "SELECT tdigest_shm_add('third', 1.0)");
+is(shm_count('third'), '1', 'new shared t-digest after drop');
+
+# the shared t-digests are lost on restart
+$node->restart;
+is(shm_count('latency'), '0', 'shared t-digests are lost on restart');
+
+$node->stop;
+
+done_testing();
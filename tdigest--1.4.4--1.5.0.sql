@@ -0,0 +1,387 @@
+CREATE OR REPLACE FUNCTION tdigest_digest_percentile(p_digest tdigest, p_quantile double precision)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_digest_percentile'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_digest_percentile(p_digest tdigest, p_quantiles double precision[])
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_digest_percentiles'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_digest_percentile_of(p_digest tdigest, p_value double precision)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_digest_percentile_of'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_digest_percentile_of(p_digest tdigest, p_values double precision[])
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_digest_percentiles_of'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_ordered_percentiles(p_pointer internal, p_quantile double precision)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_ordered_percentiles'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tdigest_ordered_array_percentiles(p_pointer internal, p_quantiles double precision[])
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_ordered_array_percentiles'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tdigest_ordered_percentiles_of(p_pointer internal, p_value double precision)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_ordered_percentiles_of'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tdigest_ordered_array_percentiles_of(p_pointer internal, p_values double precision[])
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_ordered_array_percentiles_of'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tdigest_ordered_trimmed_avg(p_pointer internal, p_low double precision, p_high double precision)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_ordered_trimmed_avg'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tdigest_ordered_trimmed_sum(p_pointer internal, p_low double precision, p_high double precision)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_ordered_trimmed_sum'
+    LANGUAGE C IMMUTABLE;
+
+/*
+ * Ordered-set variants of the aggregates, with the percentiles (values, trim
+ * limits) as direct arguments, passed to the final function. All of them use
+ * the same transition function, so aggregates with the same WITHIN GROUP
+ * arguments share a single aggregate state. That requires FINALFUNC_MODIFY,
+ * which is not supported before PostgreSQL 11.
+ */
+DO $$
+DECLARE
+    v_modify text := '';
+BEGIN
+
+    IF current_setting('server_version_num')::int >= 110000 THEN
+        v_modify := ', FINALFUNC_MODIFY = SHAREABLE';
+    END IF;
+
+    EXECUTE 'CREATE AGGREGATE tdigest_ordered_percentile(double precision ORDER BY double precision, int) (
+        SFUNC = tdigest_add_double,
+        STYPE = internal,
+        FINALFUNC = tdigest_ordered_percentiles,
+        PARALLEL = SAFE' || v_modify || ')';
+
+    EXECUTE 'CREATE AGGREGATE tdigest_ordered_percentile(double precision[] ORDER BY double precision, int) (
+        SFUNC = tdigest_add_double,
+        STYPE = internal,
+        FINALFUNC = tdigest_ordered_array_percentiles,
+        PARALLEL = SAFE' || v_modify || ')';
+
+    EXECUTE 'CREATE AGGREGATE tdigest_ordered_percentile_of(double precision ORDER BY double precision, int) (
+        SFUNC = tdigest_add_double,
+        STYPE = internal,
+        FINALFUNC = tdigest_ordered_percentiles_of,
+        PARALLEL = SAFE' || v_modify || ')';
+
+    EXECUTE 'CREATE AGGREGATE tdigest_ordered_percentile_of(double precision[] ORDER BY double precision, int) (
+        SFUNC = tdigest_add_double,
+        STYPE = internal,
+        FINALFUNC = tdigest_ordered_array_percentiles_of,
+        PARALLEL = SAFE' || v_modify || ')';
+
+    EXECUTE 'CREATE AGGREGATE tdigest_ordered_avg(double precision, double precision ORDER BY double precision, int) (
+        SFUNC = tdigest_add_double,
+        STYPE = internal,
+        FINALFUNC = tdigest_ordered_trimmed_avg,
+        PARALLEL = SAFE' || v_modify || ')';
+
+    EXECUTE 'CREATE AGGREGATE tdigest_ordered_sum(double precision, double precision ORDER BY double precision, int) (
+        SFUNC = tdigest_add_double,
+        STYPE = internal,
+        FINALFUNC = tdigest_ordered_trimmed_sum,
+        PARALLEL = SAFE' || v_modify || ')';
+
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION tdigest_stats(OUT compactions bigint, OUT sorts bigint, OUT sorted_centroids bigint,
+                                         OUT combines bigint, OUT serialized bigint, OUT serialized_bytes bigint,
+                                         OUT deserialized bigint, OUT deserialized_bytes bigint,
+                                         OUT compact_time double precision, OUT sort_time double precision)
+    RETURNS record
+    AS 'tdigest', 'tdigest_stats_info'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_stats_reset()
+    RETURNS void
+    AS 'tdigest', 'tdigest_stats_reset'
+    LANGUAGE C VOLATILE STRICT;
+
+-- trimmed aggregates with multiple bands (arrays of low/high percentiles)
+CREATE OR REPLACE FUNCTION tdigest_add_double_trimmed_array(p_pointer internal, p_element double precision, p_compression int, p_low double precision[], p_high double precision[])
+    RETURNS internal
+    AS 'tdigest', 'tdigest_add_double_trimmed_array'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tdigest_add_digest_trimmed_array(p_pointer internal, p_element tdigest, p_low double precision[], p_high double precision[])
+    RETURNS internal
+    AS 'tdigest', 'tdigest_add_digest_trimmed_array'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tdigest_trimmed_array_avg(p_pointer internal)
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_trimmed_array_avg'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tdigest_trimmed_array_sum(p_pointer internal)
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_trimmed_array_sum'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tdigest_avg(double precision, int, double precision[], double precision[]) (
+    SFUNC = tdigest_add_double_trimmed_array,
+    STYPE = internal,
+    FINALFUNC = tdigest_trimmed_array_avg,
+    SERIALFUNC = tdigest_serial,
+    DESERIALFUNC = tdigest_deserial,
+    COMBINEFUNC = tdigest_combine,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE tdigest_avg(tdigest, double precision[], double precision[]) (
+    SFUNC = tdigest_add_digest_trimmed_array,
+    STYPE = internal,
+    FINALFUNC = tdigest_trimmed_array_avg,
+    SERIALFUNC = tdigest_serial,
+    DESERIALFUNC = tdigest_deserial,
+    COMBINEFUNC = tdigest_combine,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE tdigest_sum(double precision, int, double precision[], double precision[]) (
+    SFUNC = tdigest_add_double_trimmed_array,
+    STYPE = internal,
+    FINALFUNC = tdigest_trimmed_array_sum,
+    SERIALFUNC = tdigest_serial,
+    DESERIALFUNC = tdigest_deserial,
+    COMBINEFUNC = tdigest_combine,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE tdigest_sum(tdigest, double precision[], double precision[]) (
+    SFUNC = tdigest_add_digest_trimmed_array,
+    STYPE = internal,
+    FINALFUNC = tdigest_trimmed_array_sum,
+    SERIALFUNC = tdigest_serial,
+    DESERIALFUNC = tdigest_deserial,
+    COMBINEFUNC = tdigest_combine,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION tdigest_digest_sum(p_digest tdigest, p_low double precision[], p_high double precision[])
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_digest_array_sum'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_digest_avg(p_digest tdigest, p_low double precision[], p_high double precision[])
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_digest_array_avg'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- exact min/max/mean/sum, stored in the t-digest header
+CREATE OR REPLACE FUNCTION tdigest_min(tdigest)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_min'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_max(tdigest)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_max'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_mean(tdigest)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_mean'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_sum(tdigest)
+    RETURNS double precision
+    AS 'tdigest', 'tdigest_sum'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- range of values in the t-digest contains the value (SQL functions, so
+-- that they get inlined and can use expression indexes on tdigest_min and
+-- tdigest_max, e.g. USING brin (tdigest_min(d), tdigest_max(d)))
+CREATE OR REPLACE FUNCTION tdigest_contains(p_digest tdigest, p_value double precision)
+    RETURNS boolean
+    AS $$ SELECT tdigest_min($1) <= $2 AND tdigest_max($1) >= $2 $$
+    LANGUAGE SQL IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tdigest_contained(p_value double precision, p_digest tdigest)
+    RETURNS boolean
+    AS $$ SELECT tdigest_min($2) <= $1 AND tdigest_max($2) >= $1 $$
+    LANGUAGE SQL IMMUTABLE;
+
+CREATE OPERATOR @> (
+    LEFTARG = tdigest,
+    RIGHTARG = double precision,
+    PROCEDURE = tdigest_contains,
+    COMMUTATOR = '<@',
+    RESTRICT = contsel,
+    JOIN = contjoinsel
+);
+
+CREATE OPERATOR <@ (
+    LEFTARG = double precision,
+    RIGHTARG = tdigest,
+    PROCEDURE = tdigest_contained,
+    COMMUTATOR = '@>',
+    RESTRICT = contsel,
+    JOIN = contjoinsel
+);
+
+-- summary of a digest (count, min, max, mean, percentiles, trimmed means)
+CREATE OR REPLACE FUNCTION tdigest_summary(p_digest tdigest, p_percentiles double precision[], p_trims double precision[],
+                                           OUT count bigint, OUT min double precision, OUT max double precision,
+                                           OUT mean double precision, OUT percentiles double precision[],
+                                           OUT trimmed_means double precision[])
+    RETURNS record
+    AS 'tdigest', 'tdigest_summary'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- build a t-digest from arrays of centroid means and counts
+CREATE OR REPLACE FUNCTION tdigest_from_arrays(p_means double precision[], p_counts bigint[], p_compression int)
+    RETURNS tdigest
+    AS 'tdigest', 'tdigest_from_arrays'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- build a t-digest from a bucketed histogram (bounds and counts)
+CREATE OR REPLACE FUNCTION tdigest_from_histogram(p_bounds double precision[], p_counts bigint[], p_compression int, p_cumulative bool = false)
+    RETURNS tdigest
+    AS 'tdigest', 'tdigest_from_histogram'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- decay the t-digest (multiply the counts by a factor)
+CREATE OR REPLACE FUNCTION tdigest_decay(p_digest tdigest, p_factor double precision)
+    RETURNS tdigest
+    AS 'tdigest', 'tdigest_decay'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- shared t-digests (require loading the library using shared_preload_libraries)
+CREATE OR REPLACE FUNCTION tdigest_shm_add(p_name text, p_value double precision)
+    RETURNS void
+    AS 'tdigest', 'tdigest_shm_add'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_shm_get(p_name text, p_reset bool = false)
+    RETURNS tdigest
+    AS 'tdigest', 'tdigest_shm_get'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_shm_drop(p_name text)
+    RETURNS bool
+    AS 'tdigest', 'tdigest_shm_drop'
+    LANGUAGE C VOLATILE STRICT;
+
+-- sliding window of t-digests (ring of per-bucket digests)
+CREATE TYPE tdigest_window;
+
+CREATE OR REPLACE FUNCTION tdigest_window_in(cstring)
+    RETURNS tdigest_window
+    AS 'tdigest', 'tdigest_window_in'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_window_out(tdigest_window)
+    RETURNS cstring
+    AS 'tdigest', 'tdigest_window_out'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_window_send(tdigest_window)
+    RETURNS bytea
+    AS 'tdigest', 'tdigest_window_send'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_window_recv(internal)
+    RETURNS tdigest_window
+    AS 'tdigest', 'tdigest_window_recv'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE tdigest_window (
+    INPUT = tdigest_window_in,
+    OUTPUT = tdigest_window_out,
+    RECEIVE = tdigest_window_recv,
+    SEND = tdigest_window_send,
+    INTERNALLENGTH = variable,
+    ALIGNMENT = double,
+    STORAGE = external
+);
+
+CREATE OR REPLACE FUNCTION tdigest_window(p_buckets int, p_compression int)
+    RETURNS tdigest_window
+    AS 'tdigest', 'tdigest_window_create'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_window_add(p_window tdigest_window, p_bucket bigint, p_digest tdigest)
+    RETURNS tdigest_window
+    AS 'tdigest', 'tdigest_window_add'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_window_advance(p_window tdigest_window, p_bucket bigint)
+    RETURNS tdigest_window
+    AS 'tdigest', 'tdigest_window_advance'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_window_digest(p_window tdigest_window)
+    RETURNS tdigest
+    AS 'tdigest', 'tdigest_window_digest'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE CAST (tdigest_window AS tdigest)
+    WITH FUNCTION tdigest_window_digest(tdigest_window)
+    AS ASSIGNMENT;
+
+CREATE OR REPLACE FUNCTION tdigest_recompress(p_digest tdigest, p_compression int)
+    RETURNS tdigest
+    AS 'tdigest', 'tdigest_recompress'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_add_digest_compression(p_pointer internal, p_element tdigest, p_compression int)
+    RETURNS internal
+    AS 'tdigest', 'tdigest_add_digest_compression'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tdigest(tdigest, int) (
+    SFUNC = tdigest_add_digest_compression,
+    STYPE = internal,
+    FINALFUNC = tdigest_digest,
+    SERIALFUNC = tdigest_serial,
+    DESERIALFUNC = tdigest_deserial,
+    COMBINEFUNC = tdigest_combine,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION tdigest_subtract(p_digest tdigest, p_other tdigest)
+    RETURNS tdigest
+    AS 'tdigest', 'tdigest_subtract'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_digest_percentile(p_digests tdigest[], p_quantile double precision)
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_digests_percentile'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_digest_percentile(p_digests tdigest[], p_quantiles double precision[])
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_digests_percentiles'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_cdf(p_digest tdigest, p_values double precision[])
+    RETURNS double precision[]
+    AS 'tdigest', 'tdigest_cdf'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tdigest_histogram(p_digest tdigest, p_bins int,
+                                             OUT edges double precision[],
+                                             OUT counts double precision[])
+    RETURNS record
+    AS 'tdigest', 'tdigest_histogram'
+    LANGUAGE C IMMUTABLE STRICT;
@@ -13,10 +13,19 @@
 #include <limits.h>
 
 #include "postgres.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "access/xact.h"
 #include "libpq/pqformat.h"
+#include "portability/instr_time.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
 #include "catalog/pg_type.h"
 
 PG_MODULE_MAGIC;
@@ -38,6 +47,10 @@ typedef struct tdigest_t {
 	int64		count;			/* number of items added to the t-digest */
 	int			compression;	/* compression used to build the digest */
 	int			ncentroids;		/* number of cetroids in the array */
+	/* extended header (only with TDIGEST_HAS_STATS) */
+	double		min;			/* exact minimum of the added values */
+	double		max;			/* exact maximum of the added values */
+	double		sum;			/* exact sum of the added values */
 	centroid_t	centroids[FLEXIBLE_ARRAY_MEMBER];
 } tdigest_t;
 
@@ -51,8 +64,37 @@ typedef struct tdigest_t {
  */
 #define	TDIGEST_STORES_MEAN		0x0001
 
+/*
+ * Digests built by compaction have centroids sorted by mean, and there's no
+ * point in sorting and compacting them again when reading them. So we mark
+ * such digests, which allows estimating percentiles directly from the stored
+ * centroids (and e.g. using prefix sums to find the right centroid).
+ *
+ * Only digests in the new format (storing mean) may be marked as compacted.
+ */
+#define	TDIGEST_COMPACTED		0x0002
+
+/*
+ * Digests with exact min, max and sum of the added values, stored in an
+ * extended header (between ncentroids and the centroids). That allows
+ * accessing those values without walking the centroids, and using the
+ * true extremes when interpolating on the tails.
+ *
+ * Digests without the flag (built by older versions) don't have the extended
+ * header at all, i.e. the centroids start right after ncentroids. When
+ * reading such digests, we derive the values from the centroids (so the
+ * min/max are not exact, but it's no worse than before).
+ *
+ * Only digests in the new format (storing mean) may have the stats.
+ */
+#define	TDIGEST_HAS_STATS		0x0004
+
 /* All valid flags, OR-ed. */
-#define	TDIGEST_VALID_FLAGS		(TDIGEST_STORES_MEAN)
+#define	TDIGEST_VALID_FLAGS		(TDIGEST_STORES_MEAN | TDIGEST_COMPACTED | \
+								 TDIGEST_HAS_STATS)
+
+/* offset of centroids in digests without the extended header */
+#define	TDIGEST_NOSTATS_HEADER	offsetof(tdigest_t, min)
 
 /*
  * An aggregate state, representing the t-digest and some additional info
@@ -68,6 +110,23 @@ typedef struct tdigest_t {
  * XXX We only ever use one of values/percentiles, never both at the same
  * time. In the future the values may use a different data types than double
  * (e.g. numeric), so we keep both fields.
+ *
+ * The buffer for centroids is allocated lazily - we start with a small one
+ * and double it as needed, up to BUFFER_SIZE(compression). Groups with only
+ * a couple values (which are common with GROUP BY) don't need the whole
+ * buffer, so this saves quite a bit of memory.
+ *
+ * In the exact mode (exact_threshold > 0), the centroids are kept as a list
+ * of distinct values with counts. When the buffer fills, we only merge the
+ * duplicate values (which is lossless), and switch to regular compaction
+ * only after the number of distinct values exceeds the threshold. Until
+ * then we can calculate exact results (e.g. percentiles).
+ *
+ * With deduplication enabled, incoming values are first collected in a small
+ * open-addressing hash table of (value, count) pairs, and only moved to the
+ * centroid buffer when the hash table fills up (or before the centroids are
+ * accessed). For data with many repeated values this reduces the number of
+ * centroids we need to sort during compaction.
  */
 typedef struct tdigest_aggstate_t {
 	/* basic t-digest fields (centroids at the end) */
@@ -76,6 +135,10 @@ typedef struct tdigest_aggstate_t {
 	int			compression;	/* compression algorithm */
 	int			ncentroids;		/* number of centroids */
 	int			ncompacted;		/* compacted part */
+	int			exact_threshold;	/* max distinct values in exact mode */
+	double		min;			/* exact minimum (+Inf if empty) */
+	double		max;			/* exact maximum (-Inf if empty) */
+	double		sum;			/* exact sum of the values */
 	/* array of requested percentiles and values */
 	int			npercentiles;	/* number of percentiles */
 	int			nvalues;		/* number of values */
@@ -84,11 +147,71 @@ typedef struct tdigest_aggstate_t {
 	double	   *percentiles;	/* array of percentiles (if any) */
 	double	   *values;			/* array of values (if any) */
 	centroid_t *centroids;		/* centroids for the digest */
+	int			nallocated;		/* allocated space for centroids */
+	centroid_t *hash;			/* hash table for deduplication (or NULL) */
+	int			nhashed;		/* number of used hash slots */
 } tdigest_aggstate_t;
 
-static int  centroid_cmp(const void *a, const void *b);
+/*
+ * A compacted t-digest cached in fn_extra (see tdigest_get_cached), along
+ * with cumulative counts for the centroids.
+ */
+typedef struct tdigest_cache_t {
+	struct varlena *key;		/* raw datum (possibly a TOAST pointer) */
+	tdigest_t  *digest;			/* compacted t-digest */
+	int64	   *cumulative;		/* cumulative counts for centroids */
+} tdigest_cache_t;
 
-#define PG_GETARG_TDIGEST(x)	(tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(x))
+/*
+ * Sliding window of t-digests - a ring of digests for consecutive buckets
+ * (e.g. one per minute), and a digest merged from all the buckets.
+ *
+ * The buckets are identified by a number (e.g. minutes since epoch), and
+ * the window contains buckets (position - nbuckets, position], with bucket
+ * b stored in slot (b mod nbuckets). Adding data to a newer bucket moves
+ * the window, evicting buckets that fall out of it.
+ *
+ * The merged digest is rebuilt whenever the window changes, so queries
+ * only need to read the merged digest. It's stored first (right after the
+ * offsets), so that for windows stored out of line we can fetch it as a
+ * slice, without the bucket digests.
+ *
+ * The digests are stored after the offsets, each one MAXALIGN-ed. Offset
+ * 0 means an empty bucket (or no merged digest, if all are empty).
+ */
+typedef struct tdigest_window_t {
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	int32		flags;			/* reserved for future use */
+	int32		nbuckets;		/* number of buckets in the ring */
+	int32		compression;	/* compression of the merged digest */
+	int64		position;		/* number of the newest bucket */
+	uint32		offsets[FLEXIBLE_ARRAY_MEMBER];	/* merged, then buckets */
+} tdigest_window_t;
+
+static int  centroid_cmp(const void *a, const void *b);
+static void tdigest_flush_hash(tdigest_aggstate_t *state);
+static void tdigest_add_centroid(tdigest_aggstate_t *state, double mean,
+								 int64 count);
+static tdigest_t *tdigest_update_format(tdigest_t *digest);
+static void tdigest_quantiles_cumulative(centroid_t *centroids,
+										 int64 *cumulative, int ncentroids,
+										 int64 total_count,
+										 double min, double max,
+										 double *percentiles, int npercentiles,
+										 double *result);
+static void tdigest_quantiles_of_cumulative(centroid_t *centroids,
+											int64 *cumulative, int ncentroids,
+											int64 total_count,
+											double min, double max,
+											double *values, int nvalues,
+											double *result);
+
+#define PG_GETARG_TDIGEST(x)	tdigest_update_format((tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(x)))
+
+#define PG_GETARG_TDIGEST_WINDOW(x)	((tdigest_window_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(x)))
+
+/* only the header (including min/max/sum), the centroids may be missing */
+#define PG_GETARG_TDIGEST_HEADER(x)	tdigest_get_header(PG_GETARG_DATUM(x), true)
 
 /*
  * Size of buffer for incoming data, as a multiple of the compression value.
@@ -105,11 +228,171 @@ static int  centroid_cmp(const void *a, const void *b);
  * and memory usage.
  */
 #define	BUFFER_SIZE(compression)	(10 * (compression))
+
+/* Initial size of the buffer for centroids (enlarged as needed). */
+#define	INITIAL_BUFFER_SIZE(compression)	Min(64, BUFFER_SIZE(compression))
+
+/*
+ * The initial buffer is allocated in the same chunk as the aggregate state
+ * (right after the struct), and replaced by a separately allocated buffer
+ * when enlarged.
+ */
+#define	INLINE_BUFFER(state) \
+	((centroid_t *) ((char *) (state) + MAXALIGN(sizeof(tdigest_aggstate_t))))
+
+/*
+ * Maximum number of distinct values in the exact mode. We need to be able
+ * to merge duplicates in a full buffer and still have some free space.
+ */
+#define	MAX_EXACT_THRESHOLD(compression)	(BUFFER_SIZE(compression) / 2)
+
+/*
+ * Size of the hash table used to deduplicate incoming values (has to be
+ * a power of 2), and the maximum number of used slots before we flush it
+ * into the centroid buffer.
+ */
+#define	DEDUP_HASH_SIZE		128
+#define	DEDUP_HASH_MAX		(DEDUP_HASH_SIZE * 3 / 4)
+
+/*
+ * Maximum number of percentiles calculated by selection directly from the
+ * unsorted buffer (in the exact mode). For more percentiles, it's cheaper
+ * to simply sort the whole buffer.
+ */
+#define	SELECT_MAX_PERCENTILES	2
+
+/*
+ * Maximum number of natural runs (ascending or descending sequences) merged
+ * when sorting the centroid buffer. With more runs the data is not ordered
+ * in any useful way, and we just do a regular qsort.
+ */
+#define	SORT_MAX_RUNS			8
 #define AssertBounds(index, length) Assert((index) >= 0 && (index) < (length))
 
 #define MIN_COMPRESSION		10
 #define MAX_COMPRESSION		10000
 
+#define MAX_WINDOW_BUCKETS	10000
+
+/* space for the window header, including offsets of the digests */
+#define TDIGEST_WINDOW_HEADER(nbuckets) \
+	MAXALIGN(offsetof(tdigest_window_t, offsets) + ((nbuckets) + 1) * sizeof(uint32))
+
+/* digest with the given index (0 is the merged one), or NULL if empty */
+#define TDIGEST_WINDOW_DIGEST(window, i) \
+	(((window)->offsets[i] == 0) ? NULL : \
+	 (tdigest_t *) ((char *) (window) + (window)->offsets[i]))
+
+/* slot for a bucket number (which may be negative) */
+#define TDIGEST_WINDOW_SLOT(nbuckets, bucket) \
+	((int) ((((bucket) % (nbuckets)) + (nbuckets)) % (nbuckets)))
+
+/*
+ * Keep exact (value, count) lists for up to this number of distinct values,
+ * before switching to regular t-digest compaction (0 disables exact mode).
+ */
+static int	tdigest_exact_threshold = 0;
+
+/* Deduplicate incoming values using a small hash table. */
+static bool	tdigest_deduplicate = false;
+
+/* Collect statistics about compactions, sorts etc. (see tdigest_stats). */
+static bool	tdigest_track_stats = false;
+
+/*
+ * Per-backend statistics, collected only with tdigest.track_stats enabled.
+ * In parallel queries, the statistics from the workers are not included.
+ */
+typedef struct tdigest_stats_t {
+	int64		compactions;		/* number of compactions */
+	int64		sorts;				/* number of sorts */
+	int64		sorted;				/* number of centroids sorted */
+	int64		combines;			/* number of combined states */
+	int64		serialized;			/* number of serialized states */
+	int64		serialized_bytes;	/* size of serialized states */
+	int64		deserialized;		/* number of deserialized states */
+	int64		deserialized_bytes;	/* size of deserialized states */
+	instr_time	compact_time;		/* time spent in compaction */
+	instr_time	sort_time;			/* time spent sorting */
+} tdigest_stats_t;
+
+static tdigest_stats_t tdigest_stats;
+
+/*
+ * Named t-digests in shared memory (see tdigest_shm_add), available only
+ * when the library is loaded using shared_preload_libraries.
+ *
+ * The number of digests and the compression are fixed at server start,
+ * so that each digest can use a preallocated centroid buffer (of the full
+ * BUFFER_SIZE). The registry of names is protected by the first lock of
+ * the "tdigest" tranche, each digest has a separate lock.
+ */
+static int	tdigest_shm_max_digests = 16;
+static int	tdigest_shm_compression = 100;
+
+/*
+ * A named t-digest in shared memory. The aggregate state is used just like
+ * in the aggregates, but the centroid buffer follows the entry, and the
+ * pointer has to be set by each backend before using the state (see
+ * tdigest_shm_state). Unused entries have an empty name.
+ *
+ * The generation is incremented whenever the digest is dropped, so that
+ * backends can detect stale slots remembered for the local buffers.
+ */
+typedef struct tdigest_shm_entry_t {
+	char		name[NAMEDATALEN];	/* name of the digest (empty if unused) */
+	uint64		generation;			/* incremented when dropped */
+	tdigest_aggstate_t state;		/* aggregate state (except centroids) */
+} tdigest_shm_entry_t;
+
+typedef struct tdigest_shm_t {
+	LWLockPadded *locks;		/* registry lock, then one per entry */
+	int			ndigests;		/* number of entries */
+	int			compression;	/* compression of all the digests */
+	Size		entry_size;		/* entry, including the centroid buffer */
+} tdigest_shm_t;
+
+/*
+ * Per-backend buffer of values added to a shared t-digest, and not yet
+ * flushed into the shared state. The values are collected in a regular
+ * aggregate state, and merged into the shared digest (after compacting
+ * it locally) when the buffer fills, or when the transaction commits.
+ */
+typedef struct tdigest_shm_local_t {
+	char		name[NAMEDATALEN];	/* name of the digest */
+	int			slot;				/* entry in shared memory */
+	uint64		generation;			/* generation of the entry */
+	tdigest_aggstate_t *state;		/* pending values (or NULL) */
+} tdigest_shm_local_t;
+
+#define TDIGEST_SHM_ENTRY_SIZE(compression) \
+	(MAXALIGN(sizeof(tdigest_shm_entry_t)) + \
+	 MAXALIGN(sizeof(centroid_t) * BUFFER_SIZE(compression)))
+
+#define TDIGEST_SHM_ENTRY(slot) \
+	((tdigest_shm_entry_t *) ((char *) tdigest_shm + \
+							  MAXALIGN(sizeof(tdigest_shm_t)) + \
+							  (slot) * tdigest_shm->entry_size))
+
+#define TDIGEST_SHM_REGISTRY_LOCK	(&tdigest_shm->locks[0].lock)
+#define TDIGEST_SHM_ENTRY_LOCK(slot)	(&tdigest_shm->locks[(slot) + 1].lock)
+
+static tdigest_shm_t *tdigest_shm = NULL;
+
+static tdigest_shm_local_t *tdigest_shm_local = NULL;
+static int	tdigest_shm_nlocal = 0;
+static MemoryContext tdigest_shm_context = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+void		_PG_init(void);
+
+static void tdigest_shm_request(void);
+static void tdigest_shm_startup(void);
+
 /* prototypes */
 PG_FUNCTION_INFO_V1(tdigest_add_double_array);
 PG_FUNCTION_INFO_V1(tdigest_add_double_array_count);
@@ -134,6 +417,7 @@ PG_FUNCTION_INFO_V1(tdigest_digest);
 PG_FUNCTION_INFO_V1(tdigest_serial);
 PG_FUNCTION_INFO_V1(tdigest_deserial);
 PG_FUNCTION_INFO_V1(tdigest_combine);
+PG_FUNCTION_INFO_V1(tdigest_add_digest_compression);
 
 PG_FUNCTION_INFO_V1(tdigest_in);
 PG_FUNCTION_INFO_V1(tdigest_out);
@@ -141,6 +425,10 @@ PG_FUNCTION_INFO_V1(tdigest_send);
 PG_FUNCTION_INFO_V1(tdigest_recv);
 
 PG_FUNCTION_INFO_V1(tdigest_count);
+PG_FUNCTION_INFO_V1(tdigest_min);
+PG_FUNCTION_INFO_V1(tdigest_max);
+PG_FUNCTION_INFO_V1(tdigest_mean);
+PG_FUNCTION_INFO_V1(tdigest_sum);
 PG_FUNCTION_INFO_V1(tdigest_to_json);
 PG_FUNCTION_INFO_V1(tdigest_to_array);
 
@@ -155,8 +443,53 @@ PG_FUNCTION_INFO_V1(tdigest_add_digest_count_trimmed);
 PG_FUNCTION_INFO_V1(tdigest_trimmed_avg);
 PG_FUNCTION_INFO_V1(tdigest_trimmed_sum);
 
+PG_FUNCTION_INFO_V1(tdigest_add_double_trimmed_array);
+PG_FUNCTION_INFO_V1(tdigest_add_digest_trimmed_array);
+PG_FUNCTION_INFO_V1(tdigest_trimmed_array_avg);
+PG_FUNCTION_INFO_V1(tdigest_trimmed_array_sum);
+
 PG_FUNCTION_INFO_V1(tdigest_digest_sum);
 PG_FUNCTION_INFO_V1(tdigest_digest_avg);
+PG_FUNCTION_INFO_V1(tdigest_digest_array_sum);
+PG_FUNCTION_INFO_V1(tdigest_digest_array_avg);
+
+PG_FUNCTION_INFO_V1(tdigest_digest_percentile);
+PG_FUNCTION_INFO_V1(tdigest_digest_percentiles);
+PG_FUNCTION_INFO_V1(tdigest_digest_percentile_of);
+PG_FUNCTION_INFO_V1(tdigest_digest_percentiles_of);
+PG_FUNCTION_INFO_V1(tdigest_digests_percentile);
+PG_FUNCTION_INFO_V1(tdigest_digests_percentiles);
+PG_FUNCTION_INFO_V1(tdigest_cdf);
+PG_FUNCTION_INFO_V1(tdigest_histogram);
+PG_FUNCTION_INFO_V1(tdigest_summary);
+PG_FUNCTION_INFO_V1(tdigest_from_arrays);
+PG_FUNCTION_INFO_V1(tdigest_from_histogram);
+PG_FUNCTION_INFO_V1(tdigest_decay);
+PG_FUNCTION_INFO_V1(tdigest_recompress);
+PG_FUNCTION_INFO_V1(tdigest_subtract);
+
+PG_FUNCTION_INFO_V1(tdigest_window_in);
+PG_FUNCTION_INFO_V1(tdigest_window_out);
+PG_FUNCTION_INFO_V1(tdigest_window_send);
+PG_FUNCTION_INFO_V1(tdigest_window_recv);
+PG_FUNCTION_INFO_V1(tdigest_window_create);
+PG_FUNCTION_INFO_V1(tdigest_window_add);
+PG_FUNCTION_INFO_V1(tdigest_window_advance);
+PG_FUNCTION_INFO_V1(tdigest_window_digest);
+
+PG_FUNCTION_INFO_V1(tdigest_ordered_percentiles);
+PG_FUNCTION_INFO_V1(tdigest_ordered_array_percentiles);
+PG_FUNCTION_INFO_V1(tdigest_ordered_percentiles_of);
+PG_FUNCTION_INFO_V1(tdigest_ordered_array_percentiles_of);
+PG_FUNCTION_INFO_V1(tdigest_ordered_trimmed_avg);
+PG_FUNCTION_INFO_V1(tdigest_ordered_trimmed_sum);
+
+PG_FUNCTION_INFO_V1(tdigest_stats_info);
+PG_FUNCTION_INFO_V1(tdigest_stats_reset);
+
+PG_FUNCTION_INFO_V1(tdigest_shm_add);
+PG_FUNCTION_INFO_V1(tdigest_shm_get);
+PG_FUNCTION_INFO_V1(tdigest_shm_drop);
 
 Datum tdigest_add_double_array(PG_FUNCTION_ARGS);
 Datum tdigest_add_double_array_count(PG_FUNCTION_ARGS);
@@ -182,6 +515,7 @@ Datum tdigest_digest(PG_FUNCTION_ARGS);
 Datum tdigest_serial(PG_FUNCTION_ARGS);
 Datum tdigest_deserial(PG_FUNCTION_ARGS);
 Datum tdigest_combine(PG_FUNCTION_ARGS);
+Datum tdigest_add_digest_compression(PG_FUNCTION_ARGS);
 
 Datum tdigest_in(PG_FUNCTION_ARGS);
 Datum tdigest_out(PG_FUNCTION_ARGS);
@@ -189,6 +523,10 @@ Datum tdigest_send(PG_FUNCTION_ARGS);
 Datum tdigest_recv(PG_FUNCTION_ARGS);
 
 Datum tdigest_count(PG_FUNCTION_ARGS);
+Datum tdigest_min(PG_FUNCTION_ARGS);
+Datum tdigest_max(PG_FUNCTION_ARGS);
+Datum tdigest_mean(PG_FUNCTION_ARGS);
+Datum tdigest_sum(PG_FUNCTION_ARGS);
 
 Datum tdigest_add_double_increment(PG_FUNCTION_ARGS);
 Datum tdigest_add_double_array_increment(PG_FUNCTION_ARGS);
@@ -204,11 +542,150 @@ Datum tdigest_add_digest_count_trimmed(PG_FUNCTION_ARGS);
 Datum tdigest_trimmed_avg(PG_FUNCTION_ARGS);
 Datum tdigest_trimmed_sum(PG_FUNCTION_ARGS);
 
+Datum tdigest_add_double_trimmed_array(PG_FUNCTION_ARGS);
+Datum tdigest_add_digest_trimmed_array(PG_FUNCTION_ARGS);
+Datum tdigest_trimmed_array_avg(PG_FUNCTION_ARGS);
+Datum tdigest_trimmed_array_sum(PG_FUNCTION_ARGS);
+
 Datum tdigest_digest_sum(PG_FUNCTION_ARGS);
 Datum tdigest_digest_avg(PG_FUNCTION_ARGS);
+Datum tdigest_digest_array_sum(PG_FUNCTION_ARGS);
+Datum tdigest_digest_array_avg(PG_FUNCTION_ARGS);
+
+Datum tdigest_digest_percentile(PG_FUNCTION_ARGS);
+Datum tdigest_digest_percentiles(PG_FUNCTION_ARGS);
+Datum tdigest_digest_percentile_of(PG_FUNCTION_ARGS);
+Datum tdigest_digest_percentiles_of(PG_FUNCTION_ARGS);
+Datum tdigest_digests_percentile(PG_FUNCTION_ARGS);
+Datum tdigest_digests_percentiles(PG_FUNCTION_ARGS);
+Datum tdigest_cdf(PG_FUNCTION_ARGS);
+Datum tdigest_histogram(PG_FUNCTION_ARGS);
+Datum tdigest_summary(PG_FUNCTION_ARGS);
+Datum tdigest_from_arrays(PG_FUNCTION_ARGS);
+Datum tdigest_from_histogram(PG_FUNCTION_ARGS);
+Datum tdigest_decay(PG_FUNCTION_ARGS);
+Datum tdigest_recompress(PG_FUNCTION_ARGS);
+Datum tdigest_subtract(PG_FUNCTION_ARGS);
+
+Datum tdigest_window_in(PG_FUNCTION_ARGS);
+Datum tdigest_window_out(PG_FUNCTION_ARGS);
+Datum tdigest_window_send(PG_FUNCTION_ARGS);
+Datum tdigest_window_recv(PG_FUNCTION_ARGS);
+Datum tdigest_window_create(PG_FUNCTION_ARGS);
+Datum tdigest_window_add(PG_FUNCTION_ARGS);
+Datum tdigest_window_advance(PG_FUNCTION_ARGS);
+Datum tdigest_window_digest(PG_FUNCTION_ARGS);
+
+Datum tdigest_ordered_percentiles(PG_FUNCTION_ARGS);
+Datum tdigest_ordered_array_percentiles(PG_FUNCTION_ARGS);
+Datum tdigest_ordered_percentiles_of(PG_FUNCTION_ARGS);
+Datum tdigest_ordered_array_percentiles_of(PG_FUNCTION_ARGS);
+Datum tdigest_ordered_trimmed_avg(PG_FUNCTION_ARGS);
+Datum tdigest_ordered_trimmed_sum(PG_FUNCTION_ARGS);
+
+Datum tdigest_stats_info(PG_FUNCTION_ARGS);
+Datum tdigest_stats_reset(PG_FUNCTION_ARGS);
+
+Datum tdigest_shm_add(PG_FUNCTION_ARGS);
+Datum tdigest_shm_get(PG_FUNCTION_ARGS);
+Datum tdigest_shm_drop(PG_FUNCTION_ARGS);
 
 static Datum double_to_array(FunctionCallInfo fcinfo, double * d, int len);
 static double *array_to_double(FunctionCallInfo fcinfo, ArrayType *v, int * len);
+static Datum *array_to_tdigests(FunctionCallInfo fcinfo, ArrayType *v,
+								bool **nulls, int *len);
+static int64 *array_to_int64(FunctionCallInfo fcinfo, ArrayType *v, int * len);
+static double *array_to_trim_bands(FunctionCallInfo fcinfo, ArrayType *low,
+								   ArrayType *high, int *nbands);
+static Datum trimmed_bands_to_array(FunctionCallInfo fcinfo, double *sums,
+									int64 *counts, int nbands, bool avg);
+
+/*
+ * Module load callback, defines the custom GUCs. When loaded using
+ * shared_preload_libraries, also requests shared memory for the shared
+ * t-digests.
+ */
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("tdigest.exact_threshold",
+							"Maximum number of distinct values kept exactly by the aggregates.",
+							"Aggregates keep exact (value, count) lists until the number of "
+							"distinct values exceeds this threshold (or half the buffer size), "
+							"and calculate exact percentiles. Zero disables the exact mode.",
+							&tdigest_exact_threshold,
+							0,
+							0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("tdigest.deduplicate",
+							 "Deduplicate values added to aggregates using a hash table.",
+							 "Repeated values are collapsed into (value, count) pairs before "
+							 "being added to the t-digest, which reduces sorting for data with "
+							 "many duplicate values.",
+							 &tdigest_deduplicate,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("tdigest.track_stats",
+							 "Collects statistics about t-digest compactions, sorts, etc.",
+							 "The statistics are per-backend, and may be inspected using "
+							 "the tdigest_stats() function.",
+							 &tdigest_track_stats,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/* the shared t-digests need shared memory allocated at startup */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("tdigest.shm_max_digests",
+							"Maximum number of shared t-digests.",
+							"Each shared t-digest uses a fixed amount of shared memory, "
+							"depending on tdigest.shm_compression.",
+							&tdigest_shm_max_digests,
+							16,
+							0, 10000,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("tdigest.shm_compression",
+							"Compression of the shared t-digests.",
+							NULL,
+							&tdigest_shm_compression,
+							100,
+							MIN_COMPRESSION, MAX_COMPRESSION,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = tdigest_shm_request;
+#else
+	tdigest_shm_request();
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = tdigest_shm_startup;
+}
 
 /* basic checks on the t-digest (proper sum of counts, ...) */
 static void
@@ -218,7 +695,13 @@ AssertCheckTDigest(tdigest_t *digest)
 	int	i;
 	int64	cnt;
 
-	Assert(digest->flags == 0 || digest->flags == TDIGEST_STORES_MEAN);
+	Assert((digest->flags & ~TDIGEST_VALID_FLAGS) == 0);
+	Assert(!(digest->flags & TDIGEST_COMPACTED) ||
+		   (digest->flags & TDIGEST_STORES_MEAN));
+
+	/* in-memory digests always have the extended header */
+	Assert(digest->flags & TDIGEST_STORES_MEAN);
+	Assert(digest->flags & TDIGEST_HAS_STATS);
 
 	Assert((digest->compression >= MIN_COMPRESSION) &&
 		   (digest->compression <= MAX_COMPRESSION));
@@ -226,12 +709,21 @@ AssertCheckTDigest(tdigest_t *digest)
 	Assert(digest->ncentroids >= 0);
 	Assert(digest->ncentroids <= BUFFER_SIZE(digest->compression));
 
+	/* compacted digests leave space in the buffer */
+	Assert(!(digest->flags & TDIGEST_COMPACTED) ||
+		   (digest->ncentroids < BUFFER_SIZE(digest->compression)));
+
 	cnt = 0;
 	for (i = 0; i < digest->ncentroids; i++)
 	{
 		Assert(digest->centroids[i].count > 0);
 		Assert(!isnan(digest->centroids[i].mean));
 		cnt += digest->centroids[i].count;
+
+		/* compacted digests have to be sorted */
+		Assert(!(digest->flags & TDIGEST_COMPACTED) || (i == 0) ||
+			   (digest->centroids[i-1].mean <= digest->centroids[i].mean));
+
 		/* FIXME also check this does work with the scale function */
 	}
 
@@ -262,7 +754,11 @@ AssertCheckTDigestAggState(tdigest_aggstate_t *state)
 		   (state->compression <= MAX_COMPRESSION));
 
 	Assert(state->ncentroids >= 0);
-	Assert(state->ncentroids <= BUFFER_SIZE(state->compression));
+	Assert(state->ncentroids <= state->nallocated);
+	Assert(state->nallocated <= BUFFER_SIZE(state->compression));
+
+	Assert((state->exact_threshold >= 0) &&
+		   (state->exact_threshold <= MAX_EXACT_THRESHOLD(state->compression)));
 
 	cnt = 0;
 	for (i = 0; i < state->ncentroids; i++)
@@ -295,6 +791,128 @@ reverse_centroids(centroid_t *centroids, int ncentroids)
 	}
 }
 
+/*
+ * Merge two sorted runs of centroids (src[start..mid) and src[mid..end))
+ * into the dst array (at the same positions).
+ */
+static void
+merge_centroids(centroid_t *src, centroid_t *dst, int start, int mid, int end)
+{
+	int	i = start,
+		j = mid,
+		k = start;
+
+	while ((i < mid) && (j < end))
+	{
+		if (centroid_cmp(&src[i], &src[j]) <= 0)
+			dst[k++] = src[i++];
+		else
+			dst[k++] = src[j++];
+	}
+
+	while (i < mid)
+		dst[k++] = src[i++];
+
+	while (j < end)
+		dst[k++] = src[j++];
+}
+
+/*
+ * Sort centroids by (mean, count), taking advantage of existing order.
+ *
+ * The buffer often consists of a couple natural runs - e.g. compacted
+ * centroids followed by values added in ascending or descending order
+ * (data read from an index, time series, ...). We look for such runs,
+ * reverse the descending ones and merge them, which is much cheaper
+ * than a regular sort. If there are too many runs (e.g. random data), we
+ * simply fall back to qsort.
+ */
+static void
+sort_centroids(centroid_t *centroids, int ncentroids)
+{
+	int			runs[SORT_MAX_RUNS + 1];
+	int			nruns = 0;
+	int			start = 0;
+	centroid_t *src,
+			   *dst;
+
+	while (start < ncentroids)
+	{
+		int	end = start + 1;
+
+		/* too many runs, just do a regular sort */
+		if (nruns == SORT_MAX_RUNS)
+		{
+			pg_qsort(centroids, ncentroids, sizeof(centroid_t), centroid_cmp);
+			return;
+		}
+
+		if ((end < ncentroids) &&
+			(centroid_cmp(&centroids[start], &centroids[end]) > 0))
+		{
+			/* descending run, reverse it (equal centroids are identical) */
+			while ((end < ncentroids) &&
+				   (centroid_cmp(&centroids[end - 1], &centroids[end]) >= 0))
+				end++;
+
+			reverse_centroids(&centroids[start], end - start);
+		}
+		else
+		{
+			while ((end < ncentroids) &&
+				   (centroid_cmp(&centroids[end - 1], &centroids[end]) <= 0))
+				end++;
+		}
+
+		runs[nruns++] = start;
+		start = end;
+	}
+
+	/* already sorted (or a single reversed run) */
+	if (nruns <= 1)
+		return;
+
+	runs[nruns] = ncentroids;
+
+	/* merge pairs of adjacent runs, until there's a single run */
+	src = centroids;
+	dst = palloc(sizeof(centroid_t) * ncentroids);
+
+	while (nruns > 1)
+	{
+		int			i;
+		int			n = 0;
+		centroid_t *tmp;
+
+		for (i = 0; i < nruns; i += 2)
+		{
+			if (i + 1 < nruns)
+				merge_centroids(src, dst, runs[i], runs[i + 1], runs[i + 2]);
+			else
+				memcpy(&dst[runs[i]], &src[runs[i]],
+					   sizeof(centroid_t) * (runs[i + 1] - runs[i]));
+
+			runs[n++] = runs[i];
+		}
+
+		runs[n] = ncentroids;
+		nruns = n;
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	/* the result is in src, copy it into the buffer if needed */
+	if (src != centroids)
+	{
+		memcpy(centroids, src, sizeof(centroid_t) * ncentroids);
+		pfree(src);
+	}
+	else
+		pfree(dst);
+}
+
 static void
 rebalance_centroids(centroid_t *centroids, int ncentroids,
 					int64 weight_before, int64 weight_after)
@@ -339,6 +957,21 @@ rebalance_centroids(centroid_t *centroids, int ncentroids,
 }
 
 
+/*
+ * Account for a sort of the centroid buffer, started at start_time.
+ */
+static void
+tdigest_stats_sort(int ncentroids, instr_time start_time)
+{
+	instr_time	end_time;
+
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_ACCUM_DIFF(tdigest_stats.sort_time, end_time, start_time);
+
+	tdigest_stats.sorts++;
+	tdigest_stats.sorted += ncentroids;
+}
+
 /*
  * Sort centroids in the digest.
  *
@@ -353,10 +986,16 @@ tdigest_sort(tdigest_aggstate_t *state)
 	int64	next_group;
 	int64	median_count;
 
-	/* do qsort on the non-sorted part */
-	pg_qsort(state->centroids,
-			 state->ncentroids,
-			 sizeof(centroid_t), centroid_cmp);
+	instr_time	start_time;
+
+	/* make sure all the values are in the centroid buffer */
+	tdigest_flush_hash(state);
+
+	if (tdigest_track_stats)
+		INSTR_TIME_SET_CURRENT(start_time);
+
+	/* sort the centroids, using any natural runs in the buffer */
+	sort_centroids(state->centroids, state->ncentroids);
 
 	/*
 	 * The centroids are sorted by (mean,count). That's fine for centroids up
@@ -411,6 +1050,80 @@ tdigest_sort(tdigest_aggstate_t *state)
 		i = j;
 		count_so_far = next_group;
 	}
+
+	if (tdigest_track_stats)
+		tdigest_stats_sort(state->ncentroids, start_time);
+}
+
+/*
+ * Compaction of a t-digest in the exact mode.
+ *
+ * Sorts the centroids and merges centroids with the same value, which does
+ * not lose any information. If the number of distinct values still fits
+ * into the threshold, the state remains in the exact mode and we're done.
+ * Otherwise we leave the exact mode, and the caller has to do the regular
+ * compaction.
+ *
+ * Returns true if the state remains in the exact mode.
+ */
+static bool
+tdigest_compact_exact(tdigest_aggstate_t *state)
+{
+	int		i;
+	int		n;
+
+	instr_time	start_time;
+
+	Assert(state->exact_threshold > 0);
+
+	if (tdigest_track_stats)
+		INSTR_TIME_SET_CURRENT(start_time);
+
+	sort_centroids(state->centroids, state->ncentroids);
+
+	if (tdigest_track_stats)
+		tdigest_stats_sort(state->ncentroids, start_time);
+
+	n = 0;
+	for (i = 0; i < state->ncentroids; i++)
+	{
+		if ((n > 0) && (state->centroids[n-1].mean == state->centroids[i].mean))
+		{
+			state->centroids[n-1].count += state->centroids[i].count;
+			continue;
+		}
+
+		state->centroids[n++] = state->centroids[i];
+	}
+
+	state->ncentroids = n;
+
+	/* too many distinct values, switch to regular compaction */
+	if (state->ncentroids > state->exact_threshold)
+	{
+		state->exact_threshold = 0;
+		state->ncompacted = 0;
+		return false;
+	}
+
+	state->ncompacted = state->ncentroids;
+
+	AssertCheckTDigestAggState(state);
+
+	return true;
+}
+
+/*
+ * Leave the exact mode, so that the next compaction is a regular one.
+ */
+static void
+tdigest_leave_exact(tdigest_aggstate_t *state)
+{
+	if (state->exact_threshold == 0)
+		return;
+
+	state->exact_threshold = 0;
+	state->ncompacted = 0;
 }
 
 /*
@@ -432,7 +1145,7 @@ tdigest_sort(tdigest_aggstate_t *state)
  * [1] https://github.com/ajwerner/tdigestc/blob/master/go/tdigest.c
  */
 static void
-tdigest_compact(tdigest_aggstate_t *state)
+tdigest_compact_centroids(tdigest_aggstate_t *state)
 {
 	int			i;
 
@@ -445,12 +1158,6 @@ tdigest_compact(tdigest_aggstate_t *state)
 	int			step;
 	int			n;
 
-	AssertCheckTDigestAggState(state);
-
-	/* if the digest is fully compacted, it's been already compacted */
-	if (state->ncompacted == state->ncentroids)
-		return;
-
 	tdigest_sort(state);
 
 	state->ncompactions++;
@@ -542,100 +1249,236 @@ tdigest_compact(tdigest_aggstate_t *state)
 }
 
 /*
- * Estimate requested quantiles from the t-digest agg state.
+ * Compact the t-digest, unless it's already compacted. In the exact mode
+ * we only merge centroids with the same value (if possible).
  */
 static void
-tdigest_compute_quantiles(tdigest_aggstate_t *state, double *result)
+tdigest_compact(tdigest_aggstate_t *state)
 {
-	int			i, j;
+	instr_time	start_time;
 
-	AssertCheckTDigestAggState(state);
+	/* make sure all the values are in the centroid buffer */
+	tdigest_flush_hash(state);
 
-	/*
-	 * Trigger a compaction, which also sorts the data.
-	 *
-	 * XXX maybe just do a sort here, which should give us a bit more accurate
-	 * results, probably.
-	 */
-	tdigest_compact(state);
+	AssertCheckTDigestAggState(state);
 
-	for (i = 0; i < state->npercentiles; i++)
-	{
-		double	count;
-		double	delta;
-		double	goal = (state->percentiles[i] * state->count);
-		bool	on_the_right;
-		centroid_t *prev, *next;
-		centroid_t *c = NULL;
-		double	slope;
+	/* if the digest is fully compacted, it's been already compacted */
+	if (state->ncompacted == state->ncentroids)
+		return;
 
-		/* first centroid for percentile 1.0 */
-		if (state->percentiles[i] == 0.0)
-		{
-			c = &state->centroids[0];
-			result[i] = c->mean;
-			continue;
-		}
+	if (tdigest_track_stats)
+		INSTR_TIME_SET_CURRENT(start_time);
 
-		/* last centroid for percentile 1.0 */
-		if (state->percentiles[i] == 1.0)
-		{
-			c = &state->centroids[state->ncentroids - 1];
-			result[i] = c->mean;
-			continue;
-		}
+	/* in exact mode we only merge duplicate values, if possible */
+	if (!((state->exact_threshold > 0) && tdigest_compact_exact(state)))
+		tdigest_compact_centroids(state);
 
-		/* walk throught the centroids and count number of items */
-		count = 0;
-		for (j = 0; j < state->ncentroids; j++)
-		{
-			c = &state->centroids[j];
+	if (tdigest_track_stats)
+	{
+		instr_time	end_time;
 
-			/* have we exceeded the expected count? */
-			if (count + c->count > goal)
-				break;
+		INSTR_TIME_SET_CURRENT(end_time);
+		INSTR_TIME_ACCUM_DIFF(tdigest_stats.compact_time, end_time, start_time);
+		tdigest_stats.compactions++;
+	}
+}
 
-			/* account for the centroid */
-			count += c->count;
-		}
+/*
+ * Calculate cumulative counts for a sorted array of centroids.
+ */
+static int64 *
+tdigest_cumulative_counts(centroid_t *centroids, int ncentroids)
+{
+	int			i;
+	int64	   *cumulative;
+	int64		count;
 
-		delta = goal - count - (c->count / 2.0);
+	cumulative = (int64 *) palloc(sizeof(int64) * ncentroids);
 
-		/*
-		 * double arithmetics, so don't compare to 0.0 direcly, it's enough
-		 * to be "close enough"
-		 */
-		if (fabs(delta) < 0.000000001)
-		{
-			result[i] = c->mean;
-			continue;
-		}
+	count = 0;
+	for (i = 0; i < ncentroids; i++)
+	{
+		count += centroids[i].count;
+		cumulative[i] = count;
+	}
 
-		on_the_right = (delta > 0.0);
+	return cumulative;
+}
+
+/*
+ * Find the first centroid with cumulative count exceeding the goal, using
+ * a binary search. Returns the last centroid if there's no such centroid.
+ */
+static int
+tdigest_find_centroid(int64 *cumulative, int ncentroids, double goal)
+{
+	int		lo = 0,
+			hi = ncentroids - 1;
+
+	while (lo < hi)
+	{
+		int		mid = lo + (hi - lo) / 2;
+
+		if (cumulative[mid] > goal)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+/*
+ * Find the first centroid with mean greater or equal to the value, using
+ * a binary search. Returns ncentroids if there's no such centroid.
+ */
+static int
+tdigest_find_mean(centroid_t *centroids, int ncentroids, double value)
+{
+	int		lo = 0,
+			hi = ncentroids;
+
+	while (lo < hi)
+	{
+		int		mid = lo + (hi - lo) / 2;
+
+		if (centroids[mid].mean >= value)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+/*
+ * Estimate requested quantiles from a sorted array of centroids.
+ *
+ * The centroids may come either from a compacted aggregate state, or from
+ * a t-digest marked as compacted (in which case we don't need to copy the
+ * centroids anywhere, we simply use them directly).
+ *
+ * We compute cumulative counts for the centroids first, so that we can find
+ * the centroid for each percentile using a binary search. That's cheaper
+ * than walking the centroids from the beginning for each percentile.
+ *
+ * The min/max values are used to interpolate on the tails, i.e. in the
+ * outer halves of the first/last centroid.
+ */
+static void
+tdigest_quantiles(centroid_t *centroids, int ncentroids, int64 total_count,
+				  double min, double max,
+				  double *percentiles, int npercentiles, double *result)
+{
+	int64	   *cumulative;
+
+	Assert(ncentroids > 0);
+
+	cumulative = tdigest_cumulative_counts(centroids, ncentroids);
+
+	tdigest_quantiles_cumulative(centroids, cumulative, ncentroids,
+								 total_count, min, max,
+								 percentiles, npercentiles, result);
+
+	pfree(cumulative);
+}
+
+/*
+ * Estimate requested quantiles from a sorted array of centroids, with the
+ * cumulative counts already calculated (e.g. cached by the caller).
+ */
+static void
+tdigest_quantiles_cumulative(centroid_t *centroids, int64 *cumulative,
+							 int ncentroids, int64 total_count,
+							 double min, double max,
+							 double *percentiles, int npercentiles,
+							 double *result)
+{
+	int			i, j;
+
+	Assert(ncentroids > 0);
+
+	/*
+	 * The extremes can't be inside the first/last centroid (but the mean
+	 * of a centroid may be off a bit due to rounding errors).
+	 */
+	min = Min(min, centroids[0].mean);
+	max = Max(max, centroids[ncentroids - 1].mean);
+
+	for (i = 0; i < npercentiles; i++)
+	{
+		double	count;
+		double	delta;
+		double	goal = (percentiles[i] * total_count);
+		bool	on_the_right;
+		centroid_t *prev, *next;
+		centroid_t *c = NULL;
+		double	slope;
+
+		/* minimum for percentile 0.0 */
+		if (percentiles[i] == 0.0)
+		{
+			result[i] = min;
+			continue;
+		}
+
+		/* maximum for percentile 1.0 */
+		if (percentiles[i] == 1.0)
+		{
+			result[i] = max;
+			continue;
+		}
 
 		/*
-		 * for extreme percentiles we might end on the right of the last node or on the
-		 * left of the first node, instead of interpolating we return the mean of the node
+		 * Find the first centroid where the cumulative count exceeds the
+		 * goal, and the number of items in the preceding centroids.
+		 */
+		j = tdigest_find_centroid(cumulative, ncentroids, goal);
+		c = &centroids[j];
+		count = (cumulative[j] - c->count);
+
+		delta = goal - count - (c->count / 2.0);
+
+		/*
+		 * double arithmetics, so don't compare to 0.0 direcly, it's enough
+		 * to be "close enough"
 		 */
-		if ((on_the_right && (j+1) >= state->ncentroids) ||
-			(!on_the_right && (j-1) < 0))
+		if (fabs(delta) < 0.000000001)
 		{
 			result[i] = c->mean;
 			continue;
 		}
 
+		on_the_right = (delta > 0.0);
+
+		/*
+		 * for extreme percentiles we might end on the right of the last node or on the
+		 * left of the first node, in which case we interpolate between the mean of the
+		 * node and the max/min value (the delta is a fraction of the half-centroid)
+		 */
+		if (on_the_right && (j+1) >= ncentroids)
+		{
+			result[i] = c->mean + (max - c->mean) * delta / (c->count / 2.0);
+			continue;
+		}
+		else if (!on_the_right && (j-1) < 0)
+		{
+			result[i] = c->mean + (c->mean - min) * delta / (c->count / 2.0);
+			continue;
+		}
+
 		if (on_the_right)
 		{
-			prev = &state->centroids[j];
-			AssertBounds(j+1, state->ncentroids);
-			next = &state->centroids[j+1];
+			prev = &centroids[j];
+			AssertBounds(j+1, ncentroids);
+			next = &centroids[j+1];
 			count += (prev->count / 2.0);
 		}
 		else
 		{
-			AssertBounds(j-1, state->ncentroids);
-			prev = &state->centroids[j-1];
-			next = &state->centroids[j];
+			AssertBounds(j-1, ncentroids);
+			prev = &centroids[j-1];
+			next = &centroids[j];
 			count -= (prev->count / 2.0);
 		}
 
@@ -646,1275 +1489,4505 @@ tdigest_compute_quantiles(tdigest_aggstate_t *state, double *result)
 }
 
 /*
- * Estimate inverse of quantile given a value from the t-digest agg state.
+ * Calculate exact quantiles from a sorted array of distinct values (with
+ * counts), i.e. from an aggregate state in the exact mode.
  *
- * Essentially an inverse to tdigest_compute_quantiles.
+ * The result is interpolated between the two closest values, the same way
+ * as percentile_cont() does it.
  */
 static void
-tdigest_compute_quantiles_of(tdigest_aggstate_t *state, double *result)
+tdigest_quantiles_exact(centroid_t *centroids, int ncentroids, int64 total_count,
+						double *percentiles, int npercentiles, double *result)
 {
-	int			i;
+	int			i, j;
+	int64	   *cumulative;
 
-	AssertCheckTDigestAggState(state);
+	Assert(ncentroids > 0);
 
-	/*
-	 * Trigger a compaction, which also sorts the data.
-	 *
-	 * XXX maybe just do a sort here, which should give us a bit more accurate
-	 * results, probably.
-	 */
-	tdigest_compact(state);
+	cumulative = tdigest_cumulative_counts(centroids, ncentroids);
 
-	for (i = 0; i < state->nvalues; i++)
+	for (i = 0; i < npercentiles; i++)
 	{
-		int			j;
-		double		count;
-		centroid_t *c = NULL;
-		centroid_t *prev;
-		double		value = state->values[i];
-		double		m, x;
+		double	pos = percentiles[i] * (total_count - 1);
+		double	rank = floor(pos);
+		double	value,
+				next;
 
-		count = 0;
-		for (j = 0; j < state->ncentroids; j++)
-		{
-			c = &state->centroids[j];
+		/* value with the (0-based) rank, and the value right after it */
+		j = tdigest_find_centroid(cumulative, ncentroids, rank);
+		value = next = centroids[j].mean;
 
-			if (c->mean >= value)
-				break;
+		if ((cumulative[j] <= rank + 1) && (j + 1 < ncentroids))
+			next = centroids[j + 1].mean;
 
-			count += c->count;
-		}
+		result[i] = value + (pos - rank) * (next - value);
+	}
+
+	pfree(cumulative);
+}
+
+/*
+ * Find value with the given (0-based) rank in an unsorted array of centroids,
+ * with the rank considering the centroid counts.
+ *
+ * This is a simple quickselect, with a three-way partitioning so that it
+ * handles duplicate values (which may be in multiple centroids) correctly.
+ * The centroids get reordered, but the array is not sorted.
+ */
+static double
+tdigest_select(centroid_t *centroids, int ncentroids, int64 rank)
+{
+	int		lo = 0,
+			hi = ncentroids;
+
+	Assert(ncentroids > 0);
 
-		/* the value exactly matches the mean */
-		if (value == c->mean)
+	while (true)
+	{
+		int		lt = lo,
+				gt = hi,
+				i = lo;
+		int64	count_lt = 0,
+				count_eq = 0;
+		double	a = centroids[lo].mean,
+				b = centroids[lo + (hi - lo) / 2].mean,
+				c = centroids[hi - 1].mean;
+		double	pivot;
+
+		/* median of three, so that sorted input is not the worst case */
+		if ((a < b) == (b < c))
+			pivot = b;
+		else if ((b < a) == (a < c))
+			pivot = a;
+		else
+			pivot = c;
+
+		/* [lo,lt) < pivot, [lt,i) == pivot, [gt,hi) > pivot */
+		while (i < gt)
 		{
-			int64	count_at_value = 0;
+			centroid_t	tmp = centroids[i];
 
-			/*
-			 * There may be multiple centroids with this mean (i.e. containing
-			 * this value), so find all of them and sum their weights.
-			 */
-			while ((j < state->ncentroids) && (state->centroids[j].mean == value))
+			if (tmp.mean < pivot)
 			{
-				count_at_value += state->centroids[j].count;
-				j++;
+				count_lt += tmp.count;
+				centroids[i++] = centroids[lt];
+				centroids[lt++] = tmp;
+			}
+			else if (tmp.mean > pivot)
+			{
+				centroids[i] = centroids[--gt];
+				centroids[gt] = tmp;
+			}
+			else
+			{
+				count_eq += tmp.count;
+				i++;
 			}
-
-			result[i] = (count + (count_at_value / 2.0)) / state->count;
-			continue;
-		}
-		else if (value > c->mean)	/* past the largest */
-		{
-			result[i] = 1;
-			continue;
 		}
-		else if (j == 0)			/* past the smallest */
+
+		if (rank < count_lt)
+			hi = lt;
+		else if (rank < count_lt + count_eq)
+			return pivot;
+		else
 		{
-			result[i] = 0;
-			continue;
+			rank -= (count_lt + count_eq);
+			lo = gt;
 		}
 
-		/*
-		 * The value lies somewhere between two centroids. We want to figure out
-		 * where along the line from the prev node to this node the value is.
-		 *
-		 * FIXME What if there are multiple centroids with the same mean as the
-		 * prev/curr centroid? This probably needs to lookup all of them and sum
-		 * their counts, just like we did in case of the exact match, no?
-		 */
-		prev = c - 1;
-		count -= (prev->count / 2);
-
-		/*
-		 * We assume for both prev/curr centroid, half the count is on left/righ,
-		 * so between them we have (prev->count/2 + curr->count/2). At zero we
-		 * are in prev->mean and at (prev->count/2 + curr->count/2) we're at
-		 * curr->mean.
-		 */
-		m = (c->mean - prev->mean) / (c->count / 2.0 + prev->count / 2.0);
-		x = (value - prev->mean) / m;
-
-		result[i] = (double) (count + x) / state->count;
+		AssertBounds(lo, hi);
 	}
 }
 
-
-/* add a value to the t-digest, trigger a compaction if full */
+/*
+ * Calculate exact quantiles from an unsorted array of centroids, i.e. from
+ * an aggregate state in the exact mode, using selection instead of sorting.
+ *
+ * Produces the same results as tdigest_quantiles_exact, but each percentile
+ * needs two linear passes (on average), so it's only worth it for a small
+ * number of percentiles.
+ */
 static void
-tdigest_add(tdigest_aggstate_t *state, double v)
+tdigest_quantiles_select(centroid_t *centroids, int ncentroids, int64 total_count,
+						 double *percentiles, int npercentiles, double *result)
 {
-	int	compression = state->compression;
+	int			i;
 
-	/*
-	 * If the buffer is full, trigger compaction here so that we have
-	 * free space for the new value.
-	 */
-	if (state->ncentroids == BUFFER_SIZE(compression))
-		tdigest_compact(state);
+	Assert(ncentroids > 0);
 
-	/* make sure we have space for the value */
-	Assert(state->ncentroids < BUFFER_SIZE(compression));
+	for (i = 0; i < npercentiles; i++)
+	{
+		double	pos = percentiles[i] * (total_count - 1);
+		double	rank = floor(pos);
+		double	value,
+				next;
 
-	/* for a single point, the value is both sum and mean */
-	state->centroids[state->ncentroids].count = 1;
-	state->centroids[state->ncentroids].mean = v;
-	state->ncentroids++;
-	state->count++;
+		/* value with the (0-based) rank, and the value right after it */
+		value = next = tdigest_select(centroids, ncentroids, (int64) rank);
+
+		if ((pos > rank) && (rank + 1 < total_count))
+			next = tdigest_select(centroids, ncentroids, (int64) rank + 1);
+
+		result[i] = value + (pos - rank) * (next - value);
+	}
 }
 
 /*
- * Add a centroid (possibly with count not equal to 1) to the t-digest,
- * triggers a compaction when buffer full.
+ * Estimate requested quantiles from the t-digest agg state.
  */
 static void
-tdigest_add_centroid(tdigest_aggstate_t *state, double mean, int64 count)
+tdigest_compute_quantiles(tdigest_aggstate_t *state, double *percentiles,
+						  int npercentiles, double *result)
 {
-	int	compression = state->compression;
+	AssertCheckTDigestAggState(state);
+
+	/* make sure all the values are in the centroid buffer */
+	tdigest_flush_hash(state);
 
 	/*
-	 * If the buffer is full, trigger compaction here so that we have
-	 * free space for the new value.
+	 * In the exact mode, with only a couple percentiles, we may use selection
+	 * instead of sorting the buffer. But only when the buffer is mostly
+	 * unsorted, and when it can't have more distinct values than allowed by
+	 * the threshold (the compaction might switch to regular t-digest, and we
+	 * need to produce the same results).
 	 */
-	if (state->ncentroids == BUFFER_SIZE(compression))
-		tdigest_compact(state);
+	if ((state->exact_threshold > 0) &&
+		(npercentiles <= SELECT_MAX_PERCENTILES) &&
+		(state->ncentroids <= state->exact_threshold) &&
+		(state->ncompacted < state->ncentroids / 2))
+	{
+		tdigest_quantiles_select(state->centroids, state->ncentroids,
+								 state->count, percentiles,
+								 npercentiles, result);
 
-	/* make sure we have space for the value */
-	Assert(state->ncentroids < BUFFER_SIZE(compression));
+		/* the selection shuffled the buffer, so it's not sorted anymore */
+		state->ncompacted = 0;
 
-	/* for a single point, the value is both sum and mean */
-	state->centroids[state->ncentroids].count = count;
-	state->centroids[state->ncentroids].mean = mean;
-	state->ncentroids++;
-	state->count += count;
-}
+		return;
+	}
 
-/* allocate t-digest with enough space for a requested number of centroids */
-static tdigest_t *
-tdigest_allocate(int ncentroids)
-{
-	Size		len;
-	tdigest_t  *digest;
-	char	   *ptr;
+	/*
+	 * Trigger a compaction, which also sorts the data.
+	 *
+	 * XXX maybe just do a sort here, which should give us a bit more accurate
+	 * results, probably.
+	 */
+	tdigest_compact(state);
 
-	len = offsetof(tdigest_t, centroids) + ncentroids * sizeof(centroid_t);
+	/* if still in the exact mode, we can calculate exact quantiles */
+	if (state->exact_threshold > 0)
+		tdigest_quantiles_exact(state->centroids, state->ncentroids,
+								state->count, percentiles,
+								npercentiles, result);
+	else
+		tdigest_quantiles(state->centroids, state->ncentroids, state->count,
+						  state->min, state->max,
+						  percentiles, npercentiles, result);
+}
 
-	/* we pre-allocate the array for all centroids and also the buffer for incoming data */
-	ptr = palloc(len);
-	SET_VARSIZE(ptr, len);
+/*
+ * Estimate inverse of quantile for values from a sorted array of centroids.
+ *
+ * Essentially an inverse to tdigest_quantiles, including the interpolation
+ * on the tails using the min/max values.
+ *
+ * Just like in tdigest_quantiles, we compute cumulative counts first, and
+ * then find the centroid for each value using a binary search on means.
+ */
+static void
+tdigest_quantiles_of(centroid_t *centroids, int ncentroids, int64 total_count,
+					 double min, double max,
+					 double *values, int nvalues, double *result)
+{
+	int64	   *cumulative;
 
-	digest = (tdigest_t *) ptr;
+	Assert(ncentroids > 0);
 
-	digest->flags = 0;
-	digest->ncentroids = 0;
-	digest->count = 0;
-	digest->compression = 0;
+	cumulative = tdigest_cumulative_counts(centroids, ncentroids);
 
-	/* new tdigest are automatically storing mean */
-	digest->flags |= TDIGEST_STORES_MEAN;
+	tdigest_quantiles_of_cumulative(centroids, cumulative, ncentroids,
+									total_count, min, max,
+									values, nvalues, result);
 
-	return digest;
+	pfree(cumulative);
 }
 
 /*
- * tdigest_update_format
- *		Update t-digest format to represent centroids as (mean,count).
- *
- * Switches the centroids from (sum,count) to (mean,count), so that all
- * the places processing centroids can use just the new format.
- *
- * If the digest already uses the new format, this is a no-op. Otherwise
- * a modified copy of the digest is returned.
- *
- * XXX This does not affect on-disk representation of existing digests,
- * we create just an in-memory version of the digest. Only when the
- * digest gets modified a new format will be written back.
+ * Estimate inverse of quantile for a value from a sorted array of centroids,
+ * with j being the first centroid with mean not below the value (or the
+ * number of centroids, if there's no such centroid). The min/max have to
+ * be adjusted by the caller, to not be inside the first/last centroid.
  */
-static tdigest_t *
-tdigest_update_format(tdigest_t *digest)
+static double
+tdigest_quantile_of_centroid(centroid_t *centroids, int64 *cumulative,
+							 int ncentroids, int64 total_count,
+							 double min, double max, double value, int j)
 {
-	int		i;
-	int		s;
-	char   *ptr;
+	double		count;
+	centroid_t *c = NULL;
+	centroid_t *prev;
+	double		m, x;
 
-	/* if already new format, we're done */
-	if (digest->flags & TDIGEST_STORES_MEAN)
-		return digest;
+	c = &centroids[Min(j, ncentroids - 1)];
+	count = (j > 0) ? cumulative[j - 1] : 0;
 
-	/*
-	 * We'll convert the digest so that centroids use means, but we must
-	 * not modify the input digest - it might be just a pointer to data
-	 * buffer, or something like that. So we have to create a copy first.
-	 */
-	s = VARSIZE_ANY(digest);
-	ptr = palloc(s);
-	memcpy(ptr, digest, s);
+	/* the value exactly matches the mean */
+	if (value == c->mean)
+	{
+		int64	count_at_value = 0;
 
-	digest = (tdigest_t *) ptr;
+		/*
+		 * There may be multiple centroids with this mean (i.e. containing
+		 * this value), so find all of them and sum their weights.
+		 */
+		while ((j < ncentroids) && (centroids[j].mean == value))
+		{
+			count_at_value += centroids[j].count;
+			j++;
+		}
 
-	/* And now tweak the contents of the copy. */
-	for (i = 0; i < digest->ncentroids; i++)
+		return (count + (count_at_value / 2.0)) / total_count;
+	}
+	else if (value > c->mean)	/* past the largest */
+	{
+		/* interpolate in the right half of the last centroid */
+		if (value < max)
+			return (total_count - c->count / 2.0 +
+					(value - c->mean) / (max - c->mean) * (c->count / 2.0)) / total_count;
+		else
+			return 1;
+	}
+	else if (j == 0)			/* past the smallest */
 	{
-		digest->centroids[i].mean
-			= digest->centroids[i].mean / digest->centroids[i].count;
+		/* interpolate in the left half of the first centroid */
+		if (value > min)
+			return ((value - min) / (c->mean - min) * (c->count / 2.0)) / total_count;
+		else
+			return 0;
 	}
 
-	digest->flags |= TDIGEST_STORES_MEAN;
+	/*
+	 * The value lies somewhere between two centroids. We want to figure out
+	 * where along the line from the prev node to this node the value is.
+	 *
+	 * FIXME What if there are multiple centroids with the same mean as the
+	 * prev/curr centroid? This probably needs to lookup all of them and sum
+	 * their counts, just like we did in case of the exact match, no?
+	 */
+	prev = c - 1;
+	count -= (prev->count / 2);
+
+	/*
+	 * We assume for both prev/curr centroid, half the count is on left/righ,
+	 * so between them we have (prev->count/2 + curr->count/2). At zero we
+	 * are in prev->mean and at (prev->count/2 + curr->count/2) we're at
+	 * curr->mean.
+	 */
+	m = (c->mean - prev->mean) / (c->count / 2.0 + prev->count / 2.0);
+	x = (value - prev->mean) / m;
 
-	return digest;
+	return (double) (count + x) / total_count;
 }
 
 /*
- * allocate a tdigest aggregate state, along with space for percentile(s)
- * and value(s) requested when calling the aggregate function
+ * Estimate inverse of quantile for values from a sorted array of centroids,
+ * with the cumulative counts already calculated (e.g. cached by the caller).
  */
-static tdigest_aggstate_t *
-tdigest_aggstate_allocate(int npercentiles, int nvalues, int compression)
+static void
+tdigest_quantiles_of_cumulative(centroid_t *centroids, int64 *cumulative,
+								int ncentroids, int64 total_count,
+								double min, double max,
+								double *values, int nvalues, double *result)
 {
-	Size				len;
-	tdigest_aggstate_t *state;
-	char			   *ptr;
+	int			i;
 
-	/* at least one of those values is 0 */
-	Assert(nvalues == 0 || npercentiles == 0);
+	Assert(ncentroids > 0);
 
 	/*
-	 * We allocate a single chunk for the struct including percentiles and
-	 * centroids (including extra buffer for new data).
+	 * The extremes can't be inside the first/last centroid (but the mean
+	 * of a centroid may be off a bit due to rounding errors).
 	 */
-	len = MAXALIGN(sizeof(tdigest_aggstate_t)) +
-		  MAXALIGN(sizeof(double) * npercentiles) +
-		  MAXALIGN(sizeof(double) * nvalues) +
-		  (BUFFER_SIZE(compression) * sizeof(centroid_t));
+	min = Min(min, centroids[0].mean);
+	max = Max(max, centroids[ncentroids - 1].mean);
 
-	ptr = palloc0(len);
-
-	state = (tdigest_aggstate_t *) ptr;
-	ptr += MAXALIGN(sizeof(tdigest_aggstate_t));
-
-	state->nvalues = nvalues;
-	state->npercentiles = npercentiles;
-	state->compression = compression;
-
-	if (npercentiles > 0)
+	for (i = 0; i < nvalues; i++)
 	{
-		state->percentiles = (double *) ptr;
-		ptr += MAXALIGN(sizeof(double) * npercentiles);
-	}
+		/*
+		 * Find the first centroid with mean not below the value (or the
+		 * last one, if there's no such centroid), and the number of items
+		 * in the preceding centroids.
+		 */
+		int		j = tdigest_find_mean(centroids, ncentroids, values[i]);
 
-	if (nvalues > 0)
-	{
-		state->values = (double *) ptr;
-		ptr += MAXALIGN(sizeof(double) * nvalues);
+		result[i] = tdigest_quantile_of_centroid(centroids, cumulative,
+												 ncentroids, total_count,
+												 min, max, values[i], j);
 	}
-
-	state->centroids = (centroid_t *) ptr;
-	ptr += (BUFFER_SIZE(compression) * sizeof(centroid_t));
-
-	Assert(ptr == (char *) state + len);
-
-	return state;
 }
 
-static tdigest_t *
-tdigest_aggstate_to_digest(tdigest_aggstate_t *state, bool compact)
+/*
+ * Estimate inverse of quantile for sorted values, in a single sweep over
+ * the centroids (instead of a binary search for each value). The results
+ * are the same as from tdigest_quantiles_of_cumulative.
+ */
+static void
+tdigest_quantiles_of_sorted(centroid_t *centroids, int64 *cumulative,
+							int ncentroids, int64 total_count,
+							double min, double max,
+							double *values, int nvalues, double *result)
 {
 	int			i;
-	tdigest_t  *digest;
-
-	if (compact)
-		tdigest_compact(state);
+	int			j = 0;
 
-	digest = tdigest_allocate(state->ncentroids);
+	Assert(ncentroids > 0);
 
-	digest->count = state->count;
-	digest->ncentroids = state->ncentroids;
-	digest->compression = state->compression;
+	min = Min(min, centroids[0].mean);
+	max = Max(max, centroids[ncentroids - 1].mean);
 
-	for (i = 0; i < state->ncentroids; i++)
+	for (i = 0; i < nvalues; i++)
 	{
-		digest->centroids[i].mean = state->centroids[i].mean;
-		digest->centroids[i].count = state->centroids[i].count;
-	}
+		Assert((i == 0) || (values[i - 1] <= values[i]));
 
-	return digest;
+		/* the first centroid with mean not below the value */
+		while ((j < ncentroids) && (centroids[j].mean < values[i]))
+			j++;
+
+		result[i] = tdigest_quantile_of_centroid(centroids, cumulative,
+												 ncentroids, total_count,
+												 min, max, values[i], j);
+	}
 }
 
-/* check that the requested percentiles are valid */
+/*
+ * Calculate exact relative ranks of values, from a sorted array of distinct
+ * values (with counts), i.e. from an aggregate state in the exact mode.
+ *
+ * Values matching one of the values in the array are considered to be in
+ * the middle of all the occurrences, just like in tdigest_quantiles_of.
+ */
 static void
-check_percentiles(double *percentiles, int npercentiles)
+tdigest_quantiles_of_exact(centroid_t *centroids, int ncentroids, int64 total_count,
+						   double *values, int nvalues, double *result)
 {
-	int i;
+	int			i, j;
 
-	for (i = 0; i < npercentiles; i++)
+	for (i = 0; i < nvalues; i++)
 	{
-		if ((percentiles[i] < 0.0) || (percentiles[i] > 1.0))
-			elog(ERROR, "invalid percentile value %f, should be in [0.0, 1.0]",
-				 percentiles[i]);
-	}
-}
+		double	count = 0;
 
-static void
-check_compression(int compression)
-{
-	if (compression < MIN_COMPRESSION || compression > MAX_COMPRESSION)
-		elog(ERROR, "invalid compression value %d", compression);
+		for (j = 0; j < ncentroids; j++)
+		{
+			if (centroids[j].mean >= values[i])
+				break;
+
+			count += centroids[j].count;
+		}
+
+		if ((j < ncentroids) && (centroids[j].mean == values[i]))
+			count += centroids[j].count / 2.0;
+
+		result[i] = count / total_count;
+	}
 }
 
+/*
+ * Estimate inverse of quantile given a value from the t-digest agg state.
+ *
+ * Essentially an inverse to tdigest_compute_quantiles.
+ */
 static void
-check_trim_values(double low, double high)
+tdigest_compute_quantiles_of(tdigest_aggstate_t *state, double *values,
+							 int nvalues, double *result)
 {
-	if (low < 0.0)
-		elog(ERROR, "invalid low percentile value %f, should be in [0.0, 1.0]",
-			 low);
+	AssertCheckTDigestAggState(state);
 
-	if (high > 1.0)
-		elog(ERROR, "invalid high percentile value %f, should be in [0.0, 1.0]",
-			 high);
+	/*
+	 * Trigger a compaction, which also sorts the data.
+	 *
+	 * XXX maybe just do a sort here, which should give us a bit more accurate
+	 * results, probably.
+	 */
+	tdigest_compact(state);
 
-	if (low >= high)
-		elog(ERROR, "invalid low/high percentile values %f/%f, should be low < high",
-			 low, high);
+	/* if still in the exact mode, we can calculate exact ranks */
+	if (state->exact_threshold > 0)
+		tdigest_quantiles_of_exact(state->centroids, state->ncentroids,
+								   state->count, values,
+								   nvalues, result);
+	else
+		tdigest_quantiles_of(state->centroids, state->ncentroids, state->count,
+							 state->min, state->max,
+							 values, nvalues, result);
 }
 
 /*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with a single percentile.
+ * Enlarge the buffer for centroids, so that it can hold at least the
+ * requested number of centroids. The buffer size is doubled, but it never
+ * exceeds BUFFER_SIZE(compression).
  */
-Datum
-tdigest_add_double(PG_FUNCTION_ARGS)
+static void
+tdigest_enlarge(tdigest_aggstate_t *state, int ncentroids)
 {
-	tdigest_aggstate_t *state;
+	int		nallocated = state->nallocated;
 
-	MemoryContext aggcontext;
+	Assert(ncentroids <= BUFFER_SIZE(state->compression));
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double called in non-aggregate context");
+	if (ncentroids <= nallocated)
+		return;
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest (if it already exists) or NULL.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+	while (nallocated < ncentroids)
+		nallocated *= 2;
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+	nallocated = Min(nallocated, BUFFER_SIZE(state->compression));
 
-	/* if there's no digest allocated, create it now */
-	if (PG_ARGISNULL(0))
+	/* the initial buffer is part of the state chunk, so can't repalloc it */
+	if (state->centroids == INLINE_BUFFER(state))
 	{
-		int		compression = PG_GETARG_INT32(2);
-		double *percentiles = NULL;
-		int		npercentiles = 0;
-		MemoryContext	oldcontext;
+		centroid_t *centroids = palloc(nallocated * sizeof(centroid_t));
 
-		check_compression(compression);
+		memcpy(centroids, state->centroids,
+			   state->ncentroids * sizeof(centroid_t));
+		state->centroids = centroids;
+	}
+	else
+		state->centroids = (centroid_t *) repalloc(state->centroids,
+												   nallocated * sizeof(centroid_t));
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+	state->nallocated = nallocated;
+}
 
-		if (PG_NARGS() >= 4)
-		{
-			percentiles = (double *) palloc(sizeof(double));
-			percentiles[0] = PG_GETARG_FLOAT8(3);
-			npercentiles = 1;
+/*
+ * Make space for a new centroid in a full buffer.
+ *
+ * In the exact mode we first try merging the duplicate values, and we only
+ * enlarge the buffer when that did not free enough space. In the regular
+ * mode we enlarge the buffer until it reaches the full size, and only then
+ * we start doing compactions.
+ */
+static void
+tdigest_make_space(tdigest_aggstate_t *state)
+{
+	Assert(state->ncentroids == state->nallocated);
 
-			check_percentiles(percentiles, npercentiles);
-		}
+	if (state->nallocated < BUFFER_SIZE(state->compression))
+	{
+		if ((state->exact_threshold > 0) && tdigest_compact_exact(state) &&
+			(state->ncentroids <= state->nallocated / 2))
+			return;
 
-		state = tdigest_aggstate_allocate(npercentiles, 0, compression);
+		tdigest_enlarge(state, state->nallocated + 1);
+	}
+	else
+	{
+		tdigest_compact(state);
 
-		if (percentiles)
+		/*
+		 * The compaction is skipped when the buffer is full of centroids
+		 * already marked as compacted (which should not happen, but the
+		 * digest might come from outside), so force it in that case.
+		 */
+		if (state->ncentroids == state->nallocated)
 		{
-			memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
-			pfree(percentiles);
+			tdigest_leave_exact(state);
+			state->ncompacted = 0;
+			tdigest_compact_centroids(state);
 		}
 
-		MemoryContextSwitchTo(oldcontext);
+		if (state->ncentroids == state->nallocated)
+			elog(ERROR, "failed to compact t-digest buffer");
 	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
-
-	tdigest_add(state, PG_GETARG_FLOAT8(1));
-
-	AssertCheckTDigestAggState(state);
-
-	PG_RETURN_POINTER(state);
 }
 
 /*
- * Generate a t-digest representing a value with a given count.
- *
- * This is an alternative to using a single centroid, representing all points
- * with the same value. It forms a proper t-diget, following all the rules on
- * centroid sizes, etc.
+ * Move all values from the deduplication hash table to the centroids.
  */
-static tdigest_t *
-tdigest_generate(int compression, double value, int64 count)
+static void
+tdigest_flush_hash(tdigest_aggstate_t *state)
 {
-	int64		count_so_far;
-	int64		count_remaining;
-	double		denom;
-	double		normalizer;
-	int			i;
-	tdigest_t  *result = tdigest_allocate(compression);
-
-	denom = 2 * M_PI * count * log(count);
-	normalizer = compression / denom;
+	int		i;
 
-	count_so_far = 0;	/* does not include current centroid */
-	count_remaining = count;
+	if (state->nhashed == 0)
+		return;
 
 	/*
-	 * Create largest possible centroids, until we run out of items. In each
-	 * step we need to find the largest possible well-formed centroid, i.e. one
-	 * that matches the two conditions:
-	 *
-	 *	z <= q0 * (1 - q0)    where q0 = (count_so_far / count)
-	 *
-	 *	z <= q2 * (1 - q2)    where q2 = (count_so_far + X) / count;
-	 *
-	 * with z = (X * normalizer). X being the value we need to determine. Solving
-	 * q0 is trivial, while q2 leads to a quadratic equation with two roots.
+	 * Reset the counter first - adding the centroids may trigger compaction,
+	 * which would try to flush the hash table again.
 	 */
-	while (count_remaining > 0)
+	state->nhashed = 0;
+
+	for (i = 0; i < DEDUP_HASH_SIZE; i++)
 	{
-		int64	proposed_count;
-		double	q0;
-		double	a, b, c;
-		double	r1, r2;
+		centroid_t	c = state->hash[i];
 
-		/* solving z <= q0 * (1 - q0) is trivial */
-		q0 = count_so_far / (double) count;
-		r1 = (q0 * (1 - q0) / normalizer);
+		if (c.count == 0)
+			continue;
 
-		/*
-		 * Solve z <= q2 * (1 - q2) as a quadratic equation. The inequatily we
-		 * need to solve is
-		 *
-		 *	0 <= a * x^2 + b * x + c
-		 *
-		 * with these coefficients.
-		 *
-		 * XXX The counts may be very high values (int64), so we need to be
-		 * careful to prevent overflows by doing everything with double.
-		 */
-		a = -1;
-		b = ((double) count - 2 * (double) count_so_far - (double) count * (double) count * normalizer);
-		c = ((double) count_so_far * (double) count - (double) count_so_far * (double) count_so_far);
+		state->hash[i].count = 0;
 
-		/*
-		 * As this is an "upside down" parabola, the values between the roots
-		 * are positive - we're looking for the largest of the two values.
-		 *
-		 * XXX Tthe first root should be the higher one, because sqrt is
-		 * always positive, so (-b - sqrt()) is smaller and negative, and
-		 * we're dividing by negative value.
-		 */
-		r2 = Max((-b - sqrt(b * b - 4 * a * c)) / (2 * a),
-				 (-b + sqrt(b * b - 4 * a * c)) / (2 * a));
+		tdigest_add_centroid(state, c.mean, c.count);
+	}
+}
 
-		/* We need to meet both conditions, so use the smaller solution. */
-		proposed_count = floor(Min(r1, r2));
+/*
+ * Mix bits of a 64-bit value (finalizer from MurmurHash3).
+ */
+static inline uint64
+tdigest_hash_mix(uint64 h)
+{
+	h ^= h >> 33;
+	h *= UINT64CONST(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64CONST(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
 
-		/*
-		 * It's possible to get very low values on the tails, but we must add
-		 * at least something, otherwise we'd get infinite loops.
-		 */
-		proposed_count = Max(proposed_count, 1);
+	return h;
+}
 
-		/* add the centroid and update the added/removed counters */
-		result->count += proposed_count;
-		result->centroids[result->ncentroids].count = proposed_count;
-		result->centroids[result->ncentroids].mean = value;
-		result->ncentroids++;
+/*
+ * Add a value to the deduplication hash table. If the value is already
+ * there, we only increment the count. Otherwise we add it to an empty slot
+ * (using linear probing), and flush the hash table when it gets too full.
+ */
+static void
+tdigest_add_hashed(tdigest_aggstate_t *state, double v)
+{
+	uint64		h;
+	int			slot;
 
-		Assert(result->ncentroids <= compression);
+	/* hash the bits of the value */
+	memcpy(&h, &v, sizeof(uint64));
+	h = tdigest_hash_mix(h);
 
-		count_so_far += proposed_count;
-		count_remaining -= proposed_count;
+	slot = (int) (h & (DEDUP_HASH_SIZE - 1));
+
+	while (state->hash[slot].count > 0)
+	{
+		if (state->hash[slot].mean == v)
+		{
+			state->hash[slot].count++;
+			return;
+		}
+
+		slot = (slot + 1) & (DEDUP_HASH_SIZE - 1);
 	}
 
-	result->count = 0;
-	for (i = 0; i < result->ncentroids; i++)
-		result->count += result->centroids[i].count;
+	/* new value, flush the hash table first if it's too full */
+	if (state->nhashed == DEDUP_HASH_MAX)
+	{
+		tdigest_flush_hash(state);
+		tdigest_add_hashed(state, v);
+		return;
+	}
 
-	return result;
+	state->hash[slot].mean = v;
+	state->hash[slot].count = 1;
+	state->nhashed++;
 }
 
 /*
- * Add a value with count to the tdigest (create one if needed). Transition
- * function for tdigest aggregate with a single percentile.
+ * Update the exact min/max/sum of the aggregate state with (a summary of)
+ * newly added data. The centroids themselves are added separately.
  */
-Datum
-tdigest_add_double_count(PG_FUNCTION_ARGS)
+static void
+tdigest_merge_stats(tdigest_aggstate_t *state, double min, double max,
+					double sum)
 {
-	int64				i;
-	int64				count;
-	tdigest_aggstate_t *state;
-	MemoryContext		aggcontext;
+	state->min = Min(state->min, min);
+	state->max = Max(state->max, max);
+	state->sum += sum;
+}
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double_count called in non-aggregate context");
+/* add a value to the t-digest, trigger a compaction if full */
+static void
+tdigest_add(tdigest_aggstate_t *state, double v)
+{
+	tdigest_merge_stats(state, v, v, v);
+
+	/* with deduplication, collect the values in the hash table first */
+	if (state->hash != NULL)
+	{
+		tdigest_add_hashed(state, v);
+		return;
+	}
 
 	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest (if it already exists) or NULL.
+	 * If the buffer is full, make space (trigger compaction) here so that
+	 * we have free space for the new value.
 	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+	if (state->ncentroids == state->nallocated)
+		tdigest_make_space(state);
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+	/* make sure we have space for the value */
+	Assert(state->ncentroids < state->nallocated);
 
-	/* if there's no digest allocated, create it now */
+	/* for a single point, the value is both sum and mean */
+	state->centroids[state->ncentroids].count = 1;
+	state->centroids[state->ncentroids].mean = v;
+	state->ncentroids++;
+	state->count++;
+}
+
+/*
+ * Add a centroid (possibly with count not equal to 1) to the t-digest,
+ * triggers a compaction when buffer full.
+ */
+static void
+tdigest_add_centroid(tdigest_aggstate_t *state, double mean, int64 count)
+{
+	/*
+	 * If the buffer is full, make space (trigger compaction) here so that
+	 * we have free space for the new value.
+	 */
+	if (state->ncentroids == state->nallocated)
+		tdigest_make_space(state);
+
+	/* make sure we have space for the value */
+	Assert(state->ncentroids < state->nallocated);
+
+	/* for a single point, the value is both sum and mean */
+	state->centroids[state->ncentroids].count = count;
+	state->centroids[state->ncentroids].mean = mean;
+	state->ncentroids++;
+	state->count += count;
+}
+
+/* allocate t-digest with enough space for a requested number of centroids */
+static tdigest_t *
+tdigest_allocate(int ncentroids)
+{
+	Size		len;
+	tdigest_t  *digest;
+	char	   *ptr;
+
+	len = offsetof(tdigest_t, centroids) + ncentroids * sizeof(centroid_t);
+
+	/* we pre-allocate the array for all centroids and also the buffer for incoming data */
+	ptr = palloc(len);
+	SET_VARSIZE(ptr, len);
+
+	digest = (tdigest_t *) ptr;
+
+	digest->flags = 0;
+	digest->ncentroids = 0;
+	digest->count = 0;
+	digest->compression = 0;
+
+	digest->min = INFINITY;
+	digest->max = -INFINITY;
+	digest->sum = 0;
+
+	/* new tdigest are automatically storing mean, and min/max/sum */
+	digest->flags |= (TDIGEST_STORES_MEAN | TDIGEST_HAS_STATS);
+
+	return digest;
+}
+
+/*
+ * tdigest_derive_stats
+ *		Derive min/max/sum for a digest without the extended header.
+ *
+ * Switches the centroids from (sum,count) to (mean,count) if needed, and
+ * then calculates the min/max/sum from the centroids. The min/max are not
+ * the exact values (we only know the centroid means), but that's what we
+ * used before the extended header was introduced anyway.
+ *
+ * The digest has to be allocated with the extended header already (i.e.
+ * the centroids have to be at the right place).
+ */
+static void
+tdigest_derive_stats(tdigest_t *digest)
+{
+	int		i;
+
+	Assert(!(digest->flags & TDIGEST_HAS_STATS));
+
+	digest->min = INFINITY;
+	digest->max = -INFINITY;
+	digest->sum = 0;
+
+	for (i = 0; i < digest->ncentroids; i++)
+	{
+		centroid_t *c = &digest->centroids[i];
+
+		if (!(digest->flags & TDIGEST_STORES_MEAN))
+			c->mean = c->mean / c->count;
+
+		digest->min = Min(digest->min, c->mean);
+		digest->max = Max(digest->max, c->mean);
+		digest->sum += c->mean * c->count;
+	}
+
+	digest->flags |= (TDIGEST_STORES_MEAN | TDIGEST_HAS_STATS);
+}
+
+/*
+ * tdigest_update_format
+ *		Update t-digest format to the current one.
+ *
+ * Switches the centroids from (sum,count) to (mean,count), and adds the
+ * extended header with min/max/sum, so that all the places processing
+ * digests can use just the current format.
+ *
+ * If the digest already uses the current format, this is a no-op. Otherwise
+ * a modified copy of the digest is returned.
+ *
+ * XXX This does not affect on-disk representation of existing digests,
+ * we create just an in-memory version of the digest. Only when the
+ * digest gets modified a new format will be written back.
+ */
+static tdigest_t *
+tdigest_update_format(tdigest_t *digest)
+{
+	tdigest_t  *copy;
+
+	/* if already the current format, we're done */
+	if ((digest->flags & TDIGEST_STORES_MEAN) &&
+		(digest->flags & TDIGEST_HAS_STATS))
+		return digest;
+
+	/*
+	 * We'll convert the digest so that it has the extended header and the
+	 * centroids use means, but we must not modify the input digest - it
+	 * might be just a pointer to data buffer, or something like that. So
+	 * we have to create a copy first. The centroids start right after
+	 * ncentroids in the old format.
+	 */
+	copy = tdigest_allocate(digest->ncentroids);
+
+	copy->flags = digest->flags;
+	copy->count = digest->count;
+	copy->compression = digest->compression;
+	copy->ncentroids = digest->ncentroids;
+
+	memcpy(copy->centroids, (char *) digest + TDIGEST_NOSTATS_HEADER,
+		   digest->ncentroids * sizeof(centroid_t));
+
+	/* And now tweak the contents of the copy. */
+	tdigest_derive_stats(copy);
+
+	return copy;
+}
+
+/*
+ * tdigest_get_header
+ *		Fetch just the t-digest header, without the centroids.
+ *
+ * Functions that only look at the header (count, min, max, ...) don't need
+ * the centroids at all. For large digests stored out of line (the type uses
+ * STORAGE = external) we fetch just a slice with the header, so we don't
+ * need to read all the TOAST chunks. Inline values are used directly.
+ *
+ * With stats=false only the fields present in all formats may be accessed
+ * (flags, count, compression, ncentroids). With stats=true the min/max/sum
+ * are available too - for digests without the extended header we have to
+ * fall back to fetching and converting the whole digest.
+ *
+ * The returned digest may be truncated, so it must not be used to access
+ * the centroids.
+ */
+static tdigest_t *
+tdigest_get_header(Datum value, bool stats)
+{
+	struct varlena *ptr = (struct varlena *) DatumGetPointer(value);
+	tdigest_t	   *digest;
+
+	if (!VARATT_IS_EXTENDED(ptr))
+		digest = (tdigest_t *) ptr;
+	else if (stats)
+		digest = (tdigest_t *) PG_DETOAST_DATUM_SLICE(value, 0,
+						offsetof(tdigest_t, centroids) - VARHDRSZ);
+	else
+		digest = (tdigest_t *) PG_DETOAST_DATUM_SLICE(value, 0,
+						TDIGEST_NOSTATS_HEADER - VARHDRSZ);
+
+	if (stats && !(digest->flags & TDIGEST_HAS_STATS))
+		digest = tdigest_update_format((tdigest_t *) PG_DETOAST_DATUM(value));
+
+	return digest;
+}
+
+/*
+ * allocate a tdigest aggregate state, along with space for percentile(s)
+ * and value(s) requested when calling the aggregate function
+ */
+static tdigest_aggstate_t *
+tdigest_aggstate_allocate(int npercentiles, int nvalues, int compression)
+{
+	Size				len;
+	int					nallocated;
+	tdigest_aggstate_t *state;
+	char			   *ptr;
+
+	/* at least one of those values is 0 */
+	Assert(nvalues == 0 || npercentiles == 0);
+
+	/*
+	 * We allocate a single chunk for the struct including percentiles and
+	 * the initial (small) buffer for centroids, so that a new group needs
+	 * just a single palloc. The buffer is moved to a separate chunk when
+	 * it needs to be enlarged.
+	 *
+	 * Only the struct, percentiles and hash table need to be zeroed, the
+	 * centroids in the buffer are never read before being written.
+	 */
+	nallocated = INITIAL_BUFFER_SIZE(compression);
+
+	len = MAXALIGN(sizeof(tdigest_aggstate_t)) +
+		  MAXALIGN(sizeof(centroid_t) * nallocated) +
+		  MAXALIGN(sizeof(double) * npercentiles) +
+		  MAXALIGN(sizeof(double) * nvalues);
+
+	/* space for the (empty) deduplication hash table */
+	if (tdigest_deduplicate)
+		len += MAXALIGN(sizeof(centroid_t) * DEDUP_HASH_SIZE);
+
+	ptr = palloc(len);
+
+	state = (tdigest_aggstate_t *) ptr;
+	ptr += MAXALIGN(sizeof(tdigest_aggstate_t));
+
+	memset(state, 0, MAXALIGN(sizeof(tdigest_aggstate_t)));
+
+	state->nallocated = nallocated;
+	state->centroids = (centroid_t *) ptr;
+	ptr += MAXALIGN(sizeof(centroid_t) * nallocated);
+
+	Assert(state->centroids == INLINE_BUFFER(state));
+
+	memset(ptr, 0, len - (ptr - (char *) state));
+
+	state->nvalues = nvalues;
+	state->npercentiles = npercentiles;
+	state->compression = compression;
+	state->exact_threshold = Min(tdigest_exact_threshold,
+								 MAX_EXACT_THRESHOLD(compression));
+
+	state->min = INFINITY;
+	state->max = -INFINITY;
+
+	if (npercentiles > 0)
+	{
+		state->percentiles = (double *) ptr;
+		ptr += MAXALIGN(sizeof(double) * npercentiles);
+	}
+
+	if (nvalues > 0)
+	{
+		state->values = (double *) ptr;
+		ptr += MAXALIGN(sizeof(double) * nvalues);
+	}
+
+	if (tdigest_deduplicate)
+	{
+		state->hash = (centroid_t *) ptr;
+		ptr += MAXALIGN(sizeof(centroid_t) * DEDUP_HASH_SIZE);
+	}
+
+	Assert(ptr == (char *) state + len);
+
+	return state;
+}
+
+static tdigest_t *
+tdigest_aggstate_to_digest(tdigest_aggstate_t *state, bool compact)
+{
+	int			i;
+	tdigest_t  *digest;
+
+	/* make sure all the values are in the centroid buffer */
+	tdigest_flush_hash(state);
+
+	/* the digest is always built by regular compaction */
+	if (compact)
+	{
+		tdigest_leave_exact(state);
+		tdigest_compact(state);
+	}
+
+	digest = tdigest_allocate(state->ncentroids);
+
+	digest->count = state->count;
+	digest->ncentroids = state->ncentroids;
+	digest->compression = state->compression;
+
+	digest->min = state->min;
+	digest->max = state->max;
+	digest->sum = state->sum;
+
+	for (i = 0; i < state->ncentroids; i++)
+	{
+		digest->centroids[i].mean = state->centroids[i].mean;
+		digest->centroids[i].count = state->centroids[i].count;
+	}
+
+	/* remember the centroids are sorted and compacted */
+	if ((state->ncentroids > 0) && (state->ncompacted == state->ncentroids))
+		digest->flags |= TDIGEST_COMPACTED;
+
+	return digest;
+}
+
+/*
+ * Add all centroids from a t-digest to the aggregate state.
+ *
+ * If the state is still empty, and the digest was already compacted using
+ * the same compression, the state is considered compacted too. That means
+ * we don't need to sort and compact the centroids again, e.g. when computing
+ * percentiles from a single digest.
+ */
+static void
+tdigest_add_digest_centroids(tdigest_aggstate_t *state, tdigest_t *digest)
+{
+	int		i;
+	bool	compacted;
+
+	Assert(digest->flags & TDIGEST_STORES_MEAN);
+
+	/* centroids of a digest are not exact values */
+	tdigest_leave_exact(state);
+
+	compacted = (state->ncentroids == 0) &&
+				(digest->flags & TDIGEST_COMPACTED) &&
+				(digest->compression == state->compression) &&
+				(digest->ncentroids < BUFFER_SIZE(state->compression));
+
+	tdigest_merge_stats(state, digest->min, digest->max, digest->sum);
+
+	for (i = 0; i < digest->ncentroids; i++)
+		tdigest_add_centroid(state, digest->centroids[i].mean,
+							 digest->centroids[i].count);
+
+	if (compacted)
+		state->ncompacted = state->ncentroids;
+}
+
+/*
+ * Get a t-digest with centroids sorted by mean, so that it can be used to
+ * estimate percentiles directly. Compacted digests are returned as is, in
+ * other cases we build a new (compacted) digest.
+ */
+static tdigest_t *
+tdigest_get_compacted(tdigest_t *digest)
+{
+	tdigest_aggstate_t *state;
+
+	digest = tdigest_update_format(digest);
+
+	if (digest->flags & TDIGEST_COMPACTED)
+		return digest;
+
+	state = tdigest_aggstate_allocate(0, 0, digest->compression);
+
+	tdigest_add_digest_centroids(state, digest);
+
+	return tdigest_aggstate_to_digest(state, true);
+}
+
+/*
+ * Get a compacted t-digest for a function argument, along with cumulative
+ * counts for the centroids.
+ *
+ * Functions like tdigest_digest_percentile are often evaluated repeatedly
+ * for the same digest (e.g. a constant, or the outer side of a join), so we
+ * cache the last digest in fn_extra, and reuse it when called with the same
+ * value again. The values are compared using the raw datum, which is either
+ * the (possibly compressed) value itself, or an on-disk TOAST pointer. In
+ * both cases the same bytes mean the same digest. Other kinds of external
+ * values (e.g. indirect pointers) are not cached.
+ *
+ * The returned digest and cumulative counts must not be modified or freed.
+ */
+static tdigest_t *
+tdigest_get_cached(FunctionCallInfo fcinfo, int argno, int64 **cumulative)
+{
+	struct varlena *raw = (struct varlena *) PG_GETARG_POINTER(argno);
+	Size			len = VARSIZE_ANY(raw);
+	tdigest_cache_t *cache = (tdigest_cache_t *) fcinfo->flinfo->fn_extra;
+	tdigest_t	   *digest;
+	MemoryContext	oldcontext;
+
+	/* same value as the last time */
+	if ((cache != NULL) && (VARSIZE_ANY(cache->key) == len) &&
+		(memcmp(cache->key, raw, len) == 0))
+	{
+		*cumulative = cache->cumulative;
+		return cache->digest;
+	}
+
+	digest = (tdigest_t *) PG_DETOAST_DATUM(PointerGetDatum(raw));
+	digest = tdigest_get_compacted(digest);
+
+	AssertCheckTDigest(digest);
+
+	if (VARATT_IS_EXTERNAL(raw) && !VARATT_IS_EXTERNAL_ONDISK(raw))
+	{
+		*cumulative = tdigest_cumulative_counts(digest->centroids,
+												digest->ncentroids);
+		return digest;
+	}
+
+	/* replace the cached digest (if any) */
+	if (cache == NULL)
+	{
+		cache = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+								   sizeof(tdigest_cache_t));
+		fcinfo->flinfo->fn_extra = cache;
+	}
+	else
+	{
+		pfree(cache->key);
+		pfree(cache->digest);
+		pfree(cache->cumulative);
+	}
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	cache->key = palloc(len);
+	memcpy(cache->key, raw, len);
+
+	cache->digest = palloc(VARSIZE(digest));
+	memcpy(cache->digest, digest, VARSIZE(digest));
+
+	cache->cumulative = tdigest_cumulative_counts(cache->digest->centroids,
+												  cache->digest->ncentroids);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	*cumulative = cache->cumulative;
+
+	return cache->digest;
+}
+
+/* check that the requested percentiles are valid */
+static void
+check_percentiles(double *percentiles, int npercentiles)
+{
+	int i;
+
+	for (i = 0; i < npercentiles; i++)
+	{
+		if ((percentiles[i] < 0.0) || (percentiles[i] > 1.0))
+			elog(ERROR, "invalid percentile value %f, should be in [0.0, 1.0]",
+				 percentiles[i]);
+	}
+}
+
+static void
+check_compression(int compression)
+{
+	if (compression < MIN_COMPRESSION || compression > MAX_COMPRESSION)
+		elog(ERROR, "invalid compression value %d", compression);
+}
+
+static void
+check_trim_values(double low, double high)
+{
+	if (low < 0.0)
+		elog(ERROR, "invalid low percentile value %f, should be in [0.0, 1.0]",
+			 low);
+
+	if (high > 1.0)
+		elog(ERROR, "invalid high percentile value %f, should be in [0.0, 1.0]",
+			 high);
+
+	if (low >= high)
+		elog(ERROR, "invalid low/high percentile values %f/%f, should be low < high",
+			 low, high);
+}
+
+/*
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with a single percentile.
+ */
+Datum
+tdigest_add_double(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_double called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int		compression = PG_GETARG_INT32(2);
+		double *percentiles = NULL;
+		int		npercentiles = 0;
+		MemoryContext	oldcontext;
+
+		check_compression(compression);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		if (PG_NARGS() >= 4)
+		{
+			percentiles = (double *) palloc(sizeof(double));
+			percentiles[0] = PG_GETARG_FLOAT8(3);
+			npercentiles = 1;
+
+			check_percentiles(percentiles, npercentiles);
+		}
+
+		state = tdigest_aggstate_allocate(npercentiles, 0, compression);
+
+		if (percentiles)
+		{
+			memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
+			pfree(percentiles);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Calculate the size of the largest well-formed centroid, starting after
+ * count_so_far items in a t-digest with count items in total. The centroid
+ * has to match the two conditions:
+ *
+ *	z <= q0 * (1 - q0)    where q0 = (count_so_far / count)
+ *
+ *	z <= q2 * (1 - q2)    where q2 = (count_so_far + X) / count;
+ *
+ * with z = (X * normalizer). X being the value we need to determine. Solving
+ * q0 is trivial, while q2 leads to a quadratic equation with two roots.
+ */
+static int64
+tdigest_centroid_size(int64 count_so_far, int64 count, double normalizer)
+{
+	double	q0;
+	double	a, b, c;
+	double	r1, r2;
+	double	proposed_count;
+
+	/* solving z <= q0 * (1 - q0) is trivial */
+	q0 = count_so_far / (double) count;
+	r1 = (q0 * (1 - q0) / normalizer);
+
+	/*
+	 * Solve z <= q2 * (1 - q2) as a quadratic equation. The inequatily we
+	 * need to solve is
+	 *
+	 *	0 <= a * x^2 + b * x + c
+	 *
+	 * with these coefficients.
+	 *
+	 * XXX The counts may be very high values (int64), so we need to be
+	 * careful to prevent overflows by doing everything with double.
+	 */
+	a = -1;
+	b = ((double) count - 2 * (double) count_so_far - (double) count * (double) count * normalizer);
+	c = ((double) count_so_far * (double) count - (double) count_so_far * (double) count_so_far);
+
+	/*
+	 * As this is an "upside down" parabola, the values between the roots
+	 * are positive - we're looking for the largest of the two values.
+	 *
+	 * XXX Tthe first root should be the higher one, because sqrt is
+	 * always positive, so (-b - sqrt()) is smaller and negative, and
+	 * we're dividing by negative value.
+	 */
+	r2 = Max((-b - sqrt(b * b - 4 * a * c)) / (2 * a),
+			 (-b + sqrt(b * b - 4 * a * c)) / (2 * a));
+
+	/* We need to meet both conditions, so use the smaller solution. */
+	proposed_count = floor(Min(r1, r2));
+
+	/*
+	 * It's possible to get very low values on the tails, but we must add
+	 * at least something, otherwise we'd get infinite loops. This also
+	 * handles NaN (e.g. for count = 1, with infinite normalizer).
+	 */
+	if (!(proposed_count >= 1))
+		return 1;
+
+	return (int64) Min(proposed_count, (double) (count - count_so_far));
+}
+
+/*
+ * Generate a t-digest representing a value with a given count.
+ *
+ * This is an alternative to using a single centroid, representing all points
+ * with the same value. It forms a proper t-diget, following all the rules on
+ * centroid sizes, etc.
+ */
+static tdigest_t *
+tdigest_generate(int compression, double value, int64 count)
+{
+	int64		count_so_far;
+	int64		count_remaining;
+	double		denom;
+	double		normalizer;
+	int			i;
+	tdigest_t  *result = tdigest_allocate(BUFFER_SIZE(compression));
+
+	denom = 2 * M_PI * count * log(count);
+	normalizer = compression / denom;
+
+	count_so_far = 0;	/* does not include current centroid */
+	count_remaining = count;
+
+	/*
+	 * Create largest possible centroids, until we run out of items. In each
+	 * step we need to find the largest possible well-formed centroid.
+	 */
+	while (count_remaining > 0)
+	{
+		int64	proposed_count;
+
+		proposed_count = tdigest_centroid_size(count_so_far, count, normalizer);
+
+		/* add the centroid and update the added/removed counters */
+		result->count += proposed_count;
+		result->centroids[result->ncentroids].count = proposed_count;
+		result->centroids[result->ncentroids].mean = value;
+		result->ncentroids++;
+
+		Assert(result->ncentroids <= BUFFER_SIZE(compression));
+
+		count_so_far += proposed_count;
+		count_remaining -= proposed_count;
+	}
+
+	result->count = 0;
+	for (i = 0; i < result->ncentroids; i++)
+		result->count += result->centroids[i].count;
+
+	result->min = value;
+	result->max = value;
+	result->sum = value * result->count;
+
+	return result;
+}
+
+/*
+ * Add a value with count to the tdigest (create one if needed). Transition
+ * function for tdigest aggregate with a single percentile.
+ */
+Datum
+tdigest_add_double_count(PG_FUNCTION_ARGS)
+{
+	int64				i;
+	int64				count;
+	tdigest_aggstate_t *state;
+	MemoryContext		aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_double_count called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int		compression = PG_GETARG_INT32(3);
+		double *percentiles = NULL;
+		int		npercentiles = 0;
+		MemoryContext	oldcontext;
+
+		check_compression(compression);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		if (PG_NARGS() >= 5)
+		{
+			percentiles = (double *) palloc(sizeof(double));
+			percentiles[0] = PG_GETARG_FLOAT8(4);
+			npercentiles = 1;
+			check_percentiles(percentiles, npercentiles);
+		}
+
+		state = tdigest_aggstate_allocate(npercentiles, 0, compression);
+
+		if (percentiles)
+		{
+			memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
+			pfree(percentiles);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(2))
+	{
+		count = 1;
+	}
+	else
+		count = PG_GETARG_INT64(2);
+
+	/* can't add values with non-positive counts */
+	if (count <= 0)
+		elog(ERROR, "invalid count value %lld, must be a positive value",
+			 (long long) count);
+
+	/*
+	 * When adding too many values (than would fit into an empty buffer, and
+	 * thus likely causing too many compactions), we instead build a t-digest
+	 * and then merge it into the existing state.
+	 *
+	 * This is much faster, because the t-digest can be generated in one go,
+	 * so there can be only one compaction at most.
+	 */
+	if (count > BUFFER_SIZE(state->compression))
+	{
+		int			i;
+		tdigest_t  *new;
+		double		value = PG_GETARG_FLOAT8(1);
+
+		new = tdigest_generate(state->compression, value, count);
+
+		tdigest_merge_stats(state, new->min, new->max, new->sum);
+
+		for (i = 0; i < new->ncentroids; i++)
+			tdigest_add_centroid(state, value, new->centroids[i].count);
+
+		count = 0;
+	}
+
+	/*
+	 * If there are only a couple values, just add them one by one, so that
+	 * we do proper compaction and sizing of centroids. Otherwise we might end
+	 * up with oversized centroid on the tails etc.
+	 */
+	for (i = 0; i < count; i++)
+		tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with a single value.
+ */
+Datum
+tdigest_add_double_values(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_double called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int		compression = PG_GETARG_INT32(2);
+		double *values = NULL;
+		int		nvalues = 0;
+		MemoryContext	oldcontext;
+
+		check_compression(compression);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		if (PG_NARGS() >= 4)
+		{
+			values = (double *) palloc(sizeof(double));
+			values[0] = PG_GETARG_FLOAT8(3);
+			nvalues = 1;
+		}
+
+		state = tdigest_aggstate_allocate(0, nvalues, compression);
+
+		if (values)
+		{
+			memcpy(state->values, values, sizeof(double) * nvalues);
+			pfree(values);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with a single value.
+ */
+Datum
+tdigest_add_double_values_count(PG_FUNCTION_ARGS)
+{
+	int64				i;
+	int64				count;
+	tdigest_aggstate_t *state;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_double called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int		compression = PG_GETARG_INT32(3);
+		double *values = NULL;
+		int		nvalues = 0;
+		MemoryContext	oldcontext;
+
+		check_compression(compression);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		if (PG_NARGS() >= 5)
+		{
+			values = (double *) palloc(sizeof(double));
+			values[0] = PG_GETARG_FLOAT8(4);
+			nvalues = 1;
+		}
+
+		state = tdigest_aggstate_allocate(0, nvalues, compression);
+
+		if (values)
+		{
+			memcpy(state->values, values, sizeof(double) * nvalues);
+			pfree(values);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(2))
+	{
+		count = 1;
+	}
+	else
+		count = PG_GETARG_INT64(2);
+
+	/* can't add values with non-positive counts */
+	if (count <= 0)
+		elog(ERROR, "invalid count value %lld, must be a positive value",
+			 (long long) count);
+
+	/*
+	 * When adding too many values (than would fit into an empty buffer, and
+	 * thus likely causing too many compactions), we instead build a t-digest
+	 * and then merge it into the existing state.
+	 *
+	 * This is much faster, because the t-digest can be generated in one go,
+	 * so there can be only one compaction at most.
+	 */
+	if (count > BUFFER_SIZE(state->compression))
+	{
+		int			i;
+		tdigest_t  *new;
+		double		value = PG_GETARG_FLOAT8(1);
+
+		new = tdigest_generate(state->compression, value, count);
+
+		tdigest_merge_stats(state, new->min, new->max, new->sum);
+
+		for (i = 0; i < new->ncentroids; i++)
+			tdigest_add_centroid(state, value, new->centroids[i].count);
+
+		count = 0;
+	}
+
+	/*
+	 * If there are only a couple values, just add them one by one, so that
+	 * we do proper compaction and sizing of centroids. Otherwise we might end
+	 * up with oversized centroid on the tails etc.
+	 */
+	for (i = 0; i < count; i++)
+		tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with a single percentile.
+ */
+Datum
+tdigest_add_digest(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+	tdigest_t		   *digest;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_digest called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+	/* make sure we get digest with the new format */
+	digest = tdigest_update_format(digest);
+
+	/* make sure the t-digest format is supported */
+	if (!(digest->flags & TDIGEST_STORES_MEAN) ||
+		((digest->flags & ~TDIGEST_VALID_FLAGS) != 0))
+		elog(ERROR, "unsupported t-digest on-disk format");
+
+	/* if there's no aggregate state allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		double *percentiles = NULL;
+		int		npercentiles = 0;
+
+		MemoryContext	oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		if (PG_NARGS() >= 3)
+		{
+			percentiles = (double *) palloc(sizeof(double));
+			percentiles[0] = PG_GETARG_FLOAT8(2);
+			npercentiles = 1;
+
+			check_percentiles(percentiles, npercentiles);
+		}
+
+		state = tdigest_aggstate_allocate(npercentiles, 0, digest->compression);
+
+		if (percentiles)
+		{
+			memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
+			pfree(percentiles);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	/*
+	 * XXX should it be allowed to add digest to a state with a different
+	 * compression value? Will it produce a "good" t-digest or does it break
+	 * the assumptions and produce much worse estimates?
+	 */
+
+	/* copy data from the tdigest into the aggstate */
+	tdigest_add_digest_centroids(state, digest);
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a t-digest to the aggregate state, with a compression specified by
+ * the caller (instead of the compression of the first digest). Transition
+ * function for tdigest(tdigest, int) aggregate, merging digests built with
+ * different compressions into a digest with the requested compression.
+ */
+Datum
+tdigest_add_digest_compression(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+	tdigest_t		   *digest;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_digest_compression called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	digest = PG_GETARG_TDIGEST(1);
+
+	/* make sure the t-digest format is supported */
+	if (!(digest->flags & TDIGEST_STORES_MEAN) ||
+		((digest->flags & ~TDIGEST_VALID_FLAGS) != 0))
+		elog(ERROR, "unsupported t-digest on-disk format");
+
+	/* if there's no aggregate state allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int		compression = PG_GETARG_INT32(2);
+
+		MemoryContext	oldcontext;
+
+		check_compression(compression);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		state = tdigest_aggstate_allocate(0, 0, compression);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	/*
+	 * The centroids are compacted using the state compression, so digests
+	 * with a higher compression get merged into fewer centroids.
+	 */
+	tdigest_add_digest_centroids(state, digest);
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with a single value.
+ */
+Datum
+tdigest_add_digest_values(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+	tdigest_t		   *digest;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_digest called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+	/* make sure we get digest with the new format */
+	digest = tdigest_update_format(digest);
+
+	/* make sure the t-digest format is supported */
+	if (!(digest->flags & TDIGEST_STORES_MEAN) ||
+		((digest->flags & ~TDIGEST_VALID_FLAGS) != 0))
+		elog(ERROR, "unsupported t-digest on-disk format");
+
+	/* if there's no aggregate state allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		double *values = NULL;
+		int		nvalues = 0;
+
+		MemoryContext	oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		if (PG_NARGS() >= 3)
+		{
+			values = (double *) palloc(sizeof(double));
+			values[0] = PG_GETARG_FLOAT8(2);
+			nvalues = 1;
+		}
+
+		state = tdigest_aggstate_allocate(0, nvalues, digest->compression);
+
+		if (values)
+		{
+			memcpy(state->values, values, sizeof(double) * nvalues);
+			pfree(values);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	/*
+	 * XXX should it be allowed to add digest to a state with a different
+	 * compression value? Will it produce a "good" t-digest or does it break
+	 * the assumptions and produce much worse estimates?
+	 */
+
+	tdigest_add_digest_centroids(state, digest);
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with an array of percentiles.
+ */
+Datum
+tdigest_add_double_array(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_double_array called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int compression = PG_GETARG_INT32(2);
+		double *percentiles;
+		int		npercentiles;
+		MemoryContext	oldcontext;
+
+		check_compression(compression);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		percentiles = array_to_double(fcinfo,
+									  PG_GETARG_ARRAYTYPE_P(3),
+									  &npercentiles);
+
+		check_percentiles(percentiles, npercentiles);
+
+		state = tdigest_aggstate_allocate(npercentiles, 0, compression);
+
+		memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
+
+		pfree(percentiles);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with an array of percentiles.
+ */
+Datum
+tdigest_add_double_array_count(PG_FUNCTION_ARGS)
+{
+	int64				i;
+	int64				count;
+	tdigest_aggstate_t *state;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_double_array called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int compression = PG_GETARG_INT32(3);
+		double *percentiles;
+		int		npercentiles;
+		MemoryContext	oldcontext;
+
+		check_compression(compression);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		percentiles = array_to_double(fcinfo,
+									  PG_GETARG_ARRAYTYPE_P(4),
+									  &npercentiles);
+
+		check_percentiles(percentiles, npercentiles);
+
+		state = tdigest_aggstate_allocate(npercentiles, 0, compression);
+
+		memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
+
+		pfree(percentiles);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(2))
+	{
+		count = 1;
+	}
+	else
+		count = PG_GETARG_INT64(2);
+
+	/* can't add values with non-positive counts */
+	if (count <= 0)
+		elog(ERROR, "invalid count value %lld, must be a positive value",
+			 (long long) count);
+
+	/*
+	 * Add the values one by one, not as one large centroid with the count.
+	 * We do it like this to allow proper compaction and sizing of centroids,
+	 * otherwise we might end up with oversized centroid on the tails etc.
+	 *
+	 * XXX If this turns out a bit too expensive, we may try determining the
+	 * size by looking for the smallest centroid covering this value.
+	 */
+	for (i = 0; i < count; i++)
+		tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with an array of values.
+ */
+Datum
+tdigest_add_double_array_values(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_double_array called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int compression = PG_GETARG_INT32(2);
+		double *values;
+		int		nvalues;
+		MemoryContext	oldcontext;
+
+		check_compression(compression);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		values = array_to_double(fcinfo,
+								 PG_GETARG_ARRAYTYPE_P(3),
+								 &nvalues);
+
+		state = tdigest_aggstate_allocate(0, nvalues, compression);
+
+		memcpy(state->values, values, sizeof(double) * nvalues);
+
+		pfree(values);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with an array of values.
+ */
+Datum
+tdigest_add_double_array_values_count(PG_FUNCTION_ARGS)
+{
+	int64				i;
+	int64				count;
+	tdigest_aggstate_t *state;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_double_array called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int compression = PG_GETARG_INT32(3);
+		double *values;
+		int		nvalues;
+		MemoryContext	oldcontext;
+
+		check_compression(compression);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		values = array_to_double(fcinfo,
+								 PG_GETARG_ARRAYTYPE_P(4),
+								 &nvalues);
+
+		state = tdigest_aggstate_allocate(0, nvalues, compression);
+
+		memcpy(state->values, values, sizeof(double) * nvalues);
+
+		pfree(values);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(2))
+	{
+		count = 1;
+	}
+	else
+		count = PG_GETARG_INT64(2);
+
+	/* can't add values with non-positive counts */
+	if (count <= 0)
+		elog(ERROR, "invalid count value %lld, must be a positive value",
+			 (long long) count);
+
+	/*
+	 * Add the values one by one, not as one large centroid with the count.
+	 * We do it like this to allow proper compaction and sizing of centroids,
+	 * otherwise we might end up with oversized centroid on the tails etc.
+	 *
+	 * XXX If this turns out a bit too expensive, we may try determining the
+	 * size by looking for the smallest centroid covering this value.
+	 */
+	for (i = 0; i < count; i++)
+		tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a digest to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with an array of percentiles.
+ */
+Datum
+tdigest_add_digest_array(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+	tdigest_t		   *digest;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_digest_array called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+	/* make sure we get digest with the new format */
+	digest = tdigest_update_format(digest);
+
+	/* make sure the t-digest format is supported */
+	if (!(digest->flags & TDIGEST_STORES_MEAN) ||
+		((digest->flags & ~TDIGEST_VALID_FLAGS) != 0))
+		elog(ERROR, "unsupported t-digest on-disk format");
+
+	/* if there's no aggregate state allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		double *percentiles;
+		int		npercentiles;
+		MemoryContext	oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		percentiles = array_to_double(fcinfo,
+									  PG_GETARG_ARRAYTYPE_P(2),
+									  &npercentiles);
+
+		check_percentiles(percentiles, npercentiles);
+
+		state = tdigest_aggstate_allocate(npercentiles, 0, digest->compression);
+
+		memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
+
+		pfree(percentiles);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	/*
+	 * XXX should it be allowed to add digest to a state with a different
+	 * compression value? Will it produce a "good" t-digest or does it break
+	 * the assumptions and produce much worse estimates?
+	 */
+
+	tdigest_add_digest_centroids(state, digest);
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Add a digest to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with an array of values.
+ */
+Datum
+tdigest_add_digest_array_values(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+	tdigest_t		   *digest;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_digest_array called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+	/* make sure we get digest with the new format */
+	digest = tdigest_update_format(digest);
+
+	/* make sure the t-digest format is supported */
+	if (!(digest->flags & TDIGEST_STORES_MEAN) ||
+		((digest->flags & ~TDIGEST_VALID_FLAGS) != 0))
+		elog(ERROR, "unsupported t-digest on-disk format");
+
+	/* if there's no aggregate state allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		double *values;
+		int		nvalues;
+		MemoryContext	oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		values = array_to_double(fcinfo,
+								 PG_GETARG_ARRAYTYPE_P(2),
+								 &nvalues);
+
+		state = tdigest_aggstate_allocate(0, nvalues, digest->compression);
+
+		memcpy(state->values, values, sizeof(double) * nvalues);
+
+		pfree(values);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	/*
+	 * XXX should it be allowed to add digest to a state with a different
+	 * compression value? Will it produce a "good" t-digest or does it break
+	 * the assumptions and produce much worse estimates?
+	 */
+
+	tdigest_add_digest_centroids(state, digest);
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Compute percentile from a tdigest. Final function for tdigest aggregate
+ * with a single percentile.
+ */
+Datum
+tdigest_percentiles(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t	   *state;
+	MemoryContext	aggcontext;
+	double			ret;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_percentiles called in non-aggregate context");
+
+	/* if there's no digest, return NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	tdigest_compute_quantiles(state, state->percentiles, state->npercentiles,
+							  &ret);
+
+	PG_RETURN_FLOAT8(ret);
+}
+
+/*
+ * Compute percentile from a tdigest. Final function for tdigest aggregate
+ * with a single percentile.
+ */
+Datum
+tdigest_percentiles_of(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t	   *state;
+	MemoryContext	aggcontext;
+	double			ret;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_percentiles_of called in non-aggregate context");
+
+	/* if there's no digest, return NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	tdigest_compute_quantiles_of(state, state->values, state->nvalues, &ret);
+
+	PG_RETURN_FLOAT8(ret);
+}
+
+/*
+ * Build a t-digest varlena value from the aggegate state.
+ */
+Datum
+tdigest_digest(PG_FUNCTION_ARGS)
+{
+	tdigest_t			   *digest;
+	tdigest_aggstate_t	   *state;
+	MemoryContext	aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_digest called in non-aggregate context");
+
+	/* if there's no digest, return NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	digest = tdigest_aggstate_to_digest(state, true);
+
+	PG_RETURN_POINTER(digest);
+}
+
+/*
+ * Compute percentiles from a tdigest. Final function for tdigest aggregate
+ * with an array of percentiles.
+ */
+Datum
+tdigest_array_percentiles(PG_FUNCTION_ARGS)
+{
+	double	*result;
+	MemoryContext aggcontext;
+
+	tdigest_aggstate_t *state;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_array_percentiles called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	result = palloc(state->npercentiles * sizeof(double));
+
+	tdigest_compute_quantiles(state, state->percentiles, state->npercentiles,
+							  result);
+
+	return double_to_array(fcinfo, result, state->npercentiles);
+}
+
+/*
+ * Compute percentiles from a tdigest. Final function for tdigest aggregate
+ * with an array of values.
+ */
+Datum
+tdigest_array_percentiles_of(PG_FUNCTION_ARGS)
+{
+	double	*result;
+	MemoryContext aggcontext;
+
+	tdigest_aggstate_t *state;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_array_percentiles_of called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	result = palloc(state->nvalues * sizeof(double));
+
+	tdigest_compute_quantiles_of(state, state->values, state->nvalues,
+								 result);
+
+	return double_to_array(fcinfo, result, state->nvalues);
+}
+
+Datum
+tdigest_serial(PG_FUNCTION_ARGS)
+{
+	bytea	   *v;
+	tdigest_aggstate_t  *state;
+	Size		len;
+	char	   *ptr;
+
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	/* the hash table is not serialized, so flush it first */
+	tdigest_flush_hash(state);
+
+	len = offsetof(tdigest_aggstate_t, percentiles) +
+		  state->npercentiles * sizeof(double) +
+		  state->nvalues * sizeof(double) +
+		  state->ncentroids * sizeof(centroid_t);
+
+	v = palloc(len + VARHDRSZ);
+
+	SET_VARSIZE(v, len + VARHDRSZ);
+	ptr = VARDATA(v);
+
+	memcpy(ptr, state, offsetof(tdigest_aggstate_t, percentiles));
+	ptr += offsetof(tdigest_aggstate_t, percentiles);
+
+	if (state->npercentiles > 0)
+	{
+		memcpy(ptr, state->percentiles, sizeof(double) * state->npercentiles);
+		ptr += sizeof(double) * state->npercentiles;
+	}
+
+	if (state->nvalues > 0)
+	{
+		memcpy(ptr, state->values, sizeof(double) * state->nvalues);
+		ptr += sizeof(double) * state->nvalues;
+	}
+
+	/* FIXME maybe don't serialize full centroids, but just sum/count */
+	memcpy(ptr, state->centroids,
+		   sizeof(centroid_t) * state->ncentroids);
+	ptr += sizeof(centroid_t) * state->ncentroids;
+
+	Assert(VARDATA(v) + len == ptr);
+
+	if (tdigest_track_stats)
+	{
+		tdigest_stats.serialized++;
+		tdigest_stats.serialized_bytes += VARSIZE(v);
+	}
+
+	PG_RETURN_POINTER(v);
+}
+
+Datum
+tdigest_deserial(PG_FUNCTION_ARGS)
+{
+	bytea  *v = (bytea *) PG_GETARG_POINTER(0);
+	char   *ptr = VARDATA_ANY(v);
+	tdigest_aggstate_t	tmp;
+	tdigest_aggstate_t *state;
+	double			   *percentiles = NULL;
+	double			   *values = NULL;
+
+	if (tdigest_track_stats)
+	{
+		tdigest_stats.deserialized++;
+		tdigest_stats.deserialized_bytes += VARSIZE_ANY(v);
+	}
+
+	/* copy aggstate header into a local variable */
+	memcpy(&tmp, ptr, offsetof(tdigest_aggstate_t, percentiles));
+	ptr += offsetof(tdigest_aggstate_t, percentiles);
+
+	/* allocate and copy percentiles */
+	if (tmp.npercentiles > 0)
+	{
+		percentiles = palloc(tmp.npercentiles * sizeof(double));
+		memcpy(percentiles, ptr, tmp.npercentiles * sizeof(double));
+		ptr += tmp.npercentiles * sizeof(double);
+	}
+
+	/* allocate and copy values */
+	if (tmp.nvalues > 0)
+	{
+		values = palloc(tmp.nvalues * sizeof(double));
+		memcpy(values, ptr, tmp.nvalues * sizeof(double));
+		ptr += tmp.nvalues * sizeof(double);
+	}
+
+	state = tdigest_aggstate_allocate(tmp.npercentiles, tmp.nvalues,
+									  tmp.compression);
+
+	if (tmp.npercentiles > 0)
+	{
+		memcpy(state->percentiles, percentiles, tmp.npercentiles * sizeof(double));
+		pfree(percentiles);
+	}
+
+	if (tmp.nvalues > 0)
+	{
+		memcpy(state->values, values, tmp.nvalues * sizeof(double));
+		pfree(values);
+	}
+
+	/* copy the data into the newly-allocated state */
+	memcpy(state, &tmp, offsetof(tdigest_aggstate_t, percentiles));
+	/* we don't need to move the pointer */
+
+	/* make sure there's enough space for the centroids */
+	tdigest_enlarge(state, state->ncentroids);
+
+	/* copy the centroids back */
+	memcpy(state->centroids, ptr,
+		   sizeof(centroid_t) * state->ncentroids);
+	ptr += sizeof(centroid_t) * state->ncentroids;
+
+	PG_RETURN_POINTER(state);
+}
+
+static tdigest_aggstate_t *
+tdigest_copy(tdigest_aggstate_t *state)
+{
+	tdigest_aggstate_t *copy;
+
+	/* the hash table is not copied, so flush it first */
+	tdigest_flush_hash(state);
+
+	copy = tdigest_aggstate_allocate(state->npercentiles, state->nvalues,
+									 state->compression);
+
+	memcpy(copy, state, offsetof(tdigest_aggstate_t, percentiles));
+
+	if (state->nvalues > 0)
+		memcpy(copy->values, state->values,
+			   sizeof(double) * state->nvalues);
+
+	if (state->npercentiles > 0)
+		memcpy(copy->percentiles, state->percentiles,
+			   sizeof(double) * state->npercentiles);
+
+	tdigest_enlarge(copy, state->ncentroids);
+
+	memcpy(copy->centroids, state->centroids,
+		   state->ncentroids * sizeof(centroid_t));
+
+	return copy;
+}
+
+Datum
+tdigest_combine(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t	 *src;
+	tdigest_aggstate_t	 *dst;
+	MemoryContext aggcontext;
+	MemoryContext oldcontext;
+	int	i;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_combine called in non-aggregate context");
+
+	/* if no "merged" state yet, try creating it */
+	if (PG_ARGISNULL(0))
+	{
+		/* nope, the second argument is NULL to, so return NULL */
+		if (PG_ARGISNULL(1))
+			PG_RETURN_NULL();
+
+		/* the second argument is not NULL, so copy it */
+		src = (tdigest_aggstate_t *) PG_GETARG_POINTER(1);
+
+		/* copy the digest into the right long-lived memory context */
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		src = tdigest_copy(src);
+		MemoryContextSwitchTo(oldcontext);
+
+		PG_RETURN_POINTER(src);
+	}
+
+	/*
+	 * If the second argument is NULL, just return the first one (we know
+	 * it's not NULL at this point).
+	 */
+	if (PG_ARGISNULL(1))
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+	/* Now we know neither argument is NULL, so merge them. */
+	src = (tdigest_aggstate_t *) PG_GETARG_POINTER(1);
+	dst = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	if (tdigest_track_stats)
+		tdigest_stats.combines++;
+
+	/* make sure all the values are in the centroid buffers */
+	tdigest_flush_hash(dst);
+	tdigest_flush_hash(src);
+
+	AssertCheckTDigestAggState(dst);
+	AssertCheckTDigestAggState(src);
+
+	/* the result is exact only if both states are exact */
+	if (src->exact_threshold == 0)
+		tdigest_leave_exact(dst);
+
+	/*
+	 * XXX should it be allowed to add digest to a state with a different
+	 * compression value? Will it produce a "good" t-digest or does it break
+	 * the assumptions and produce much worse estimates?
+	 */
+
+	tdigest_merge_stats(dst, src->min, src->max, src->sum);
+
+	/* copy data from the tdigest into the aggstate */
+	for (i = 0; i < src->ncentroids; i++)
+		tdigest_add_centroid(dst, src->centroids[i].mean,
+								  src->centroids[i].count);
+
+	AssertCheckTDigestAggState(dst);
+
+	PG_RETURN_POINTER(dst);
+}
+
+/* API for incremental updates */
+
+/*
+ * expand the t-digest into an in-memory aggregate state
+ */
+static tdigest_aggstate_t *
+tdigest_digest_to_aggstate(tdigest_t *digest)
+{
+	tdigest_aggstate_t *state;
+
+	/* make sure we get digest with the new format */
+	digest = tdigest_update_format(digest);
+
+	/* make sure the t-digest format is supported */
+	if (!(digest->flags & TDIGEST_STORES_MEAN) ||
+		((digest->flags & ~TDIGEST_VALID_FLAGS) != 0))
+		elog(ERROR, "unsupported t-digest on-disk format");
+
+	state = tdigest_aggstate_allocate(0, 0, digest->compression);
+
+	/* copy data from the tdigest into the aggstate */
+	tdigest_add_digest_centroids(state, digest);
+
+	AssertCheckTDigestAggState(state);
+
+	return state;
+}
+
+/*
+ * Add a single value to the t-digest. This is not very efficient, as it has
+ * to deserialize the t-digest into the in-memory aggstate representation
+ * and serialize it back for each call, but it's convenient and acceptable
+ * for some use cases.
+ *
+ * When efficiency is important, it may be possible to use the batch variant
+ * with first aggregating the updates into a t-digest, and then merge that
+ * into an existing t-digest in one step using tdigest_union_double_increment
+ *
+ * This is similar to hll_add, while the "union" is more like hll_union.
+ */
+Datum
+tdigest_add_double_increment(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+	bool				compact = PG_GETARG_BOOL(3);
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		int		compression;
+
+		/*
+		 * We don't require compression, but only when there is an existing
+		 * t-digest value. Make sure the value was supplied.
+		 */
+		if (PG_ARGISNULL(2))
+			elog(ERROR, "compression value not supplied, but t-digest is NULL");
+
+		compression = PG_GETARG_INT32(2);
+
+		check_compression(compression);
+
+		state = tdigest_aggstate_allocate(0, 0, compression);
+	}
+	else
+		state = tdigest_digest_to_aggstate(PG_GETARG_TDIGEST(0));
+
+	tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(tdigest_aggstate_to_digest(state, compact));
+}
+
+/*
+ * Add an array of values to the t-digest. This amortizes the overhead of
+ * deserializing and serializing the t-digest, compared to the per-value
+ * version.
+ *
+ * When efficiency is important, it may be possible to use the batch variant
+ * with first aggregating the updates into a t-digest, and then merge that
+ * into an existing t-digest in one step using tdigest_union_double_increment
+ *
+ * This is similar to hll_add, while the "union" is more like hll_union.
+ */
+Datum
+tdigest_add_double_array_increment(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+	bool				compact = PG_GETARG_BOOL(3);
+	double			   *values;
+	int					nvalues;
+	int					i;
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	/* if there's no digest allocated, create it now */
 	if (PG_ARGISNULL(0))
 	{
-		int		compression = PG_GETARG_INT32(3);
-		double *percentiles = NULL;
-		int		npercentiles = 0;
-		MemoryContext	oldcontext;
+		int		compression;
+
+		/*
+		 * We don't require compression, but only when there is an existing
+		 * t-digest value. Make sure the value was supplied.
+		 */
+		if (PG_ARGISNULL(2))
+			elog(ERROR, "compression value not supplied, but t-digest is NULL");
+
+		compression = PG_GETARG_INT32(2);
+
+		check_compression(compression);
+
+		state = tdigest_aggstate_allocate(0, 0, compression);
+	}
+	else
+		state = tdigest_digest_to_aggstate(PG_GETARG_TDIGEST(0));
+
+	values = array_to_double(fcinfo,
+							 PG_GETARG_ARRAYTYPE_P(1),
+							 &nvalues);
+
+	for (i = 0; i < nvalues; i++)
+		tdigest_add(state, values[i]);
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(tdigest_aggstate_to_digest(state, compact));
+}
+
+/*
+ * Merge a t-digest into another t-digest. This is somewaht inefficient, as
+ * it has to deserialize the t-digests into the in-memory aggstate values,
+ * and serialize it back for each call, but it's better than doing it for
+ * each individual value (like tdigest_union_double_increment).
+ *
+ * This is similar to hll_union.
+ */
+Datum
+tdigest_union_double_increment(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t *state;
+	tdigest_t		   *digest;
+	bool				compact = PG_GETARG_BOOL(2);
+
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+	else if (PG_ARGISNULL(0))
+		PG_RETURN_POINTER(PG_GETARG_POINTER(1));
+	else if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+
+	/* now we know both arguments are non-null */
+
+	/* parse the first digest (we'll merge the other one into this) */
+	state = tdigest_digest_to_aggstate(PG_GETARG_TDIGEST(0));
+	AssertCheckTDigestAggState(state);
+
+	/* parse the second digest */
+	digest = PG_GETARG_TDIGEST(1);
+	AssertCheckTDigest(digest);
+
+	/* copy data from the tdigest into the aggstate */
+	tdigest_add_digest_centroids(state, digest);
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(tdigest_aggstate_to_digest(state, compact));
+}
+
+
+/*
+ * Comparator, ordering the centroids by mean value.
+ *
+ * When the mean is the same, we try ordering the centroids by count.
+ *
+ * In principle, centroids with the same mean represent the same value,
+ * but we still need to care about the count to allow rebalancing the
+ * centroids later.
+ */
+static int
+centroid_cmp(const void *a, const void *b)
+{
+	double	ma, mb;
+
+	centroid_t *ca = (centroid_t *) a;
+	centroid_t *cb = (centroid_t *) b;
+
+	ma = ca->mean;
+	mb = cb->mean;
+
+	if (ma < mb)
+		return -1;
+	else if (ma > mb)
+		return 1;
+
+	if (ca->count < cb->count)
+		return -1;
+	else if (ca->count > cb->count)
+		return 1;
+
+	return 0;
+}
+
+Datum
+tdigest_in(PG_FUNCTION_ARGS)
+{
+	int			i, r;
+	char	   *str = PG_GETARG_CSTRING(0);
+	tdigest_t  *digest = NULL;
+	size_t		slen;
+
+	/* t-digest header fields */
+	int32       flags;
+	int64		count,
+				total_count;
+	int			compression;
+	int			ncentroids;
+	int			header_length;
+	char	   *ptr;
+
+	/* extended header */
+	double		min = 0,
+				max = 0,
+				sum = 0;
+
+	slen = strlen(str);
+
+	r = sscanf(str, "flags %d count " INT64_FORMAT " compression %d centroids %d%n",
+			   &flags, &count, &compression, &ncentroids, &header_length);
+
+	if (r != 4)
+		elog(ERROR, "failed to parse t-digest value");
+
+	if ((flags & ~TDIGEST_VALID_FLAGS) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid flags for t-digest")));
+
+	/* only digests in the new format may be marked as compacted */
+	if ((flags & TDIGEST_COMPACTED) && !(flags & TDIGEST_STORES_MEAN))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid flags for t-digest")));
+
+	/* only digests in the new format may have the extended header */
+	if ((flags & TDIGEST_HAS_STATS) && !(flags & TDIGEST_STORES_MEAN))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid flags for t-digest")));
+
+	if (flags & TDIGEST_HAS_STATS)
+	{
+		int		nbytes = -1;
+
+		r = sscanf(str + header_length, " min %lf max %lf sum %lf%n",
+				   &min, &max, &sum, &nbytes);
+
+		if ((r != 3) || (nbytes < 0))
+			elog(ERROR, "failed to parse t-digest value");
+
+		if (isnan(min) || isnan(max) || isnan(sum) || (min > max))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid min/max/sum values for t-digest")));
+
+		header_length += nbytes;
+	}
+
+	if ((compression < MIN_COMPRESSION) || (compression > MAX_COMPRESSION))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("compression for t-digest must be in [%d, %d]",
+						MIN_COMPRESSION, MAX_COMPRESSION)));
+
+	if (count <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("count value for the t-digest must be positive")));
+
+	if (ncentroids <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of centroids for the t-digest must be positive")));
+
+	if (ncentroids > BUFFER_SIZE(compression))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of centroids for the t-digest exceeds buffer size")));
+
+	/*
+	 * Compacted digests always have fewer centroids than the buffer size,
+	 * otherwise adding data to them would not leave any space. Don't trust
+	 * the flag for digests that don't meet this.
+	 */
+	if ((flags & TDIGEST_COMPACTED) && (ncentroids >= BUFFER_SIZE(compression)))
+		flags &= ~TDIGEST_COMPACTED;
+
+	digest = tdigest_allocate(ncentroids);
+
+	digest->flags = flags;
+	digest->count = count;
+	digest->ncentroids = ncentroids;
+	digest->compression = compression;
+
+	digest->min = min;
+	digest->max = max;
+	digest->sum = sum;
+
+	ptr = str + header_length;
+
+	total_count = 0;
+	ncentroids = 0;
+	for (i = 0; i < digest->ncentroids; i++)
+	{
+		int		nbytes = -1;
+		double	mean;
+
+		if (sscanf(ptr, " (%lf, " INT64_FORMAT ")%n", &mean, &count, &nbytes) != 2)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("failed to parse centroid")));
+
+		/*
+		 * The %n might have not been assigned, in which case it kept the -1
+		 * value. Treat it as malformed input value.
+		 */
+		if (nbytes < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("failed to parse centroid")));
+
+		/*
+		 * We should have parsed the whole format, and the last charater should
+		 * be a closing parenthesis for the centroid. If not, it's malformed.
+		 */
+		if (ptr[nbytes - 1] != ')')
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("malformed centroid, missing closing ')'")));
+
+		/*
+		 * Not sure if this can happen with text input, but better to keep the
+		 * checks the same as in tdigest_recv.
+		 */
+		if (isnan(mean))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("mean value for all centroids in a t-digest must be valid")));
+
+		if (count <= 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("count value for all centroids in a t-digest must be positive")));
+		else if (count > digest->count)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("count value of a centroid exceeds total count")));
+
+		digest->centroids[i].count = count;
+		digest->centroids[i].mean = mean;
+
+		/* the centroids should be sorted by mean */
+		if (i > 0)
+		{
+			double	mean_prev = digest->centroids[i-1].mean;
+
+			if (!(flags & TDIGEST_STORES_MEAN))
+			{
+				mean = (mean / digest->centroids[i].count);
+				mean_prev = (mean_prev / digest->centroids[i-1].count);
+			}
+
+			if (mean_prev > mean)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("centroids not sorted by mean")));
+		}
+
+		/* track the total count so that we can check later */
+		total_count += count;
+		ncentroids++;
+
+		/*
+		 * Skip to the end of the centroid (the character after the closing
+		 * parenthesis). If this is the end of the string, stop parsing, even
+		 * if we failed to parse the right number of centroids).
+		 */
+		ptr += nbytes;
+
+		/* end of string */
+		if (*ptr == '\0')
+			break;
+
+		/* must not scan past the end of the input string */
+		Assert(ptr <= str + slen);
+	}
+
+	/*
+	 * Malformed inputs may have the wrong number of centroids, in which case
+	 * we either don't consume the whole input (ncentroids too high), or we
+	 * don't get all the expected centroids (ncentroids too high).
+	 */
+	if (ptr < str + slen)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("input t-digest value too long")));
+
+	if (ncentroids != digest->ncentroids)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("input t-digest value too short")));
+
+	/*
+	 * If we consumed just the right number of centroids, we must have read
+	 * the whole input value exactly.
+	 */
+	Assert(ptr == str + slen);
+
+	/* check that the total matches */
+	if (total_count != digest->count)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("total count does not match the data (%lld != %lld)",
+						(long long) total_count, (long long) digest->count)));
+
+	/*
+	 * Make sure we return digest with the new format (it might be the
+	 * old format, in which case "mean" fields actually store "sum", and
+	 * without the min/max/sum).
+	 */
+	if (!(digest->flags & TDIGEST_HAS_STATS))
+		tdigest_derive_stats(digest);
+
+	AssertCheckTDigest(digest);
+
+	PG_RETURN_POINTER(digest);
+}
+
+/*
+ * Append a double value, so that it's parsed back exactly.
+ *
+ * The min/max/sum are supposed to be exact, so we can't just use "%lf"
+ * (or "%g" in JSON), which keeps only 6 decimal places (significant
+ * digits). We still use the format whenever it's enough to represent the
+ * value exactly, so that the output does not change for the common values,
+ * and "%.17g" otherwise. Both are accepted by the "%lf" in tdigest_in.
+ */
+static void
+append_exact_double(StringInfo str, const char *format, double value)
+{
+	char	buf[512];
+
+	snprintf(buf, sizeof(buf), format, value);
+
+	if (strtod(buf, NULL) != value)
+		snprintf(buf, sizeof(buf), "%.17g", value);
+
+	appendStringInfoString(str, buf);
+}
+
+Datum
+tdigest_out(PG_FUNCTION_ARGS)
+{
+	int			i;
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	StringInfoData	str;
+
+	AssertCheckTDigest(digest);
+
+	initStringInfo(&str);
+
+	appendStringInfo(&str, "flags %d count " INT64_FORMAT " compression %d centroids %d",
+					 digest->flags, digest->count, digest->compression,
+					 digest->ncentroids);
+
+	appendStringInfoString(&str, " min ");
+	append_exact_double(&str, "%lf", digest->min);
+	appendStringInfoString(&str, " max ");
+	append_exact_double(&str, "%lf", digest->max);
+	appendStringInfoString(&str, " sum ");
+	append_exact_double(&str, "%lf", digest->sum);
+
+	for (i = 0; i < digest->ncentroids; i++)
+		appendStringInfo(&str, " (%lf, " INT64_FORMAT ")",
+						 digest->centroids[i].mean,
+						 digest->centroids[i].count);
+
+	PG_RETURN_CSTRING(str.data);
+}
+
+Datum
+tdigest_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	tdigest_t  *digest;
+	int			i;
+	int64		count;
+	int64		total_count;
+	int32		flags;
+	int32		compression;
+	int32		ncentroids;
+	double		min = 0,
+				max = 0,
+				sum = 0;
+
+	flags = pq_getmsgint(buf, sizeof(int32));
+
+	/* make sure the t-digest format is supported */
+	if (((flags & ~TDIGEST_VALID_FLAGS) != 0) ||
+		((flags & TDIGEST_COMPACTED) && !(flags & TDIGEST_STORES_MEAN)) ||
+		((flags & TDIGEST_HAS_STATS) && !(flags & TDIGEST_STORES_MEAN)))
+		elog(ERROR, "unsupported t-digest on-disk format");
+
+	count = pq_getmsgint64(buf);
+	compression = pq_getmsgint(buf, sizeof(int32));
+	ncentroids = pq_getmsgint(buf, sizeof(int32));
+
+	if (flags & TDIGEST_HAS_STATS)
+	{
+		min = pq_getmsgfloat8(buf);
+		max = pq_getmsgfloat8(buf);
+		sum = pq_getmsgfloat8(buf);
+
+		if (isnan(min) || isnan(max) || isnan(sum) || (min > max))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid min/max/sum values for t-digest")));
+	}
+
+	if ((compression < MIN_COMPRESSION) || (compression > MAX_COMPRESSION))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("compression for t-digest must be in [%d, %d]",
+						MIN_COMPRESSION, MAX_COMPRESSION)));
+
+	if (count <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("count value for the t-digest must be positive")));
+
+	if (ncentroids <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of centroids for the t-digest must be positive")));
+
+	if (ncentroids > BUFFER_SIZE(compression))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of centroids for the t-digest exceeds buffer size")));
+
+	/* don't trust the flag for digests that can't be compacted (see tdigest_in) */
+	if ((flags & TDIGEST_COMPACTED) && (ncentroids >= BUFFER_SIZE(compression)))
+		flags &= ~TDIGEST_COMPACTED;
+
+	digest = tdigest_allocate(ncentroids);
+
+	digest->flags = flags;
+	digest->count = count;
+	digest->compression = compression;
+	digest->ncentroids = ncentroids;
+
+	digest->min = min;
+	digest->max = max;
+	digest->sum = sum;
+
+	total_count = 0;
+	for (i = 0; i < digest->ncentroids; i++)
+	{
+		digest->centroids[i].mean = pq_getmsgfloat8(buf);
+		digest->centroids[i].count = pq_getmsgint64(buf);
+
+		if (isnan(digest->centroids[i].mean))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("mean value for all centroids in a t-digest must be valid")));
+
+		if (digest->centroids[i].count <= 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("count value for all centroids in a t-digest must be positive")));
+		else if (digest->centroids[i].count > digest->count)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("count value of a centroid exceeds total count")));
+
+		/* compacted digests are used without sorting, so check the order */
+		if ((flags & TDIGEST_COMPACTED) && (i > 0) &&
+			(digest->centroids[i-1].mean > digest->centroids[i].mean))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("centroids not sorted by mean")));
+
+		/* track the total count so that we can check later */
+		total_count += digest->centroids[i].count;
+	}
+
+	/* check that the total matches */
+	if (total_count != digest->count)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("total count does not match the data (%lld != %lld)",
+						(long long) total_count, (long long) digest->count)));
+
+	/*
+	 * Make sure we return digest with the new format (it might be the
+	 * old format, in which case "mean" fields actually store "sum", and
+	 * without the min/max/sum).
+	 */
+	if (!(digest->flags & TDIGEST_HAS_STATS))
+		tdigest_derive_stats(digest);
+
+	AssertCheckTDigest(digest);
+
+	PG_RETURN_POINTER(digest);
+}
+
+Datum
+tdigest_send(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	StringInfoData buf;
+	int			i;
+
+	pq_begintypsend(&buf);
+
+	pq_sendint(&buf, digest->flags, 4);
+	pq_sendint64(&buf, digest->count);
+	pq_sendint(&buf, digest->compression, 4);
+	pq_sendint(&buf, digest->ncentroids, 4);
+
+	pq_sendfloat8(&buf, digest->min);
+	pq_sendfloat8(&buf, digest->max);
+	pq_sendfloat8(&buf, digest->sum);
+
+	for (i = 0; i < digest->ncentroids; i++)
+	{
+		pq_sendfloat8(&buf, digest->centroids[i].mean);
+		pq_sendint64(&buf, digest->centroids[i].count);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+Datum
+tdigest_count(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest = tdigest_get_header(PG_GETARG_DATUM(0), false);
+
+	PG_RETURN_INT64(digest->count);
+}
+
+/*
+ * Accessors for the exact min/max/sum stored in the extended header. Those
+ * don't need to look at the centroids at all (except for digests built by
+ * older versions, where the values are derived from the centroids), so we
+ * only fetch the header.
+ */
+Datum
+tdigest_min(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest = PG_GETARG_TDIGEST_HEADER(0);
+
+	PG_RETURN_FLOAT8(digest->min);
+}
+
+Datum
+tdigest_max(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest = PG_GETARG_TDIGEST_HEADER(0);
 
-		check_compression(compression);
+	PG_RETURN_FLOAT8(digest->max);
+}
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+Datum
+tdigest_mean(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest = PG_GETARG_TDIGEST_HEADER(0);
 
-		if (PG_NARGS() >= 5)
-		{
-			percentiles = (double *) palloc(sizeof(double));
-			percentiles[0] = PG_GETARG_FLOAT8(4);
-			npercentiles = 1;
-			check_percentiles(percentiles, npercentiles);
-		}
+	PG_RETURN_FLOAT8(digest->sum / digest->count);
+}
 
-		state = tdigest_aggstate_allocate(npercentiles, 0, compression);
+Datum
+tdigest_sum(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest = PG_GETARG_TDIGEST_HEADER(0);
 
-		if (percentiles)
-		{
-			memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
-			pfree(percentiles);
-		}
+	PG_RETURN_FLOAT8(digest->sum);
+}
 
-		MemoryContextSwitchTo(oldcontext);
+/*
+ * tdigest_to_json
+ *		Transform the tdigest into a JSON value.
+ *
+ * Digests in the older formats (storing sum for centroids, or without the
+ * min/max/sum) are converted by tdigest_update_format first, so we always
+ * print mean. Otherwise the "mean" key would be confusing.
+ *
+ * The centroids are stored in two separate arrays - one for means, one for
+ * counts. That makes it easier to process, because it's clear the i-th
+ * in each array is for i-th centroid. We might store it in a single array,
+ * but then we'd have to walk it in pairs. And it'd mix float and int
+ * values in the same array.
+ */
+Datum
+tdigest_to_json(PG_FUNCTION_ARGS)
+{
+	int				i;
+	StringInfoData	str;
+	tdigest_t	   *digest = PG_GETARG_TDIGEST(0);
+
+	initStringInfo(&str);
+
+	appendStringInfoChar(&str, '{');
+
+	appendStringInfo(&str, "\"flags\": %d, ", digest->flags);
+	appendStringInfo(&str, "\"count\": " INT64_FORMAT ", ", digest->count);
+	appendStringInfo(&str, "\"compression\": %d, ", digest->compression);
+	appendStringInfo(&str, "\"centroids\": %d, ", digest->ncentroids);
+	appendStringInfoString(&str, "\"min\": ");
+	append_exact_double(&str, "%g", digest->min);
+	appendStringInfoString(&str, ", \"max\": ");
+	append_exact_double(&str, "%g", digest->max);
+	appendStringInfoString(&str, ", \"sum\": ");
+	append_exact_double(&str, "%g", digest->sum);
+	appendStringInfoString(&str, ", ");
+
+	appendStringInfoString(&str, "\"mean\": [");
+
+	for (i = 0; i < digest->ncentroids; i++)
+	{
+		if (i > 0)
+			appendStringInfoString(&str, ", ");
+
+		/* don't print insignificant zeroes to the right of decimal point */
+		appendStringInfo(&str, "%g", digest->centroids[i].mean);
 	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	if (PG_ARGISNULL(2))
+	appendStringInfoString(&str, "], ");
+
+	appendStringInfoString(&str, "\"count\": [");
+
+	for (i = 0; i < digest->ncentroids; i++)
 	{
-		count = 1;
+		if (i > 0)
+			appendStringInfoString(&str, ", ");
+
+		appendStringInfo(&str, INT64_FORMAT, digest->centroids[i].count);
 	}
-	else
-		count = PG_GETARG_INT64(2);
 
-	/* can't add values with non-positive counts */
-	if (count <= 0)
-		elog(ERROR, "invalid count value %lld, must be a positive value",
-			 (long long) count);
+	appendStringInfoString(&str, "]");
 
-	/*
-	 * When adding too many values (than would fit into an empty buffer, and
-	 * thus likely causing too many compactions), we instead build a t-digest
-	 * and then merge it into the existing state.
-	 *
-	 * This is much faster, because the t-digest can be generated in one go,
-	 * so there can be only one compaction at most.
-	 */
-	if (count > BUFFER_SIZE(state->compression))
+	appendStringInfoChar(&str, '}');
+
+	PG_RETURN_TEXT_P(cstring_to_text(str.data));
+}
+
+/*
+ * tdigest_to_array
+ *		Transform the tdigest into an array of double values.
+ *
+ * The whole digest is stored in a single "double precision" array, which
+ * may be a bit confusing and perhaps fragile if more fields need to be
+ * added in the future. The initial elements are flags, count (number of
+ * items added to the digest), compression (determines the limit on number
+ * of centroids) and current number of centroids. Follows stream of values
+ * encoding the centroids in pairs of (mean, count).
+ *
+ * Digests in the older formats are converted by tdigest_update_format first,
+ * so we always output mean. The min/max/sum from the extended header are
+ * not included, to keep the array format unchanged (so the flag is not set
+ * in the array either).
+ */
+Datum
+tdigest_to_array(PG_FUNCTION_ARGS)
+{
+	int				i,
+					idx;
+	tdigest_t	   *digest = PG_GETARG_TDIGEST(0);
+	double		   *values;
+	int				nvalues;
+
+	/* number of values to store in the array */
+	nvalues = 4 + (digest->ncentroids * 2);
+	values = (double *) palloc(sizeof(double) * nvalues);
+
+	idx = 0;
+	values[idx++] = (digest->flags & ~TDIGEST_HAS_STATS);
+	values[idx++] = digest->count;
+	values[idx++] = digest->compression;
+	values[idx++] = digest->ncentroids;
+
+	for (i = 0; i < digest->ncentroids; i++)
 	{
-		int			i;
-		tdigest_t  *new;
-		double		value = PG_GETARG_FLOAT8(1);
+		values[idx++] = digest->centroids[i].mean;
+		values[idx++] = digest->centroids[i].count;
+	}
 
-		new = tdigest_generate(state->compression, value, count);
+	Assert(idx == nvalues);
 
-		for (i = 0; i < new->ncentroids; i++)
-			tdigest_add_centroid(state, value, new->centroids[i].count);
+	return double_to_array(fcinfo, values, nvalues);
+}
 
-		count = 0;
+/*
+ * Build a t-digest from arrays of centroid means and counts.
+ *
+ * If the centroids are sorted by mean and fit into the buffer, we build the
+ * digest directly. Otherwise we add them to an aggregate state, and build a
+ * compacted digest from it. The min/max are derived from the centroids, as
+ * we don't know the exact values.
+ */
+Datum
+tdigest_from_arrays(PG_FUNCTION_ARGS)
+{
+	ArrayType  *means_array = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType  *counts_array = PG_GETARG_ARRAYTYPE_P(1);
+	int			compression = PG_GETARG_INT32(2);
+	double	   *means;
+	int64	   *counts;
+	int			nmeans,
+				ncounts;
+	int			i;
+	bool		sorted = true;
+	tdigest_t  *digest;
+
+	if (array_contains_nulls(means_array))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("mean value for all centroids in a t-digest must be valid")));
+
+	check_compression(compression);
+
+	means = array_to_double(fcinfo, means_array, &nmeans);
+	counts = array_to_int64(fcinfo, counts_array, &ncounts);
+
+	if (nmeans != ncounts)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of means and counts does not match (%d != %d)",
+						nmeans, ncounts)));
+
+	for (i = 0; i < nmeans; i++)
+	{
+		if (isnan(means[i]))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("mean value for all centroids in a t-digest must be valid")));
+
+		if (counts[i] <= 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("count value for all centroids in a t-digest must be positive")));
+
+		if ((i > 0) && (means[i - 1] > means[i]))
+			sorted = false;
 	}
 
-	/*
-	 * If there are only a couple values, just add them one by one, so that
-	 * we do proper compaction and sizing of centroids. Otherwise we might end
-	 * up with oversized centroid on the tails etc.
-	 */
-	for (i = 0; i < count; i++)
-		tdigest_add(state, PG_GETARG_FLOAT8(1));
+	/* sorted and small enough, so just copy the centroids */
+	if (sorted && (nmeans <= BUFFER_SIZE(compression)))
+	{
+		digest = tdigest_allocate(nmeans);
 
-	AssertCheckTDigestAggState(state);
+		digest->compression = compression;
+		digest->ncentroids = nmeans;
 
-	PG_RETURN_POINTER(state);
+		for (i = 0; i < nmeans; i++)
+		{
+			digest->centroids[i].mean = means[i];
+			digest->centroids[i].count = counts[i];
+
+			digest->count += counts[i];
+			digest->sum += means[i] * counts[i];
+		}
+
+		digest->min = means[0];
+		digest->max = means[nmeans - 1];
+	}
+	else
+	{
+		tdigest_aggstate_t *state;
+
+		state = tdigest_aggstate_allocate(0, 0, compression);
+
+		/* centroids are not exact values */
+		tdigest_leave_exact(state);
+
+		for (i = 0; i < nmeans; i++)
+		{
+			tdigest_merge_stats(state, means[i], means[i], means[i] * counts[i]);
+			tdigest_add_centroid(state, means[i], counts[i]);
+		}
+
+		digest = tdigest_aggstate_to_digest(state, true);
+	}
+
+	AssertCheckTDigest(digest);
+
+	PG_RETURN_POINTER(digest);
 }
 
 /*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with a single value.
+ * Build a t-digest from a bucketed histogram (e.g. from Prometheus or HDR
+ * histograms), without expanding the buckets into individual values.
+ *
+ * The histogram is defined by an array of bucket bounds, and an array of
+ * bucket counts (one element shorter), with bucket i covering the interval
+ * [bounds[i], bounds[i+1]]. The counts may be cumulative, in which case
+ * the count for each bucket is the difference from the preceding one.
+ *
+ * We assume the values are distributed uniformly within each bucket, and
+ * generate centroids of the largest well-formed size (just like in
+ * tdigest_generate), walking the buckets only once. A centroid may span
+ * multiple buckets, and its mean is calculated from the parts of the
+ * buckets it covers. The min/max are the bounds of the first/last bucket
+ * with a non-zero count.
  */
 Datum
-tdigest_add_double_values(PG_FUNCTION_ARGS)
+tdigest_from_histogram(PG_FUNCTION_ARGS)
 {
-	tdigest_aggstate_t *state;
+	int			compression = PG_GETARG_INT32(2);
+	bool		cumulative = PG_GETARG_BOOL(3);
+	double	   *bounds;
+	int64	   *counts;
+	int			nbounds,
+				ncounts;
+	int			i;
+	int64		total_count;
+	int64		count_so_far;
+	int64		bucket_remaining;
+	double		normalizer;
+	tdigest_t  *digest;
 
-	MemoryContext aggcontext;
+	check_compression(compression);
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double called in non-aggregate context");
+	if (array_contains_nulls(PG_GETARG_ARRAYTYPE_P(0)))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("histogram bounds must not be NULL")));
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest (if it already exists) or NULL.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+	bounds = array_to_double(fcinfo, PG_GETARG_ARRAYTYPE_P(0), &nbounds);
+	counts = array_to_int64(fcinfo, PG_GETARG_ARRAYTYPE_P(1), &ncounts);
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	if (nbounds != ncounts + 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of histogram bounds has to be number of buckets + 1 (%d != %d)",
+						nbounds, ncounts + 1)));
+
+	for (i = 0; i < nbounds; i++)
+	{
+		if (isnan(bounds[i]) || isinf(bounds[i]) ||
+			((i > 0) && (bounds[i - 1] > bounds[i])))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("histogram bounds must be finite and sorted")));
 	}
 
-	/* if there's no digest allocated, create it now */
-	if (PG_ARGISNULL(0))
+	/* translate cumulative counts to per-bucket counts */
+	for (i = ncounts - 1; i >= 0; i--)
 	{
-		int		compression = PG_GETARG_INT32(2);
-		double *values = NULL;
-		int		nvalues = 0;
-		MemoryContext	oldcontext;
+		if (cumulative && (i > 0))
+			counts[i] -= counts[i - 1];
 
-		check_compression(compression);
+		if (counts[i] < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("histogram bucket counts must not be negative")));
+	}
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+	total_count = 0;
+	for (i = 0; i < ncounts; i++)
+		total_count += counts[i];
 
-		if (PG_NARGS() >= 4)
+	if (total_count <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("histogram has to contain at least one value")));
+
+	normalizer = compression / (2 * M_PI * total_count * log(total_count));
+
+	digest = tdigest_allocate(BUFFER_SIZE(compression));
+	digest->compression = compression;
+	digest->count = total_count;
+
+	/* skip the empty buckets at the beginning */
+	i = 0;
+	while (counts[i] == 0)
+		i++;
+
+	digest->min = bounds[i];
+	bucket_remaining = counts[i];
+
+	count_so_far = 0;
+	while (count_so_far < total_count)
+	{
+		int64	centroid_count;
+		int64	remaining;
+		double	sum = 0;
+		double	mean;
+
+		centroid_count = tdigest_centroid_size(count_so_far, total_count,
+											   normalizer);
+
+		/* take the items for the centroid from the buckets, in order */
+		remaining = centroid_count;
+		while (remaining > 0)
 		{
-			values = (double *) palloc(sizeof(double));
-			values[0] = PG_GETARG_FLOAT8(3);
-			nvalues = 1;
+			int64	n = Min(remaining, bucket_remaining);
+			int64	offset = (counts[i] - bucket_remaining);
+
+			/* mean of items uniformly distributed in the bucket */
+			sum += n * (bounds[i] + (bounds[i + 1] - bounds[i]) *
+						(offset + n / 2.0) / counts[i]);
+
+			remaining -= n;
+			bucket_remaining -= n;
+
+			/* move to the next non-empty bucket (if there's one) */
+			if (bucket_remaining == 0)
+			{
+				digest->max = bounds[i + 1];
+
+				while ((i + 1 < ncounts) && (counts[++i] == 0))
+					;
+
+				bucket_remaining = counts[i];
+			}
 		}
 
-		state = tdigest_aggstate_allocate(0, nvalues, compression);
+		Assert(digest->ncentroids < BUFFER_SIZE(compression));
+
+		/* keep the means sorted, even with rounding errors */
+		mean = sum / centroid_count;
+		if (digest->ncentroids > 0)
+			mean = Max(mean, digest->centroids[digest->ncentroids - 1].mean);
 
-		if (values)
-		{
-			memcpy(state->values, values, sizeof(double) * nvalues);
-			pfree(values);
-		}
+		digest->centroids[digest->ncentroids].mean = mean;
+		digest->centroids[digest->ncentroids].count = centroid_count;
+		digest->ncentroids++;
 
-		MemoryContextSwitchTo(oldcontext);
+		digest->sum += sum;
+
+		count_so_far += centroid_count;
 	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	tdigest_add(state, PG_GETARG_FLOAT8(1));
+	/* the centroids are sorted and well-formed */
+	digest->flags |= TDIGEST_COMPACTED;
 
-	AssertCheckTDigestAggState(state);
+	/* we don't need the unused part of the buffer */
+	SET_VARSIZE(digest, offsetof(tdigest_t, centroids) +
+				digest->ncentroids * sizeof(centroid_t));
 
-	PG_RETURN_POINTER(state);
+	AssertCheckTDigest(digest);
+
+	PG_RETURN_POINTER(digest);
 }
 
 /*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with a single value.
+ * Decay a t-digest by multiplying the counts of all centroids by a factor,
+ * so that older values gradually lose weight (e.g. when combined with
+ * tdigest_add on a regular basis, or with a factor derived from the time
+ * since the last update).
+ *
+ * The counts are integers, so we can't simply scale and round each of them
+ * (centroids with small counts would never decay, or would all disappear
+ * at once). Instead we scale the cumulative counts, round them down after
+ * adding an offset in [0,1), and take differences. That distributes the
+ * rounding errors between the centroids, and with the offset picked at
+ * random it's unbiased (systematic sampling), so even centroids with a
+ * single value decay at the right rate over repeated decays. To keep the
+ * function deterministic, the offset is derived from a hash of the digest.
+ * Centroids with the count rounded to zero are dropped, so the digest does
+ * not accumulate negligible mass.
+ *
+ * The min/max are kept as long as the first/last centroid remains, and are
+ * replaced by the first/last centroid mean otherwise. The sum is estimated
+ * from the remaining centroids. If all the centroids are dropped, the
+ * result is NULL.
  */
 Datum
-tdigest_add_double_values_count(PG_FUNCTION_ARGS)
+tdigest_decay(PG_FUNCTION_ARGS)
 {
-	int64				i;
-	int64				count;
-	tdigest_aggstate_t *state;
-
-	MemoryContext aggcontext;
-
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double called in non-aggregate context");
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	double		factor = PG_GETARG_FLOAT8(1);
+	tdigest_t  *result;
+	int64		cumulative;
+	int64		prev;
+	uint64		h;
+	double		offset;
+	int			first = -1;
+	int			last = -1;
+	int			i;
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest (if it already exists) or NULL.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+	if (!(factor > 0.0 && factor <= 1.0))
+		elog(ERROR, "invalid decay factor %f, should be in (0.0, 1.0]",
+			 factor);
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+	if (factor == 1.0)
+		PG_RETURN_POINTER(digest);
 
-	/* if there's no digest allocated, create it now */
-	if (PG_ARGISNULL(0))
-	{
-		int		compression = PG_GETARG_INT32(3);
-		double *values = NULL;
-		int		nvalues = 0;
-		MemoryContext	oldcontext;
+	digest = tdigest_get_compacted(digest);
 
-		check_compression(compression);
+	/* pseudo-random offset in [0,1), derived from the count and sum */
+	memcpy(&h, &digest->sum, sizeof(uint64));
+	h = tdigest_hash_mix(h ^ tdigest_hash_mix((uint64) digest->count));
+	offset = (h >> 11) / (double) (UINT64CONST(1) << 53);
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+	result = tdigest_allocate(digest->ncentroids);
+	result->flags = digest->flags;
+	result->compression = digest->compression;
 
-		if (PG_NARGS() >= 5)
-		{
-			values = (double *) palloc(sizeof(double));
-			values[0] = PG_GETARG_FLOAT8(4);
-			nvalues = 1;
-		}
+	cumulative = 0;
+	prev = 0;
 
-		state = tdigest_aggstate_allocate(0, nvalues, compression);
+	for (i = 0; i < digest->ncentroids; i++)
+	{
+		centroid_t *c = &digest->centroids[i];
+		int64		next;
 
-		if (values)
-		{
-			memcpy(state->values, values, sizeof(double) * nvalues);
-			pfree(values);
-		}
+		cumulative += c->count;
+		next = (int64) floor(cumulative * factor + offset);
 
-		MemoryContextSwitchTo(oldcontext);
-	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+		/* rounded to zero, drop the centroid */
+		if (next == prev)
+			continue;
 
-	if (PG_ARGISNULL(2))
-	{
-		count = 1;
-	}
-	else
-		count = PG_GETARG_INT64(2);
+		result->centroids[result->ncentroids].mean = c->mean;
+		result->centroids[result->ncentroids].count = (next - prev);
+		result->ncentroids++;
 
-	/* can't add values with non-positive counts */
-	if (count <= 0)
-		elog(ERROR, "invalid count value %lld, must be a positive value",
-			 (long long) count);
+		result->count += (next - prev);
+		result->sum += c->mean * (next - prev);
 
-	/*
-	 * When adding too many values (than would fit into an empty buffer, and
-	 * thus likely causing too many compactions), we instead build a t-digest
-	 * and then merge it into the existing state.
-	 *
-	 * This is much faster, because the t-digest can be generated in one go,
-	 * so there can be only one compaction at most.
-	 */
-	if (count > BUFFER_SIZE(state->compression))
-	{
-		int			i;
-		tdigest_t  *new;
-		double		value = PG_GETARG_FLOAT8(1);
+		if (first == -1)
+			first = i;
+		last = i;
 
-		new = tdigest_generate(state->compression, value, count);
+		prev = next;
+	}
 
-		for (i = 0; i < new->ncentroids; i++)
-			tdigest_add_centroid(state, value, new->centroids[i].count);
+	if (result->ncentroids == 0)
+		PG_RETURN_NULL();
 
-		count = 0;
-	}
+	result->min = (first == 0) ? digest->min : result->centroids[0].mean;
+	result->max = (last == digest->ncentroids - 1) ? digest->max :
+				  result->centroids[result->ncentroids - 1].mean;
 
-	/*
-	 * If there are only a couple values, just add them one by one, so that
-	 * we do proper compaction and sizing of centroids. Otherwise we might end
-	 * up with oversized centroid on the tails etc.
-	 */
-	for (i = 0; i < count; i++)
-		tdigest_add(state, PG_GETARG_FLOAT8(1));
+	SET_VARSIZE(result, offsetof(tdigest_t, centroids) +
+				result->ncentroids * sizeof(centroid_t));
 
-	AssertCheckTDigestAggState(state);
+	AssertCheckTDigest(result);
 
-	PG_RETURN_POINTER(state);
+	PG_RETURN_POINTER(result);
 }
 
 /*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with a single percentile.
+ * Change compression of a t-digest, e.g. to reduce the size of digests for
+ * older data, which don't need to be as accurate.
+ *
+ * The centroids are sorted, so we can do that in a single pass, merging
+ * each centroid into the preceding one while that's allowed by the new
+ * compression (the same rule as tdigest_compact_centroids, going in one
+ * direction). Centroids can't be split, so increasing the compression
+ * does not make the digest more accurate - it only allows adding more
+ * data with the higher compression.
+ *
+ * The count, min/max and sum are not affected.
  */
 Datum
-tdigest_add_digest(PG_FUNCTION_ARGS)
+tdigest_recompress(PG_FUNCTION_ARGS)
 {
-	int					i;
-	tdigest_aggstate_t *state;
-	tdigest_t		   *digest;
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	int			compression = PG_GETARG_INT32(1);
+	tdigest_t  *result;
+	centroid_t *cur;
+	int64		count_so_far;
+	int64		total_count;
+	double		denom;
+	double		normalizer;
+	int			i;
 
-	MemoryContext aggcontext;
+	check_compression(compression);
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_digest called in non-aggregate context");
+	digest = tdigest_get_compacted(digest);
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest (if it already exists) or NULL.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+	if (digest->compression == compression)
+		PG_RETURN_POINTER(digest);
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+	total_count = digest->count;
+	denom = 2 * M_PI * total_count * log(total_count);
+	normalizer = compression / denom;
 
-	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+	result = tdigest_allocate(digest->ncentroids);
+	result->flags = digest->flags;
+	result->compression = compression;
+	result->count = digest->count;
+	result->min = digest->min;
+	result->max = digest->max;
+	result->sum = digest->sum;
 
-	/* make sure we get digest with the new format */
-	digest = tdigest_update_format(digest);
+	cur = &result->centroids[0];
+	count_so_far = 0;
 
-	/* make sure the t-digest format is supported */
-	if (digest->flags != TDIGEST_STORES_MEAN)
-		elog(ERROR, "unsupported t-digest on-disk format");
+	if (digest->ncentroids > 0)
+	{
+		*cur = digest->centroids[0];
+		result->ncentroids = 1;
+	}
 
-	/* if there's no aggregate state allocated, create it now */
-	if (PG_ARGISNULL(0))
+	for (i = 1; i < digest->ncentroids; i++)
 	{
-		double *percentiles = NULL;
-		int		npercentiles = 0;
+		centroid_t *c = &digest->centroids[i];
+		int64	proposed_count;
+		double	q0;
+		double	q2;
+		double	z;
 
-		MemoryContext	oldcontext;
+		proposed_count = cur->count + c->count;
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+		z = proposed_count * normalizer;
+		q0 = count_so_far / (double) total_count;
+		q2 = (count_so_far + proposed_count) / (double) total_count;
 
-		if (PG_NARGS() >= 3)
+		if ((z <= (q0 * (1 - q0))) && (z <= (q2 * (1 - q2))))
 		{
-			percentiles = (double *) palloc(sizeof(double));
-			percentiles[0] = PG_GETARG_FLOAT8(2);
-			npercentiles = 1;
+			/* keep the means equal, if possible (see compact_centroids) */
+			if (cur->mean != c->mean)
+				cur->mean = (cur->count * cur->mean + c->count * c->mean) /
+							proposed_count;
 
-			check_percentiles(percentiles, npercentiles);
+			cur->count = proposed_count;
 		}
-
-		state = tdigest_aggstate_allocate(npercentiles, 0, digest->compression);
-
-		if (percentiles)
+		else
 		{
-			memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
-			pfree(percentiles);
+			count_so_far += cur->count;
+			cur = &result->centroids[result->ncentroids++];
+			*cur = *c;
 		}
+	}
 
-		MemoryContextSwitchTo(oldcontext);
+	SET_VARSIZE(result, offsetof(tdigest_t, centroids) +
+				result->ncentroids * sizeof(centroid_t));
+
+	AssertCheckTDigest(result);
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * Number of values in a (compacted) t-digest not greater than the value,
+ * assuming the values of each centroid are spread uniformly between the
+ * midpoints to the adjacent centroids (or min/max for the first/last one).
+ *
+ * Called with increasing values, so that we can continue from the centroid
+ * determined by the previous call (index and count of preceding centroids).
+ */
+static double
+tdigest_count_below(tdigest_t *digest, double value, int *index, int64 *count)
+{
+	int		i = *index;
+	double	lo;
+	double	hi;
+
+	for (; i < digest->ncentroids; i++)
+	{
+		hi = (i == digest->ncentroids - 1) ? digest->max :
+			 (digest->centroids[i].mean + digest->centroids[i + 1].mean) / 2;
+
+		if (hi > value)
+			break;
+
+		*count += digest->centroids[i].count;
 	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	/*
-	 * XXX should it be allowed to add digest to a state with a different
-	 * compression value? Will it produce a "good" t-digest or does it break
-	 * the assumptions and produce much worse estimates?
-	 */
+	*index = i;
 
-	/* copy data from the tdigest into the aggstate */
-	for (i = 0; i < digest->ncentroids; i++)
-		tdigest_add_centroid(state, digest->centroids[i].mean,
-									digest->centroids[i].count);
+	if (i == digest->ncentroids)
+		return *count;
 
-	AssertCheckTDigestAggState(state);
+	lo = (i == 0) ? digest->min :
+		 (digest->centroids[i - 1].mean + digest->centroids[i].mean) / 2;
 
-	PG_RETURN_POINTER(state);
+	if (value <= lo)
+		return *count;
+
+	return *count + digest->centroids[i].count * (value - lo) / (hi - lo);
 }
 
 /*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with a single value.
+ * Subtract a t-digest from another t-digest, e.g. to remove values deleted
+ * from a table from a digest maintained by a trigger.
+ *
+ * We only have the centroids, so we can't remove the exact values. Instead
+ * we treat the centroids of the first digest as ranges of values between
+ * midpoints to the adjacent centroids, and reduce the count of each of them
+ * by the number of values the subtracted digest has in the range. Both
+ * digests are sorted, so that's a single merge pass over the centroids.
+ * The counts are rounded using the cumulative counts, and if a centroid
+ * does not have enough values, the rest is taken from the following ones
+ * (or preceding ones, at the end). The means are not modified, so the
+ * result remains sorted. Centroids with the count reduced to zero are
+ * dropped.
+ *
+ * The result is accurate only if the subtracted values were actually added
+ * to the first digest, but that's not something we can check. We only
+ * check the subtracted digest does not have more values than the first
+ * one. If it has the same number of values, the result is NULL.
+ *
+ * The sum is calculated by subtracting the sums, and the min/max are kept
+ * as long as the first/last centroid remains (and are replaced by the mean
+ * of the first/last centroid otherwise).
  */
 Datum
-tdigest_add_digest_values(PG_FUNCTION_ARGS)
+tdigest_subtract(PG_FUNCTION_ARGS)
 {
-	int					i;
-	tdigest_aggstate_t *state;
-	tdigest_t		   *digest;
-
-	MemoryContext aggcontext;
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	tdigest_t  *other = PG_GETARG_TDIGEST(1);
+	tdigest_t  *result;
+	int64	   *counts;
+	int64		remove;
+	int64		prev;
+	int64		count;
+	int			index;
+	int			first = -1;
+	int			last = -1;
+	int			i;
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_digest called in non-aggregate context");
+	if (other->count > digest->count)
+		elog(ERROR, "can't subtract t-digest with " INT64_FORMAT " values from t-digest with " INT64_FORMAT " values",
+			 other->count, digest->count);
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest (if it already exists) or NULL.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+	if (other->count == 0)
+		PG_RETURN_POINTER(digest);
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+	if (other->count == digest->count)
+		PG_RETURN_NULL();
 
-	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+	digest = tdigest_get_compacted(digest);
+	other = tdigest_get_compacted(other);
 
-	/* make sure we get digest with the new format */
-	digest = tdigest_update_format(digest);
+	counts = (int64 *) palloc(sizeof(int64) * digest->ncentroids);
 
-	/* make sure the t-digest format is supported */
-	if (digest->flags != TDIGEST_STORES_MEAN)
-		elog(ERROR, "unsupported t-digest on-disk format");
+	index = 0;
+	count = 0;
+	prev = 0;
+	remove = 0;
 
-	/* if there's no aggregate state allocated, create it now */
-	if (PG_ARGISNULL(0))
+	for (i = 0; i < digest->ncentroids; i++)
 	{
-		double *values = NULL;
-		int		nvalues = 0;
+		int64	next;
+		int64	n;
+
+		/* subtracted values up to the midpoint to the next centroid */
+		if (i < digest->ncentroids - 1)
+			next = llround(tdigest_count_below(other,
+											   (digest->centroids[i].mean +
+												digest->centroids[i + 1].mean) / 2,
+											   &index, &count));
+		else
+			next = other->count;
 
-		MemoryContext	oldcontext;
+		/* values we failed to remove from the preceding centroids */
+		remove += (next - prev);
+		prev = next;
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+		n = Min(remove, digest->centroids[i].count);
 
-		if (PG_NARGS() >= 3)
-		{
-			values = (double *) palloc(sizeof(double));
-			values[0] = PG_GETARG_FLOAT8(2);
-			nvalues = 1;
-		}
+		counts[i] = digest->centroids[i].count - n;
+		remove -= n;
+	}
+
+	/* remove the remaining values from the last centroids */
+	for (i = digest->ncentroids - 1; (i >= 0) && (remove > 0); i--)
+	{
+		int64	n = Min(remove, counts[i]);
+
+		counts[i] -= n;
+		remove -= n;
+	}
 
-		state = tdigest_aggstate_allocate(0, nvalues, digest->compression);
+	Assert(remove == 0);
 
-		if (values)
-		{
-			memcpy(state->values, values, sizeof(double) * nvalues);
-			pfree(values);
-		}
+	result = tdigest_allocate(digest->ncentroids);
+	result->flags = digest->flags;
+	result->compression = digest->compression;
+	result->count = (digest->count - other->count);
+	result->sum = (digest->sum - other->sum);
 
-		MemoryContextSwitchTo(oldcontext);
+	for (i = 0; i < digest->ncentroids; i++)
+	{
+		if (counts[i] == 0)
+			continue;
+
+		result->centroids[result->ncentroids].mean = digest->centroids[i].mean;
+		result->centroids[result->ncentroids].count = counts[i];
+		result->ncentroids++;
+
+		if (first == -1)
+			first = i;
+		last = i;
 	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	/*
-	 * XXX should it be allowed to add digest to a state with a different
-	 * compression value? Will it produce a "good" t-digest or does it break
-	 * the assumptions and produce much worse estimates?
-	 */
+	pfree(counts);
 
-	for (i = 0; i < digest->ncentroids; i++)
-		tdigest_add_centroid(state, digest->centroids[i].mean,
-									digest->centroids[i].count);
+	Assert(result->ncentroids > 0);
 
-	AssertCheckTDigestAggState(state);
+	result->min = (first == 0) ? digest->min : result->centroids[0].mean;
+	result->max = (last == digest->ncentroids - 1) ? digest->max :
+				  result->centroids[result->ncentroids - 1].mean;
 
-	PG_RETURN_POINTER(state);
+	SET_VARSIZE(result, offsetof(tdigest_t, centroids) +
+				result->ncentroids * sizeof(centroid_t));
+
+	AssertCheckTDigest(result);
+
+	PG_RETURN_POINTER(result);
 }
 
 /*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with an array of percentiles.
+ * Build a sliding window from the bucket digests (in slot order, NULL for
+ * empty buckets), and the merged digest for all the buckets.
  */
-Datum
-tdigest_add_double_array(PG_FUNCTION_ARGS)
+static tdigest_window_t *
+tdigest_window_build(int nbuckets, int compression, int64 position,
+					 tdigest_t **buckets)
 {
+	int			i;
+	Size		len;
+	uint32		offset;
+	tdigest_t  *merged = NULL;
+	tdigest_window_t *window;
 	tdigest_aggstate_t *state;
 
-	MemoryContext aggcontext;
+	state = tdigest_aggstate_allocate(0, 0, compression);
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double_array called in non-aggregate context");
+	len = TDIGEST_WINDOW_HEADER(nbuckets);
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest or NULL.
-	 */
-	if (PG_ARGISNULL(1))
+	for (i = 0; i < nbuckets; i++)
 	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+		if (buckets[i] == NULL)
+			continue;
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+		tdigest_add_digest_centroids(state, buckets[i]);
+		len += MAXALIGN(VARSIZE(buckets[i]));
 	}
 
-	/* if there's no digest allocated, create it now */
-	if (PG_ARGISNULL(0))
+	if (state->count > 0)
 	{
-		int compression = PG_GETARG_INT32(2);
-		double *percentiles;
-		int		npercentiles;
-		MemoryContext	oldcontext;
-
-		check_compression(compression);
+		merged = tdigest_aggstate_to_digest(state, true);
+		len += MAXALIGN(VARSIZE(merged));
+	}
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+	window = (tdigest_window_t *) palloc0(len);
+	SET_VARSIZE(window, len);
 
-		percentiles = array_to_double(fcinfo,
-									  PG_GETARG_ARRAYTYPE_P(3),
-									  &npercentiles);
+	window->flags = 0;
+	window->nbuckets = nbuckets;
+	window->compression = compression;
+	window->position = position;
 
-		check_percentiles(percentiles, npercentiles);
+	/* the merged digest goes first, so that it can be fetched as a slice */
+	offset = TDIGEST_WINDOW_HEADER(nbuckets);
 
-		state = tdigest_aggstate_allocate(npercentiles, 0, compression);
+	for (i = 0; i <= nbuckets; i++)
+	{
+		tdigest_t  *digest = (i == 0) ? merged : buckets[i - 1];
 
-		memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
+		if (digest == NULL)
+			continue;
 
-		pfree(percentiles);
+		memcpy((char *) window + offset, digest, VARSIZE(digest));
 
-		MemoryContextSwitchTo(oldcontext);
+		window->offsets[i] = offset;
+		offset += MAXALIGN(VARSIZE(digest));
 	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	tdigest_add(state, PG_GETARG_FLOAT8(1));
+	Assert(offset == len);
 
-	AssertCheckTDigestAggState(state);
+	return window;
+}
 
-	PG_RETURN_POINTER(state);
+/*
+ * Get the bucket digests of a window, in slot order.
+ */
+static tdigest_t **
+tdigest_window_buckets(tdigest_window_t *window)
+{
+	int			i;
+	tdigest_t **buckets = palloc(sizeof(tdigest_t *) * window->nbuckets);
+
+	for (i = 0; i < window->nbuckets; i++)
+		buckets[i] = TDIGEST_WINDOW_DIGEST(window, i + 1);
+
+	return buckets;
+}
+
+static void
+check_window_buckets(int nbuckets)
+{
+	if (nbuckets < 1 || nbuckets > MAX_WINDOW_BUCKETS)
+		elog(ERROR, "invalid number of buckets %d, should be in [1, %d]",
+			 nbuckets, MAX_WINDOW_BUCKETS);
 }
 
 /*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with an array of percentiles.
+ * Add a digest (or NULL) to a bucket of the window. If the bucket is newer
+ * than the current position, the window moves first, and buckets falling
+ * out of it are evicted. Data for buckets already out of the window are
+ * ignored.
  */
-Datum
-tdigest_add_double_array_count(PG_FUNCTION_ARGS)
+static tdigest_window_t *
+tdigest_window_update(tdigest_window_t *window, int64 bucket,
+					  tdigest_t *digest)
 {
-	int64				i;
-	int64				count;
-	tdigest_aggstate_t *state;
+	int			nbuckets = window->nbuckets;
+	int64		position = window->position;
+	tdigest_t **buckets;
 
-	MemoryContext aggcontext;
+	/* the position of an empty window does not matter */
+	if (window->offsets[0] == 0)
+		position = bucket;
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double_array called in non-aggregate context");
+	/* too old, or moving to the current position (nothing to do) */
+	if ((bucket <= position - nbuckets) ||
+		((digest == NULL) && (bucket <= position)))
+		return window;
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest or NULL.
-	 */
-	if (PG_ARGISNULL(1))
+	buckets = tdigest_window_buckets(window);
+
+	/* evict buckets that fall out of the window (slots of the new buckets) */
+	if (bucket > position)
 	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+		int64	b;
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+		for (b = Max(position + 1, bucket - nbuckets + 1); b <= bucket; b++)
+			buckets[TDIGEST_WINDOW_SLOT(nbuckets, b)] = NULL;
+
+		position = bucket;
 	}
 
-	/* if there's no digest allocated, create it now */
-	if (PG_ARGISNULL(0))
+	if (digest != NULL)
 	{
-		int compression = PG_GETARG_INT32(3);
-		double *percentiles;
-		int		npercentiles;
-		MemoryContext	oldcontext;
+		int			slot = TDIGEST_WINDOW_SLOT(nbuckets, bucket);
+		tdigest_aggstate_t *state;
 
-		check_compression(compression);
+		state = tdigest_aggstate_allocate(0, 0, window->compression);
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+		if (buckets[slot] != NULL)
+			tdigest_add_digest_centroids(state, buckets[slot]);
 
-		percentiles = array_to_double(fcinfo,
-									  PG_GETARG_ARRAYTYPE_P(4),
-									  &npercentiles);
+		tdigest_add_digest_centroids(state, digest);
 
-		check_percentiles(percentiles, npercentiles);
+		buckets[slot] = tdigest_aggstate_to_digest(state, true);
+	}
 
-		state = tdigest_aggstate_allocate(npercentiles, 0, compression);
+	return tdigest_window_build(nbuckets, window->compression, position,
+								buckets);
+}
 
-		memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
+/*
+ * Create an empty sliding window with the given number of buckets.
+ */
+Datum
+tdigest_window_create(PG_FUNCTION_ARGS)
+{
+	int			nbuckets = PG_GETARG_INT32(0);
+	int			compression = PG_GETARG_INT32(1);
+	tdigest_t **buckets;
 
-		pfree(percentiles);
+	check_window_buckets(nbuckets);
+	check_compression(compression);
 
-		MemoryContextSwitchTo(oldcontext);
-	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	buckets = palloc0(sizeof(tdigest_t *) * nbuckets);
 
-	if (PG_ARGISNULL(2))
-	{
-		count = 1;
-	}
-	else
-		count = PG_GETARG_INT64(2);
+	PG_RETURN_POINTER(tdigest_window_build(nbuckets, compression, 0, buckets));
+}
 
-	/* can't add values with non-positive counts */
-	if (count <= 0)
-		elog(ERROR, "invalid count value %lld, must be a positive value",
-			 (long long) count);
+/*
+ * Add a digest to a bucket of the window (moving the window if needed).
+ */
+Datum
+tdigest_window_add(PG_FUNCTION_ARGS)
+{
+	tdigest_window_t *window = PG_GETARG_TDIGEST_WINDOW(0);
+	int64		bucket = PG_GETARG_INT64(1);
+	tdigest_t  *digest = PG_GETARG_TDIGEST(2);
 
-	/*
-	 * Add the values one by one, not as one large centroid with the count.
-	 * We do it like this to allow proper compaction and sizing of centroids,
-	 * otherwise we might end up with oversized centroid on the tails etc.
-	 *
-	 * XXX If this turns out a bit too expensive, we may try determining the
-	 * size by looking for the smallest centroid covering this value.
-	 */
-	for (i = 0; i < count; i++)
-		tdigest_add(state, PG_GETARG_FLOAT8(1));
+	AssertCheckTDigest(digest);
 
-	AssertCheckTDigestAggState(state);
+	PG_RETURN_POINTER(tdigest_window_update(window, bucket, digest));
+}
 
-	PG_RETURN_POINTER(state);
+/*
+ * Move the window to a bucket, evicting the buckets falling out of it.
+ */
+Datum
+tdigest_window_advance(PG_FUNCTION_ARGS)
+{
+	tdigest_window_t *window = PG_GETARG_TDIGEST_WINDOW(0);
+	int64		bucket = PG_GETARG_INT64(1);
+
+	PG_RETURN_POINTER(tdigest_window_update(window, bucket, NULL));
 }
 
 /*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with an array of values.
+ * Get the merged digest for all buckets of the window (NULL if empty).
+ *
+ * The merged digest is stored right after the offsets, so for windows
+ * stored out of line we only fetch the slices with the header and the
+ * merged digest, not the bucket digests.
  */
 Datum
-tdigest_add_double_array_values(PG_FUNCTION_ARGS)
+tdigest_window_digest(PG_FUNCTION_ARGS)
 {
-	tdigest_aggstate_t *state;
+	Datum		value = PG_GETARG_DATUM(0);
+	struct varlena *ptr = (struct varlena *) DatumGetPointer(value);
+	tdigest_window_t *window;
+	tdigest_t  *merged;
+	tdigest_t  *result;
+
+	if (!VARATT_IS_EXTENDED(ptr))
+		window = (tdigest_window_t *) ptr;
+	else
+	{
+		int			i;
+		int			nbuckets;
+		uint32		end = 0;
 
-	MemoryContext aggcontext;
+		window = (tdigest_window_t *) PG_DETOAST_DATUM_SLICE(value, 0,
+						offsetof(tdigest_window_t, offsets) - VARHDRSZ);
+		nbuckets = window->nbuckets;
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double_array called in non-aggregate context");
+		window = (tdigest_window_t *) PG_DETOAST_DATUM_SLICE(value, 0,
+						TDIGEST_WINDOW_HEADER(nbuckets) - VARHDRSZ);
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest or NULL.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
+		if (window->offsets[0] == 0)
 			PG_RETURN_NULL();
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+		/* the merged digest ends where the first bucket starts */
+		for (i = 1; i <= nbuckets; i++)
+		{
+			if ((window->offsets[i] != 0) &&
+				((end == 0) || (window->offsets[i] < end)))
+				end = window->offsets[i];
+		}
+
+		window = (tdigest_window_t *) PG_DETOAST_DATUM_SLICE(value, 0,
+						end - VARHDRSZ);
 	}
 
-	/* if there's no digest allocated, create it now */
-	if (PG_ARGISNULL(0))
-	{
-		int compression = PG_GETARG_INT32(2);
-		double *values;
-		int		nvalues;
-		MemoryContext	oldcontext;
+	merged = TDIGEST_WINDOW_DIGEST(window, 0);
 
-		check_compression(compression);
+	if (merged == NULL)
+		PG_RETURN_NULL();
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+	/* copy the digest, so that it does not point into the window */
+	result = (tdigest_t *) palloc(VARSIZE(merged));
+	memcpy(result, merged, VARSIZE(merged));
 
-		values = array_to_double(fcinfo,
-								 PG_GETARG_ARRAYTYPE_P(3),
-								 &nvalues);
+	PG_RETURN_POINTER(result);
+}
 
-		state = tdigest_aggstate_allocate(0, nvalues, compression);
+Datum
+tdigest_window_in(PG_FUNCTION_ARGS)
+{
+	char	   *str = PG_GETARG_CSTRING(0);
+	int			nbuckets;
+	int			compression;
+	int64		position;
+	int			nbytes = -1;
+	int			i;
+	char	   *ptr;
+	tdigest_t **buckets;
 
-		memcpy(state->values, values, sizeof(double) * nvalues);
+	if ((sscanf(str, "buckets %d compression %d position " INT64_FORMAT "%n",
+				&nbuckets, &compression, &position, &nbytes) != 3) ||
+		(nbytes < 0))
+		elog(ERROR, "failed to parse t-digest window value");
 
-		pfree(values);
+	check_window_buckets(nbuckets);
+	check_compression(compression);
 
-		MemoryContextSwitchTo(oldcontext);
+	buckets = palloc0(sizeof(tdigest_t *) * nbuckets);
+
+	/* the buckets are listed from the oldest one */
+	ptr = str + nbytes;
+	for (i = 0; i < nbuckets; i++)
+	{
+		char	   *end;
+		int64		bucket = position - nbuckets + 1 + i;
+
+		while (*ptr == ' ')
+			ptr++;
+
+		if ((*ptr != '[') || ((end = strchr(ptr, ']')) == NULL))
+			elog(ERROR, "failed to parse t-digest window value");
+
+		if (end > ptr + 1)
+		{
+			char	   *digest = pnstrdup(ptr + 1, end - ptr - 1);
+
+			buckets[TDIGEST_WINDOW_SLOT(nbuckets, bucket)] =
+				tdigest_update_format((tdigest_t *)
+					DatumGetPointer(DirectFunctionCall1(tdigest_in,
+														CStringGetDatum(digest))));
+		}
+
+		ptr = end + 1;
 	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	tdigest_add(state, PG_GETARG_FLOAT8(1));
+	if (*ptr != '\0')
+		elog(ERROR, "failed to parse t-digest window value");
 
-	AssertCheckTDigestAggState(state);
+	PG_RETURN_POINTER(tdigest_window_build(nbuckets, compression, position,
+										   buckets));
+}
 
-	PG_RETURN_POINTER(state);
+Datum
+tdigest_window_out(PG_FUNCTION_ARGS)
+{
+	tdigest_window_t *window = PG_GETARG_TDIGEST_WINDOW(0);
+	StringInfoData	str;
+	int			i;
+
+	initStringInfo(&str);
+
+	appendStringInfo(&str, "buckets %d compression %d position " INT64_FORMAT,
+					 window->nbuckets, window->compression, window->position);
+
+	/* from the oldest bucket (the merged digest is not included) */
+	for (i = 0; i < window->nbuckets; i++)
+	{
+		int64		bucket = window->position - window->nbuckets + 1 + i;
+		tdigest_t  *digest;
+
+		digest = TDIGEST_WINDOW_DIGEST(window,
+						TDIGEST_WINDOW_SLOT(window->nbuckets, bucket) + 1);
+
+		if (digest == NULL)
+			appendStringInfoString(&str, " []");
+		else
+			appendStringInfo(&str, " [%s]",
+							 DatumGetCString(DirectFunctionCall1(tdigest_out,
+													PointerGetDatum(digest))));
+	}
+
+	PG_RETURN_CSTRING(str.data);
 }
 
-/*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with an array of values.
- */
 Datum
-tdigest_add_double_array_values_count(PG_FUNCTION_ARGS)
+tdigest_window_recv(PG_FUNCTION_ARGS)
 {
-	int64				i;
-	int64				count;
-	tdigest_aggstate_t *state;
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	int32		flags;
+	int32		nbuckets;
+	int32		compression;
+	int64		position;
+	int			i;
+	tdigest_t **buckets;
+
+	flags = pq_getmsgint(buf, sizeof(int32));
 
-	MemoryContext aggcontext;
+	if (flags != 0)
+		elog(ERROR, "unsupported t-digest window on-disk format");
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double_array called in non-aggregate context");
+	nbuckets = pq_getmsgint(buf, sizeof(int32));
+	compression = pq_getmsgint(buf, sizeof(int32));
+	position = pq_getmsgint64(buf);
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest or NULL.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+	check_window_buckets(nbuckets);
+	check_compression(compression);
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+	buckets = palloc0(sizeof(tdigest_t *) * nbuckets);
 
-	/* if there's no digest allocated, create it now */
-	if (PG_ARGISNULL(0))
+	/* from the oldest bucket, each digest prefixed by length (0 if empty) */
+	for (i = 0; i < nbuckets; i++)
 	{
-		int compression = PG_GETARG_INT32(3);
-		double *values;
-		int		nvalues;
-		MemoryContext	oldcontext;
+		int64		bucket = position - nbuckets + 1 + i;
+		int32		len = pq_getmsgint(buf, sizeof(int32));
+		StringInfoData	digest;
 
-		check_compression(compression);
+		if (len == 0)
+			continue;
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+		digest.data = (char *) pq_getmsgbytes(buf, len);
+		digest.len = len;
+		digest.maxlen = len;
+		digest.cursor = 0;
 
-		values = array_to_double(fcinfo,
-								 PG_GETARG_ARRAYTYPE_P(4),
-								 &nvalues);
+		buckets[TDIGEST_WINDOW_SLOT(nbuckets, bucket)] =
+			tdigest_update_format((tdigest_t *)
+				DatumGetPointer(DirectFunctionCall1(tdigest_recv,
+													PointerGetDatum(&digest))));
+	}
 
-		state = tdigest_aggstate_allocate(0, nvalues, compression);
+	PG_RETURN_POINTER(tdigest_window_build(nbuckets, compression, position,
+										   buckets));
+}
 
-		memcpy(state->values, values, sizeof(double) * nvalues);
+Datum
+tdigest_window_send(PG_FUNCTION_ARGS)
+{
+	tdigest_window_t *window = PG_GETARG_TDIGEST_WINDOW(0);
+	StringInfoData buf;
+	int			i;
 
-		pfree(values);
+	pq_begintypsend(&buf);
 
-		MemoryContextSwitchTo(oldcontext);
-	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	pq_sendint(&buf, window->flags, 4);
+	pq_sendint(&buf, window->nbuckets, 4);
+	pq_sendint(&buf, window->compression, 4);
+	pq_sendint64(&buf, window->position);
 
-	if (PG_ARGISNULL(2))
+	for (i = 0; i < window->nbuckets; i++)
 	{
-		count = 1;
-	}
-	else
-		count = PG_GETARG_INT64(2);
+		int64		bucket = window->position - window->nbuckets + 1 + i;
+		tdigest_t  *digest;
+		bytea	   *data;
 
-	/* can't add values with non-positive counts */
-	if (count <= 0)
-		elog(ERROR, "invalid count value %lld, must be a positive value",
-			 (long long) count);
+		digest = TDIGEST_WINDOW_DIGEST(window,
+						TDIGEST_WINDOW_SLOT(window->nbuckets, bucket) + 1);
 
-	/*
-	 * Add the values one by one, not as one large centroid with the count.
-	 * We do it like this to allow proper compaction and sizing of centroids,
-	 * otherwise we might end up with oversized centroid on the tails etc.
-	 *
-	 * XXX If this turns out a bit too expensive, we may try determining the
-	 * size by looking for the smallest centroid covering this value.
-	 */
-	for (i = 0; i < count; i++)
-		tdigest_add(state, PG_GETARG_FLOAT8(1));
+		if (digest == NULL)
+		{
+			pq_sendint(&buf, 0, 4);
+			continue;
+		}
 
-	AssertCheckTDigestAggState(state);
+		data = (bytea *) DatumGetPointer(DirectFunctionCall1(tdigest_send,
+															 PointerGetDatum(digest)));
 
-	PG_RETURN_POINTER(state);
+		pq_sendint(&buf, VARSIZE(data) - VARHDRSZ, 4);
+		pq_sendbytes(&buf, VARDATA(data), VARSIZE(data) - VARHDRSZ);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
 }
 
-/*
- * Add a digest to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with an array of percentiles.
- */
 Datum
-tdigest_add_digest_array(PG_FUNCTION_ARGS)
+tdigest_add_double_trimmed(PG_FUNCTION_ARGS)
 {
-	int					i;
 	tdigest_aggstate_t *state;
-	tdigest_t		   *digest;
 
 	MemoryContext aggcontext;
 
 	/* cannot be called directly because of internal-type argument */
 	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_digest_array called in non-aggregate context");
+		elog(ERROR, "tdigest_add_double_mean called in non-aggregate context");
 
 	/*
 	 * We want to skip NULL values altogether - we return either the existing
@@ -1929,72 +6002,48 @@ tdigest_add_digest_array(PG_FUNCTION_ARGS)
 		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
 	}
 
-	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
-
-	/* make sure we get digest with the new format */
-	digest = tdigest_update_format(digest);
-
-	/* make sure the t-digest format is supported */
-	if (digest->flags != TDIGEST_STORES_MEAN)
-		elog(ERROR, "unsupported t-digest on-disk format");
-
-	/* if there's no aggregate state allocated, create it now */
+	/* if there's no digest allocated, create it now */
 	if (PG_ARGISNULL(0))
 	{
-		double *percentiles;
-		int		npercentiles;
-		MemoryContext	oldcontext;
-
-		oldcontext = MemoryContextSwitchTo(aggcontext);
-
-		percentiles = array_to_double(fcinfo,
-									  PG_GETARG_ARRAYTYPE_P(2),
-									  &npercentiles);
+		MemoryContext oldcontext;
+		int		compression = PG_GETARG_INT32(2);
+		double	low = PG_GETARG_FLOAT8(3);
+		double	high = PG_GETARG_FLOAT8(4);
 
-		check_percentiles(percentiles, npercentiles);
+		check_compression(compression);
 
-		state = tdigest_aggstate_allocate(npercentiles, 0, digest->compression);
+		check_trim_values(low, high);
 
-		memcpy(state->percentiles, percentiles, sizeof(double) * npercentiles);
+		oldcontext = MemoryContextSwitchTo(aggcontext);
 
-		pfree(percentiles);
+		state = tdigest_aggstate_allocate(0, 0, compression);
+		state->trim_low = low;
+		state->trim_high = high;
 
 		MemoryContextSwitchTo(oldcontext);
 	}
 	else
 		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	/*
-	 * XXX should it be allowed to add digest to a state with a different
-	 * compression value? Will it produce a "good" t-digest or does it break
-	 * the assumptions and produce much worse estimates?
-	 */
-
-	for (i = 0; i < digest->ncentroids; i++)
-		tdigest_add_centroid(state, digest->centroids[i].mean,
-									digest->centroids[i].count);
+	tdigest_add(state, PG_GETARG_FLOAT8(1));
 
 	AssertCheckTDigestAggState(state);
 
 	PG_RETURN_POINTER(state);
 }
 
-/*
- * Add a digest to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with an array of values.
- */
 Datum
-tdigest_add_digest_array_values(PG_FUNCTION_ARGS)
+tdigest_add_double_count_trimmed(PG_FUNCTION_ARGS)
 {
-	int					i;
+	int		i;
+	int64	count;
 	tdigest_aggstate_t *state;
-	tdigest_t		   *digest;
 
 	MemoryContext aggcontext;
 
 	/* cannot be called directly because of internal-type argument */
 	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_digest_array called in non-aggregate context");
+		elog(ERROR, "tdigest_add_double_mean called in non-aggregate context");
 
 	/*
 	 * We want to skip NULL values altogether - we return either the existing
@@ -2009,421 +6058,342 @@ tdigest_add_digest_array_values(PG_FUNCTION_ARGS)
 		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
 	}
 
-	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
-
-	/* make sure we get digest with the new format */
-	digest = tdigest_update_format(digest);
-
-	/* make sure the t-digest format is supported */
-	if (digest->flags != TDIGEST_STORES_MEAN)
-		elog(ERROR, "unsupported t-digest on-disk format");
-
-	/* if there's no aggregate state allocated, create it now */
+	/* if there's no digest allocated, create it now */
 	if (PG_ARGISNULL(0))
 	{
-		double *values;
-		int		nvalues;
-		MemoryContext	oldcontext;
-
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+		MemoryContext oldcontext;
+		int		compression = PG_GETARG_INT32(3);
+		double	low = PG_GETARG_FLOAT8(4);
+		double	high = PG_GETARG_FLOAT8(5);
 
-		values = array_to_double(fcinfo,
-								 PG_GETARG_ARRAYTYPE_P(2),
-								 &nvalues);
+		check_compression(compression);
 
-		state = tdigest_aggstate_allocate(0, nvalues, digest->compression);
+		check_trim_values(low, high);
 
-		memcpy(state->values, values, sizeof(double) * nvalues);
+		oldcontext = MemoryContextSwitchTo(aggcontext);
 
-		pfree(values);
+		state = tdigest_aggstate_allocate(0, 0, compression);
+		state->trim_low = low;
+		state->trim_high = high;
 
 		MemoryContextSwitchTo(oldcontext);
 	}
 	else
 		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	/*
-	 * XXX should it be allowed to add digest to a state with a different
-	 * compression value? Will it produce a "good" t-digest or does it break
-	 * the assumptions and produce much worse estimates?
-	 */
-
-	for (i = 0; i < digest->ncentroids; i++)
-		tdigest_add_centroid(state, digest->centroids[i].mean,
-									digest->centroids[i].count);
-
-	AssertCheckTDigestAggState(state);
-
-	PG_RETURN_POINTER(state);
-}
-
-/*
- * Compute percentile from a tdigest. Final function for tdigest aggregate
- * with a single percentile.
- */
-Datum
-tdigest_percentiles(PG_FUNCTION_ARGS)
-{
-	tdigest_aggstate_t	   *state;
-	MemoryContext	aggcontext;
-	double			ret;
-
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_percentiles called in non-aggregate context");
-
-	/* if there's no digest, return NULL */
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
-
-	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
-
-	tdigest_compute_quantiles(state, &ret);
-
-	PG_RETURN_FLOAT8(ret);
-}
-
-/*
- * Compute percentile from a tdigest. Final function for tdigest aggregate
- * with a single percentile.
- */
-Datum
-tdigest_percentiles_of(PG_FUNCTION_ARGS)
-{
-	tdigest_aggstate_t	   *state;
-	MemoryContext	aggcontext;
-	double			ret;
-
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_percentiles_of called in non-aggregate context");
-
-	/* if there's no digest, return NULL */
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
-
-	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
-
-	tdigest_compute_quantiles_of(state, &ret);
-
-	PG_RETURN_FLOAT8(ret);
-}
-
-/*
- * Build a t-digest varlena value from the aggegate state.
- */
-Datum
-tdigest_digest(PG_FUNCTION_ARGS)
-{
-	tdigest_t			   *digest;
-	tdigest_aggstate_t	   *state;
-	MemoryContext	aggcontext;
-
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_digest called in non-aggregate context");
-
-	/* if there's no digest, return NULL */
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
-
-	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
-
-	digest = tdigest_aggstate_to_digest(state, true);
+	if (PG_ARGISNULL(2))
+		count = 1;
+	else
+		count = PG_GETARG_INT64(2);
 
-	PG_RETURN_POINTER(digest);
-}
+	/* can't add values with non-positive counts */
+	if (count <= 0)
+		elog(ERROR, "invalid count value %lld, must be a positive value",
+			 (long long) count);
 
-/*
- * Compute percentiles from a tdigest. Final function for tdigest aggregate
- * with an array of percentiles.
- */
-Datum
-tdigest_array_percentiles(PG_FUNCTION_ARGS)
-{
-	double	*result;
-	MemoryContext aggcontext;
+	/*
+	 * When adding too many values (than would fit into an empty buffer, and
+	 * thus likely causing too many compactions), we instead build a t-digest
+	 * and then merge it into the existing state.
+	 *
+	 * This is much faster, because the t-digest can be generated in one go,
+	 * so there can be only one compaction at most.
+	 */
+	if (count > BUFFER_SIZE(state->compression))
+	{
+		tdigest_t  *new;
+		double		value = PG_GETARG_FLOAT8(1);
 
-	tdigest_aggstate_t *state;
+		new = tdigest_generate(state->compression, value, count);
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_array_percentiles called in non-aggregate context");
+		tdigest_merge_stats(state, new->min, new->max, new->sum);
 
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+		for (i = 0; i < new->ncentroids; i++)
+			tdigest_add_centroid(state, value, new->centroids[i].count);
 
-	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+		count = 0;
+	}
 
-	result = palloc(state->npercentiles * sizeof(double));
+	/*
+	 * If there are only a couple values, just add them one by one, so that
+	 * we do proper compaction and sizing of centroids. Otherwise we might end
+	 * up with oversized centroid on the tails etc.
+	 */
+	for (i = 0; i < count; i++)
+		tdigest_add(state, PG_GETARG_FLOAT8(1));
 
-	tdigest_compute_quantiles(state, result);
+	AssertCheckTDigestAggState(state);
 
-	return double_to_array(fcinfo, result, state->npercentiles);
+	PG_RETURN_POINTER(state);
 }
 
 /*
- * Compute percentiles from a tdigest. Final function for tdigest aggregate
- * with an array of values.
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for tdigest aggregate with a single value.
  */
 Datum
-tdigest_array_percentiles_of(PG_FUNCTION_ARGS)
+tdigest_add_digest_trimmed(PG_FUNCTION_ARGS)
 {
-	double	*result;
-	MemoryContext aggcontext;
-
 	tdigest_aggstate_t *state;
+	tdigest_t		   *digest;
+
+	MemoryContext aggcontext;
 
 	/* cannot be called directly because of internal-type argument */
 	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_array_percentiles_of called in non-aggregate context");
-
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
-
-	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
-
-	result = palloc(state->nvalues * sizeof(double));
+		elog(ERROR, "tdigest_add_digest called in non-aggregate context");
 
-	tdigest_compute_quantiles_of(state, result);
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * t-digest (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
 
-	return double_to_array(fcinfo, result, state->nvalues);
-}
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
 
-Datum
-tdigest_serial(PG_FUNCTION_ARGS)
-{
-	bytea	   *v;
-	tdigest_aggstate_t  *state;
-	Size		len;
-	char	   *ptr;
+	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
 
-	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	/* make sure we get digest with the new format */
+	digest = tdigest_update_format(digest);
 
-	len = offsetof(tdigest_aggstate_t, percentiles) +
-		  state->npercentiles * sizeof(double) +
-		  state->nvalues * sizeof(double) +
-		  state->ncentroids * sizeof(centroid_t);
+	/* make sure the t-digest format is supported */
+	if (!(digest->flags & TDIGEST_STORES_MEAN) ||
+		((digest->flags & ~TDIGEST_VALID_FLAGS) != 0))
+		elog(ERROR, "unsupported t-digest on-disk format");
 
-	v = palloc(len + VARHDRSZ);
+	/* if there's no aggregate state allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext oldcontext;
+		double	low = PG_GETARG_FLOAT8(2);
+		double	high = PG_GETARG_FLOAT8(3);
 
-	SET_VARSIZE(v, len + VARHDRSZ);
-	ptr = VARDATA(v);
+		check_trim_values(low, high);
 
-	memcpy(ptr, state, offsetof(tdigest_aggstate_t, percentiles));
-	ptr += offsetof(tdigest_aggstate_t, percentiles);
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		state = tdigest_aggstate_allocate(0, 0, digest->compression);
+		state->trim_low = low;
+		state->trim_high = high;
 
-	if (state->npercentiles > 0)
-	{
-		memcpy(ptr, state->percentiles, sizeof(double) * state->npercentiles);
-		ptr += sizeof(double) * state->npercentiles;
+		MemoryContextSwitchTo(oldcontext);
 	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	if (state->nvalues > 0)
-	{
-		memcpy(ptr, state->values, sizeof(double) * state->nvalues);
-		ptr += sizeof(double) * state->nvalues;
-	}
+	/*
+	 * XXX should it be allowed to add digest to a state with a different
+	 * compression value? Will it produce a "good" t-digest or does it break
+	 * the assumptions and produce much worse estimates?
+	 */
 
-	/* FIXME maybe don't serialize full centroids, but just sum/count */
-	memcpy(ptr, state->centroids,
-		   sizeof(centroid_t) * state->ncentroids);
-	ptr += sizeof(centroid_t) * state->ncentroids;
+	tdigest_add_digest_centroids(state, digest);
 
-	Assert(VARDATA(v) + len == ptr);
+	AssertCheckTDigestAggState(state);
 
-	PG_RETURN_POINTER(v);
+	PG_RETURN_POINTER(state);
 }
 
-Datum
-tdigest_deserial(PG_FUNCTION_ARGS)
+/*
+ * Calculate trimmed aggregates for multiple bands from centroids.
+ *
+ * The bands are specified by arrays of low/high percentiles, and the sums
+ * and counts for all of them are calculated in a single pass over the
+ * sorted centroids. For each band the result is exactly the same as when
+ * calculated separately.
+ *
+ * The centroids below the lowest threshold don't contribute to any band,
+ * so we skip them using a binary search on cumulative counts.
+ */
+static void
+tdigest_trimmed_agg_bands(centroid_t *centroids, int ncentroids,
+						  int64 count, double *low, double *high, int nbands,
+						  double *sums, int64 *counts)
 {
-	bytea  *v = (bytea *) PG_GETARG_POINTER(0);
-	char   *ptr = VARDATA_ANY(v);
-	tdigest_aggstate_t	tmp;
-	tdigest_aggstate_t *state;
-	double			   *percentiles = NULL;
-	double			   *values = NULL;
+	int		i, j;
+	int64	count_done = 0,
+			count_min = PG_INT64_MAX,
+			count_max = 0;
+	int64  *count_low,
+		   *count_high,
+		   *cumulative;
 
-	/* copy aggstate header into a local variable */
-	memcpy(&tmp, ptr, offsetof(tdigest_aggstate_t, percentiles));
-	ptr += offsetof(tdigest_aggstate_t, percentiles);
+	count_low = palloc(sizeof(int64) * nbands);
+	count_high = palloc(sizeof(int64) * nbands);
 
-	/* allocate and copy percentiles */
-	if (tmp.npercentiles > 0)
+	/* translate the percentiles to counts */
+	for (j = 0; j < nbands; j++)
 	{
-		percentiles = palloc(tmp.npercentiles * sizeof(double));
-		memcpy(percentiles, ptr, tmp.npercentiles * sizeof(double));
-		ptr += tmp.npercentiles * sizeof(double);
+		count_low[j] = floor(count * low[j]);
+		count_high[j] = ceil(count * high[j]);
+
+		count_min = Min(count_min, count_low[j]);
+		count_max = Max(count_max, count_high[j]);
+
+		sums[j] = 0;
+		counts[j] = 0;
 	}
 
-	/* allocate and copy values */
-	if (tmp.nvalues > 0)
+	/* skip centroids entirely below the lowest threshold */
+	i = 0;
+	if ((nbands > 0) && (ncentroids > 0))
 	{
-		values = palloc(tmp.nvalues * sizeof(double));
-		memcpy(values, ptr, tmp.nvalues * sizeof(double));
-		ptr += tmp.nvalues * sizeof(double);
-	}
+		cumulative = tdigest_cumulative_counts(centroids, ncentroids);
 
-	state = tdigest_aggstate_allocate(tmp.npercentiles, tmp.nvalues,
-									  tmp.compression);
+		i = tdigest_find_centroid(cumulative, ncentroids, count_min);
+		count_done = cumulative[i] - centroids[i].count;
 
-	if (tmp.npercentiles > 0)
-	{
-		memcpy(state->percentiles, percentiles, tmp.npercentiles * sizeof(double));
-		pfree(percentiles);
+		pfree(cumulative);
 	}
 
-	if (tmp.nvalues > 0)
+	for (; i < ncentroids; i++)
 	{
-		memcpy(state->values, values, tmp.nvalues * sizeof(double));
-		pfree(values);
-	}
-
-	/* copy the data into the newly-allocated state */
-	memcpy(state, &tmp, offsetof(tdigest_aggstate_t, percentiles));
-	/* we don't need to move the pointer */
-
-	/* copy the centroids back */
-	memcpy(state->centroids, ptr,
-		   sizeof(centroid_t) * state->ncentroids);
-	ptr += sizeof(centroid_t) * state->ncentroids;
+		for (j = 0; j < nbands; j++)
+		{
+			int64	count_add;
 
-	PG_RETURN_POINTER(state);
-}
+			/* skip bands where we already crossed the high threshold */
+			if (count_done >= count_high[j])
+				continue;
 
-static tdigest_aggstate_t *
-tdigest_copy(tdigest_aggstate_t *state)
-{
-	tdigest_aggstate_t *copy;
+			/* Assume the whole centroid falls into the range. */
+			count_add = centroids[i].count;
 
-	copy = tdigest_aggstate_allocate(state->npercentiles, state->nvalues,
-									 state->compression);
+			/*
+			 * If we haven't reached the low threshold yet, skip appropriate
+			 * part of the centroid.
+			 */
+			count_add -= Min(Max(0, count_low[j] - count_done),
+							 count_add);
 
-	memcpy(copy, state, offsetof(tdigest_aggstate_t, percentiles));
+			/*
+			 * If we have reached the upper threshold, ignore the overflowing
+			 * part of the centroid.
+			 */
+			count_add = Min(Max(0, count_high[j] - count_done),
+							 count_add);
 
-	if (state->nvalues > 0)
-		memcpy(copy->values, state->values,
-			   sizeof(double) * state->nvalues);
+			/* increment the sum / count */
+			sums[j] += centroids[i].mean * count_add;
+			counts[j] += count_add;
+		}
 
-	if (state->npercentiles > 0)
-		memcpy(copy->percentiles, state->percentiles,
-			   sizeof(double) * state->npercentiles);
+		/* consider the whole centroid processed */
+		count_done += centroids[i].count;
 
-	memcpy(copy->centroids, state->centroids,
-		   state->ncentroids * sizeof(centroid_t));
+		/* break once we cross the high threshold for all bands */
+		if (count_done >= count_max)
+			break;
+	}
 
-	return copy;
+	pfree(count_low);
+	pfree(count_high);
 }
 
-Datum
-tdigest_combine(PG_FUNCTION_ARGS)
+/*
+ * Calculate trimmed aggregates from centroids.
+ */
+static void
+tdigest_trimmed_agg(centroid_t *centroids, int ncentroids,
+					int64 count, double low, double high,
+					double *sump, int64 *countp)
 {
-	tdigest_aggstate_t	 *src;
-	tdigest_aggstate_t	 *dst;
-	MemoryContext aggcontext;
-	MemoryContext oldcontext;
-	int	i;
-
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_combine called in non-aggregate context");
-
-	/* if no "merged" state yet, try creating it */
-	if (PG_ARGISNULL(0))
-	{
-		/* nope, the second argument is NULL to, so return NULL */
-		if (PG_ARGISNULL(1))
-			PG_RETURN_NULL();
-
-		/* the second argument is not NULL, so copy it */
-		src = (tdigest_aggstate_t *) PG_GETARG_POINTER(1);
+	tdigest_trimmed_agg_bands(centroids, ncentroids, count, &low, &high, 1,
+							  sump, countp);
+}
 
-		/* copy the digest into the right long-lived memory context */
-		oldcontext = MemoryContextSwitchTo(aggcontext);
-		src = tdigest_copy(src);
-		MemoryContextSwitchTo(oldcontext);
 
-		PG_RETURN_POINTER(src);
-	}
+/*
+ * Compute percentile from a tdigest. Final function for tdigest aggregate
+ * with a single percentile.
+ */
+Datum
+tdigest_trimmed_avg(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t	   *state;
+	MemoryContext	aggcontext;
+	double			sum;
+	int64			count;
 
-	/*
-	 * If the second argument is NULL, just return the first one (we know
-	 * it's not NULL at this point).
-	 */
-	if (PG_ARGISNULL(1))
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_percentiles called in non-aggregate context");
 
-	/* Now we know neither argument is NULL, so merge them. */
-	src = (tdigest_aggstate_t *) PG_GETARG_POINTER(1);
-	dst = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	/* if there's no digest, return NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
 
-	AssertCheckTDigestAggState(dst);
-	AssertCheckTDigestAggState(src);
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	/*
-	 * XXX should it be allowed to add digest to a state with a different
-	 * compression value? Will it produce a "good" t-digest or does it break
-	 * the assumptions and produce much worse estimates?
-	 */
+	/* make sure the centroids are sorted */
+	tdigest_sort(state);
 
-	/* copy data from the tdigest into the aggstate */
-	for (i = 0; i < src->ncentroids; i++)
-		tdigest_add_centroid(dst, src->centroids[i].mean,
-								  src->centroids[i].count);
+	tdigest_trimmed_agg(state->centroids, state->ncentroids,
+						state->count, state->trim_low, state->trim_high,
+						&sum, &count);
 
-	AssertCheckTDigestAggState(dst);
+	if (count > 0)
+		PG_RETURN_FLOAT8(sum / count);
 
-	PG_RETURN_POINTER(dst);
+	PG_RETURN_NULL();
 }
 
-/* API for incremental updates */
-
 /*
- * expand the t-digest into an in-memory aggregate state
+ * Compute percentile from a tdigest. Final function for tdigest aggregate
+ * with a single percentile.
  */
-static tdigest_aggstate_t *
-tdigest_digest_to_aggstate(tdigest_t *digest)
+Datum
+tdigest_trimmed_sum(PG_FUNCTION_ARGS)
 {
-	int					i;
-	tdigest_aggstate_t *state;
+	tdigest_aggstate_t	   *state;
+	MemoryContext	aggcontext;
+	double			sum;
+	int64			count;
 
-	/* make sure we get digest with the new format */
-	digest = tdigest_update_format(digest);
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_percentiles called in non-aggregate context");
 
-	/* make sure the t-digest format is supported */
-	if (digest->flags != TDIGEST_STORES_MEAN)
-		elog(ERROR, "unsupported t-digest on-disk format");
+	/* if there's no digest, return NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
 
-	state = tdigest_aggstate_allocate(0, 0, digest->compression);
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	/* copy data from the tdigest into the aggstate */
-	for (i = 0; i < digest->ncentroids; i++)
-		tdigest_add_centroid(state,
-							 digest->centroids[i].mean,
-							 digest->centroids[i].count);
+	/* make sure the centroids are sorted */
+	tdigest_sort(state);
 
-	AssertCheckTDigestAggState(state);
+	tdigest_trimmed_agg(state->centroids, state->ncentroids,
+						state->count, state->trim_low, state->trim_high,
+						&sum, &count);
 
-	return state;
+	if (count > 0)
+		PG_RETURN_FLOAT8(sum);
+
+	PG_RETURN_NULL();
 }
 
 /*
- * Add a single value to the t-digest. This is not very efficient, as it has
- * to deserialize the t-digest into the in-memory aggstate representation
- * and serialize it back for each call, but it's convenient and acceptable
- * for some use cases.
- *
- * When efficiency is important, it may be possible to use the batch variant
- * with first aggregating the updates into a t-digest, and then merge that
- * into an existing t-digest in one step using tdigest_union_double_increment
+ * Add a value to the tdigest (create one if needed). Transition function
+ * for trimmed aggregates with multiple bands.
  *
- * This is similar to hll_add, while the "union" is more like hll_union.
+ * The bands are stored in the percentiles array - low percentiles for all
+ * the bands, followed by the high percentiles.
  */
 Datum
-tdigest_add_double_increment(PG_FUNCTION_ARGS)
+tdigest_add_double_trimmed_array(PG_FUNCTION_ARGS)
 {
 	tdigest_aggstate_t *state;
-	bool				compact = PG_GETARG_BOOL(3);
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_double_trimmed_array called in non-aggregate context");
 
 	/*
 	 * We want to skip NULL values altogether - we return either the existing
@@ -2441,50 +6411,52 @@ tdigest_add_double_increment(PG_FUNCTION_ARGS)
 	/* if there's no digest allocated, create it now */
 	if (PG_ARGISNULL(0))
 	{
-		int		compression;
+		MemoryContext oldcontext;
+		int		compression = PG_GETARG_INT32(2);
+		double *bands;
+		int		nbands;
 
-		/*
-		 * We don't require compression, but only when there is an existing
-		 * t-digest value. Make sure the value was supplied.
-		 */
-		if (PG_ARGISNULL(2))
-			elog(ERROR, "compression value not supplied, but t-digest is NULL");
+		check_compression(compression);
 
-		compression = PG_GETARG_INT32(2);
+		bands = array_to_trim_bands(fcinfo,
+									PG_GETARG_ARRAYTYPE_P(3),
+									PG_GETARG_ARRAYTYPE_P(4),
+									&nbands);
 
-		check_compression(compression);
+		oldcontext = MemoryContextSwitchTo(aggcontext);
 
-		state = tdigest_aggstate_allocate(0, 0, compression);
+		state = tdigest_aggstate_allocate(2 * nbands, 0, compression);
+		memcpy(state->percentiles, bands, sizeof(double) * 2 * nbands);
+
+		MemoryContextSwitchTo(oldcontext);
+
+		pfree(bands);
 	}
 	else
-		state = tdigest_digest_to_aggstate(PG_GETARG_TDIGEST(0));
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
 	tdigest_add(state, PG_GETARG_FLOAT8(1));
 
 	AssertCheckTDigestAggState(state);
 
-	PG_RETURN_POINTER(tdigest_aggstate_to_digest(state, compact));
+	PG_RETURN_POINTER(state);
 }
 
 /*
- * Add an array of values to the t-digest. This amortizes the overhead of
- * deserializing and serializing the t-digest, compared to the per-value
- * version.
- *
- * When efficiency is important, it may be possible to use the batch variant
- * with first aggregating the updates into a t-digest, and then merge that
- * into an existing t-digest in one step using tdigest_union_double_increment
- *
- * This is similar to hll_add, while the "union" is more like hll_union.
+ * Add a digest to the tdigest (create one if needed). Transition function
+ * for trimmed aggregates with multiple bands.
  */
 Datum
-tdigest_add_double_array_increment(PG_FUNCTION_ARGS)
+tdigest_add_digest_trimmed_array(PG_FUNCTION_ARGS)
 {
 	tdigest_aggstate_t *state;
-	bool				compact = PG_GETARG_BOOL(3);
-	double			   *values;
-	int					nvalues;
-	int					i;
+	tdigest_t		   *digest;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_add_digest_trimmed_array called in non-aggregate context");
 
 	/*
 	 * We want to skip NULL values altogether - we return either the existing
@@ -2499,980 +6471,1396 @@ tdigest_add_double_array_increment(PG_FUNCTION_ARGS)
 		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
 	}
 
-	/* if there's no digest allocated, create it now */
+	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+	/* make sure we get digest with the new format */
+	digest = tdigest_update_format(digest);
+
+	/* make sure the t-digest format is supported */
+	if (!(digest->flags & TDIGEST_STORES_MEAN) ||
+		((digest->flags & ~TDIGEST_VALID_FLAGS) != 0))
+		elog(ERROR, "unsupported t-digest on-disk format");
+
+	/* if there's no aggregate state allocated, create it now */
 	if (PG_ARGISNULL(0))
 	{
-		int		compression;
+		MemoryContext oldcontext;
+		double *bands;
+		int		nbands;
+
+		bands = array_to_trim_bands(fcinfo,
+									PG_GETARG_ARRAYTYPE_P(2),
+									PG_GETARG_ARRAYTYPE_P(3),
+									&nbands);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		state = tdigest_aggstate_allocate(2 * nbands, 0, digest->compression);
+		memcpy(state->percentiles, bands, sizeof(double) * 2 * nbands);
+
+		MemoryContextSwitchTo(oldcontext);
+
+		pfree(bands);
+	}
+	else
+		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	tdigest_add_digest_centroids(state, digest);
+
+	AssertCheckTDigestAggState(state);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Compute trimmed aggregates for all bands stored in the aggregate state.
+ */
+static Datum
+tdigest_trimmed_array_agg(FunctionCallInfo fcinfo, bool avg)
+{
+	tdigest_aggstate_t	   *state;
+	int				nbands;
+	double		   *sums;
+	int64		   *counts;
+
+	/* if there's no digest, return NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	nbands = state->npercentiles / 2;
+
+	sums = palloc(sizeof(double) * nbands);
+	counts = palloc(sizeof(int64) * nbands);
+
+	/* make sure the centroids are sorted */
+	tdigest_sort(state);
+
+	tdigest_trimmed_agg_bands(state->centroids, state->ncentroids,
+							  state->count, state->percentiles,
+							  state->percentiles + nbands, nbands,
+							  sums, counts);
+
+	return trimmed_bands_to_array(fcinfo, sums, counts, nbands, avg);
+}
+
+/*
+ * Compute trimmed averages for multiple bands. Final function for trimmed
+ * aggregates with arrays of low/high percentiles.
+ */
+Datum
+tdigest_trimmed_array_avg(PG_FUNCTION_ARGS)
+{
+	MemoryContext	aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_trimmed_array_avg called in non-aggregate context");
+
+	return tdigest_trimmed_array_agg(fcinfo, true);
+}
+
+/*
+ * Compute trimmed sums for multiple bands. Final function for trimmed
+ * aggregates with arrays of low/high percentiles.
+ */
+Datum
+tdigest_trimmed_array_sum(PG_FUNCTION_ARGS)
+{
+	MemoryContext	aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_trimmed_array_sum called in non-aggregate context");
+
+	return tdigest_trimmed_array_agg(fcinfo, false);
+}
+
+/*
+ * Trimmed sum of a single digest (non-aggregate function).
+ */
+Datum
+tdigest_digest_sum(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	double		low = PG_GETARG_FLOAT8(1);
+	double		high = PG_GETARG_FLOAT8(2);
+
+	double		sum;
+	int64		count;
+
+	AssertCheckTDigest(digest);
+
+	tdigest_trimmed_agg(digest->centroids, digest->ncentroids,
+						digest->count, low, high, &sum, &count);
+
+	if (count > 0)
+		PG_RETURN_FLOAT8(sum);
+
+	PG_RETURN_NULL();
+}
+
+/*
+ * Trimmed average of a single digest (non-aggregate function)
+ */
+Datum
+tdigest_digest_avg(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	double		low = PG_GETARG_FLOAT8(1);
+	double		high = PG_GETARG_FLOAT8(2);
+
+	double		sum;
+	int64		count;
+
+	AssertCheckTDigest(digest);
+
+	tdigest_trimmed_agg(digest->centroids, digest->ncentroids,
+						digest->count, low, high, &sum, &count);
 
-		/*
-		 * We don't require compression, but only when there is an existing
-		 * t-digest value. Make sure the value was supplied.
-		 */
-		if (PG_ARGISNULL(2))
-			elog(ERROR, "compression value not supplied, but t-digest is NULL");
+	if (count > 0)
+		PG_RETURN_FLOAT8(sum / count);
 
-		compression = PG_GETARG_INT32(2);
+	PG_RETURN_NULL();
+}
 
-		check_compression(compression);
+/*
+ * Trimmed sums of a single digest for multiple bands (non-aggregate
+ * function).
+ */
+Datum
+tdigest_digest_array_sum(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	double	   *bands;
+	int			nbands;
+	double	   *sums;
+	int64	   *counts;
 
-		state = tdigest_aggstate_allocate(0, 0, compression);
-	}
-	else
-		state = tdigest_digest_to_aggstate(PG_GETARG_TDIGEST(0));
+	bands = array_to_trim_bands(fcinfo,
+								PG_GETARG_ARRAYTYPE_P(1),
+								PG_GETARG_ARRAYTYPE_P(2),
+								&nbands);
 
-	values = array_to_double(fcinfo,
-							 PG_GETARG_ARRAYTYPE_P(1),
-							 &nvalues);
+	AssertCheckTDigest(digest);
 
-	for (i = 0; i < nvalues; i++)
-		tdigest_add(state, values[i]);
+	sums = palloc(sizeof(double) * nbands);
+	counts = palloc(sizeof(int64) * nbands);
 
-	AssertCheckTDigestAggState(state);
+	tdigest_trimmed_agg_bands(digest->centroids, digest->ncentroids,
+							  digest->count, bands, bands + nbands, nbands,
+							  sums, counts);
 
-	PG_RETURN_POINTER(tdigest_aggstate_to_digest(state, compact));
+	return trimmed_bands_to_array(fcinfo, sums, counts, nbands, false);
 }
 
 /*
- * Merge a t-digest into another t-digest. This is somewaht inefficient, as
- * it has to deserialize the t-digests into the in-memory aggstate values,
- * and serialize it back for each call, but it's better than doing it for
- * each individual value (like tdigest_union_double_increment).
- *
- * This is similar to hll_union.
+ * Trimmed averages of a single digest for multiple bands (non-aggregate
+ * function).
  */
 Datum
-tdigest_union_double_increment(PG_FUNCTION_ARGS)
+tdigest_digest_array_avg(PG_FUNCTION_ARGS)
 {
-	int					i;
-	tdigest_aggstate_t *state;
-	tdigest_t		   *digest;
-	bool				compact = PG_GETARG_BOOL(2);
-
-	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
-		PG_RETURN_NULL();
-	else if (PG_ARGISNULL(0))
-		PG_RETURN_POINTER(PG_GETARG_POINTER(1));
-	else if (PG_ARGISNULL(1))
-		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
-
-	/* now we know both arguments are non-null */
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	double	   *bands;
+	int			nbands;
+	double	   *sums;
+	int64	   *counts;
 
-	/* parse the first digest (we'll merge the other one into this) */
-	state = tdigest_digest_to_aggstate(PG_GETARG_TDIGEST(0));
-	AssertCheckTDigestAggState(state);
+	bands = array_to_trim_bands(fcinfo,
+								PG_GETARG_ARRAYTYPE_P(1),
+								PG_GETARG_ARRAYTYPE_P(2),
+								&nbands);
 
-	/* parse the second digest */
-	digest = PG_GETARG_TDIGEST(1);
 	AssertCheckTDigest(digest);
 
-	/* copy data from the tdigest into the aggstate */
-	for (i = 0; i < digest->ncentroids; i++)
-		tdigest_add_centroid(state, digest->centroids[i].mean,
-									digest->centroids[i].count);
+	sums = palloc(sizeof(double) * nbands);
+	counts = palloc(sizeof(int64) * nbands);
 
-	AssertCheckTDigestAggState(state);
+	tdigest_trimmed_agg_bands(digest->centroids, digest->ncentroids,
+							  digest->count, bands, bands + nbands, nbands,
+							  sums, counts);
 
-	PG_RETURN_POINTER(tdigest_aggstate_to_digest(state, compact));
+	return trimmed_bands_to_array(fcinfo, sums, counts, nbands, true);
 }
 
-
 /*
- * Comparator, ordering the centroids by mean value.
- *
- * When the mean is the same, we try ordering the centroids by count.
+ * Estimate a single percentile from a single digest (non-aggregate function).
  *
- * In principle, centroids with the same mean represent the same value,
- * but we still need to care about the count to allow rebalancing the
- * centroids later.
+ * For compacted digests the centroids are used directly, without building
+ * the aggregate state (and sorting/compacting the centroids). The digest is
+ * cached in fn_extra, for repeated calls with the same digest.
  */
-static int
-centroid_cmp(const void *a, const void *b)
+Datum
+tdigest_digest_percentile(PG_FUNCTION_ARGS)
 {
-	double	ma, mb;
-
-	centroid_t *ca = (centroid_t *) a;
-	centroid_t *cb = (centroid_t *) b;
+	tdigest_t  *digest;
+	int64	   *cumulative;
+	double		percentile = PG_GETARG_FLOAT8(1);
+	double		result;
 
-	ma = ca->mean;
-	mb = cb->mean;
+	check_percentiles(&percentile, 1);
 
-	if (ma < mb)
-		return -1;
-	else if (ma > mb)
-		return 1;
+	digest = tdigest_get_cached(fcinfo, 0, &cumulative);
 
-	if (ca->count < cb->count)
-		return -1;
-	else if (ca->count > cb->count)
-		return 1;
+	tdigest_quantiles_cumulative(digest->centroids, cumulative,
+								 digest->ncentroids, digest->count,
+								 digest->min, digest->max,
+								 &percentile, 1, &result);
 
-	return 0;
+	PG_RETURN_FLOAT8(result);
 }
 
+/*
+ * Estimate an array of percentiles from a single digest (non-aggregate
+ * function).
+ */
 Datum
-tdigest_in(PG_FUNCTION_ARGS)
+tdigest_digest_percentiles(PG_FUNCTION_ARGS)
 {
-	int			i, r;
-	char	   *str = PG_GETARG_CSTRING(0);
-	tdigest_t  *digest = NULL;
-	size_t		slen;
-
-	/* t-digest header fields */
-	int32       flags;
-	int64		count,
-				total_count;
-	int			compression;
-	int			ncentroids;
-	int			header_length;
-	char	   *ptr;
-
-	slen = strlen(str);
+	tdigest_t  *digest;
+	int64	   *cumulative;
+	double	   *percentiles;
+	int			npercentiles;
+	double	   *result;
 
-	r = sscanf(str, "flags %d count " INT64_FORMAT " compression %d centroids %d%n",
-			   &flags, &count, &compression, &ncentroids, &header_length);
+	percentiles = array_to_double(fcinfo,
+								  PG_GETARG_ARRAYTYPE_P(1),
+								  &npercentiles);
 
-	if (r != 4)
-		elog(ERROR, "failed to parse t-digest value");
+	check_percentiles(percentiles, npercentiles);
 
-	if ((flags & ~TDIGEST_VALID_FLAGS) != 0)
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("invalid flags for t-digest")));
+	digest = tdigest_get_cached(fcinfo, 0, &cumulative);
 
-	if ((compression < MIN_COMPRESSION) || (compression > MAX_COMPRESSION))
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("compression for t-digest must be in [%d, %d]",
-						MIN_COMPRESSION, MAX_COMPRESSION)));
+	result = palloc(npercentiles * sizeof(double));
 
-	if (count <= 0)
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("count value for the t-digest must be positive")));
+	tdigest_quantiles_cumulative(digest->centroids, cumulative,
+								 digest->ncentroids, digest->count,
+								 digest->min, digest->max,
+								 percentiles, npercentiles, result);
 
-	if (ncentroids <= 0)
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("number of centroids for the t-digest must be positive")));
+	return double_to_array(fcinfo, result, npercentiles);
+}
 
-	if (ncentroids > BUFFER_SIZE(compression))
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("number of centroids for the t-digest exceeds buffer size")));
+/*
+ * Estimate the percentile of a value from a single digest (non-aggregate
+ * function).
+ */
+Datum
+tdigest_digest_percentile_of(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest;
+	int64	   *cumulative;
+	double		value = PG_GETARG_FLOAT8(1);
+	double		result;
 
-	digest = tdigest_allocate(ncentroids);
+	digest = tdigest_get_cached(fcinfo, 0, &cumulative);
 
-	digest->flags = flags;
-	digest->count = count;
-	digest->ncentroids = ncentroids;
-	digest->compression = compression;
+	tdigest_quantiles_of_cumulative(digest->centroids, cumulative,
+									digest->ncentroids, digest->count,
+									digest->min, digest->max,
+									&value, 1, &result);
 
-	ptr = str + header_length;
+	PG_RETURN_FLOAT8(result);
+}
 
-	total_count = 0;
-	ncentroids = 0;
-	for (i = 0; i < digest->ncentroids; i++)
-	{
-		int		nbytes = -1;
-		double	mean;
+/*
+ * Estimate percentiles of an array of values from a single digest
+ * (non-aggregate function).
+ */
+Datum
+tdigest_digest_percentiles_of(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest;
+	int64	   *cumulative;
+	double	   *values;
+	int			nvalues;
+	double	   *result;
 
-		if (sscanf(ptr, " (%lf, " INT64_FORMAT ")%n", &mean, &count, &nbytes) != 2)
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("failed to parse centroid")));
+	values = array_to_double(fcinfo,
+							 PG_GETARG_ARRAYTYPE_P(1),
+							 &nvalues);
 
-		/*
-		 * The %n might have not been assigned, in which case it kept the -1
-		 * value. Treat it as malformed input value.
-		 */
-		if (nbytes < 0)
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("failed to parse centroid")));
+	digest = tdigest_get_cached(fcinfo, 0, &cumulative);
 
-		/*
-		 * We should have parsed the whole format, and the last charater should
-		 * be a closing parenthesis for the centroid. If not, it's malformed.
-		 */
-		if (ptr[nbytes - 1] != ')')
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("malformed centroid, missing closing ')'")));
+	result = palloc(nvalues * sizeof(double));
 
-		/*
-		 * Not sure if this can happen with text input, but better to keep the
-		 * checks the same as in tdigest_recv.
-		 */
-		if (isnan(mean))
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("mean value for all centroids in a t-digest must be valid")));
+	tdigest_quantiles_of_cumulative(digest->centroids, cumulative,
+									digest->ncentroids, digest->count,
+									digest->min, digest->max,
+									values, nvalues, result);
 
-		if (count <= 0)
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("count value for all centroids in a t-digest must be positive")));
-		else if (count > digest->count)
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("count value of a centroid exceeds total count")));
+	return double_to_array(fcinfo, result, nvalues);
+}
 
-		digest->centroids[i].count = count;
-		digest->centroids[i].mean = mean;
+/*
+ * Estimate percentiles from a t-digest stored in an array element.
+ *
+ * Compacted digests are used directly, so there's no aggregate state and
+ * no copy of the centroids (unless the element is compressed).
+ */
+static void
+tdigest_element_quantiles(Datum element, double *percentiles,
+						  int npercentiles, double *result)
+{
+	tdigest_t  *raw = (tdigest_t *) DatumGetPointer(element);
+	tdigest_t  *detoasted = (tdigest_t *) PG_DETOAST_DATUM(element);
+	tdigest_t  *digest = tdigest_get_compacted(detoasted);
 
-		/* the centroids should be sorted by mean */
-		if (i > 0)
-		{
-			double	mean_prev = digest->centroids[i-1].mean;
+	tdigest_quantiles(digest->centroids, digest->ncentroids, digest->count,
+					  digest->min, digest->max,
+					  percentiles, npercentiles, result);
 
-			if (!(flags & TDIGEST_STORES_MEAN))
-			{
-				mean = (mean / digest->centroids[i].count);
-				mean_prev = (mean_prev / digest->centroids[i-1].count);
-			}
+	if (digest != detoasted)
+		pfree(digest);
 
-			if (mean_prev > mean)
-				ereport(ERROR,
-						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-						 errmsg("centroids not sorted by mean")));
-		}
+	if (detoasted != raw)
+		pfree(detoasted);
+}
 
-		/* track the total count so that we can check later */
-		total_count += count;
-		ncentroids++;
+/*
+ * Estimate a single percentile for each digest in an array (non-aggregate
+ * function), e.g. for per-minute digests of a time series. This is much
+ * cheaper than calling tdigest_digest_percentile for each digest, and it
+ * returns an array with one value per digest (NULL for NULL digests).
+ */
+Datum
+tdigest_digests_percentile(PG_FUNCTION_ARGS)
+{
+	Datum	   *digests;
+	bool	   *nulls;
+	int			ndigests;
+	double		percentile = PG_GETARG_FLOAT8(1);
+	Datum	   *values;
+	int			dims[1];
+	int			lbs[1] = {1};
+	int			i;
 
-		/*
-		 * Skip to the end of the centroid (the character after the closing
-		 * parenthesis). If this is the end of the string, stop parsing, even
-		 * if we failed to parse the right number of centroids).
-		 */
-		ptr += nbytes;
+	check_percentiles(&percentile, 1);
 
-		/* end of string */
-		if (*ptr == '\0')
-			break;
+	digests = array_to_tdigests(fcinfo, PG_GETARG_ARRAYTYPE_P(0),
+								&nulls, &ndigests);
 
-		/* must not scan past the end of the input string */
-		Assert(ptr <= str + slen);
-	}
+	if (ndigests == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(FLOAT8OID));
 
-	/*
-	 * Malformed inputs may have the wrong number of centroids, in which case
-	 * we either don't consume the whole input (ncentroids too high), or we
-	 * don't get all the expected centroids (ncentroids too high).
-	 */
-	if (ptr < str + slen)
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("input t-digest value too long")));
+	values = (Datum *) palloc(ndigests * sizeof(Datum));
 
-	if (ncentroids != digest->ncentroids)
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("input t-digest value too short")));
+	for (i = 0; i < ndigests; i++)
+	{
+		double	result;
 
-	/*
-	 * If we consumed just the right number of centroids, we must have read
-	 * the whole input value exactly.
-	 */
-	Assert(ptr == str + slen);
+		if (nulls[i])
+			continue;
 
-	/* check that the total matches */
-	if (total_count != digest->count)
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("total count does not match the data (%lld != %lld)",
-						(long long) total_count, (long long) digest->count)));
+		tdigest_element_quantiles(digests[i], &percentile, 1, &result);
 
-	/*
-	 * Make sure we return digest with the new format (it might be the
-	 * old format, in which case "mean" fields actually store "sum").
-	 */
-	digest = tdigest_update_format(digest);
+		values[i] = Float8GetDatum(result);
+	}
 
-	AssertCheckTDigest(digest);
+	dims[0] = ndigests;
 
-	PG_RETURN_POINTER(digest);
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(values, nulls, 1, dims, lbs,
+											 FLOAT8OID, sizeof(float8),
+											 FLOAT8PASSBYVAL, 'd'));
 }
 
+/*
+ * Estimate an array of percentiles for each digest in an array
+ * (non-aggregate function). Returns a two-dimensional array, with a row
+ * of percentiles for each digest (all NULL for NULL digests).
+ */
 Datum
-tdigest_out(PG_FUNCTION_ARGS)
+tdigest_digests_percentiles(PG_FUNCTION_ARGS)
 {
+	Datum	   *digests;
+	bool	   *nulls;
+	int			ndigests;
+	double	   *percentiles;
+	int			npercentiles;
+	double	   *result;
+	Datum	   *values;
+	bool	   *isnull;
+	int			dims[2];
+	int			lbs[2] = {1, 1};
 	int			i;
-	tdigest_t  *digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-	StringInfoData	str;
+	int			j;
 
-	AssertCheckTDigest(digest);
+	percentiles = array_to_double(fcinfo,
+								  PG_GETARG_ARRAYTYPE_P(1),
+								  &npercentiles);
 
-	initStringInfo(&str);
+	check_percentiles(percentiles, npercentiles);
 
-	appendStringInfo(&str, "flags %d count " INT64_FORMAT " compression %d centroids %d",
-					 digest->flags, digest->count, digest->compression,
-					 digest->ncentroids);
+	digests = array_to_tdigests(fcinfo, PG_GETARG_ARRAYTYPE_P(0),
+								&nulls, &ndigests);
 
-	/*
-	 * If this is an old tdigest with sum values, we'll send those, and
-	 * it's up to the reader to fix it. It'll be indicated by not having
-	 * the TDIGEST_STORES_MEAN flag.
-	 */
-	for (i = 0; i < digest->ncentroids; i++)
-		appendStringInfo(&str, " (%lf, " INT64_FORMAT ")",
-						 digest->centroids[i].mean,
-						 digest->centroids[i].count);
+	if ((ndigests == 0) || (npercentiles == 0))
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(FLOAT8OID));
 
-	PG_RETURN_CSTRING(str.data);
+	result = (double *) palloc(npercentiles * sizeof(double));
+	values = (Datum *) palloc(ndigests * npercentiles * sizeof(Datum));
+	isnull = (bool *) palloc0(ndigests * npercentiles * sizeof(bool));
+
+	for (i = 0; i < ndigests; i++)
+	{
+		if (nulls[i])
+		{
+			memset(&isnull[i * npercentiles], true, npercentiles);
+			continue;
+		}
+
+		tdigest_element_quantiles(digests[i], percentiles, npercentiles,
+								  result);
+
+		for (j = 0; j < npercentiles; j++)
+			values[i * npercentiles + j] = Float8GetDatum(result[j]);
+	}
+
+	dims[0] = ndigests;
+	dims[1] = npercentiles;
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(values, isnull, 2, dims, lbs,
+											 FLOAT8OID, sizeof(float8),
+											 FLOAT8PASSBYVAL, 'd'));
 }
 
+/*
+ * Estimate the cumulative distribution function for an array of sorted
+ * values (e.g. bin edges of a histogram) from a single digest. Returns
+ * the same values as tdigest_digest_percentile_of, but the values are
+ * processed in a single sweep over the centroids.
+ */
 Datum
-tdigest_recv(PG_FUNCTION_ARGS)
+tdigest_cdf(PG_FUNCTION_ARGS)
 {
-	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
 	tdigest_t  *digest;
+	int64	   *cumulative;
+	double	   *edges;
+	int			nedges;
+	double	   *result;
 	int			i;
-	int64		count;
-	int64		total_count;
-	int32		flags;
-	int32		compression;
-	int32		ncentroids;
 
-	flags = pq_getmsgint(buf, sizeof(int32));
+	edges = array_to_double(fcinfo,
+							PG_GETARG_ARRAYTYPE_P(1),
+							&nedges);
 
-	/* make sure the t-digest format is supported */
-	if ((flags != 0) && (flags != TDIGEST_STORES_MEAN))
-		elog(ERROR, "unsupported t-digest on-disk format");
+	for (i = 1; i < nedges; i++)
+	{
+		if (!(edges[i - 1] <= edges[i]))
+			elog(ERROR, "values have to be sorted (%f > %f)",
+				 edges[i - 1], edges[i]);
+	}
 
-	count = pq_getmsgint64(buf);
-	compression = pq_getmsgint(buf, sizeof(int32));
-	ncentroids = pq_getmsgint(buf, sizeof(int32));
+	digest = tdigest_get_cached(fcinfo, 0, &cumulative);
 
-	if ((compression < MIN_COMPRESSION) || (compression > MAX_COMPRESSION))
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("compression for t-digest must be in [%d, %d]",
-						MIN_COMPRESSION, MAX_COMPRESSION)));
+	result = palloc(nedges * sizeof(double));
 
-	if (count <= 0)
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("count value for the t-digest must be positive")));
+	tdigest_quantiles_of_sorted(digest->centroids, cumulative,
+								digest->ncentroids, digest->count,
+								digest->min, digest->max,
+								edges, nedges, result);
 
-	if (ncentroids <= 0)
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("number of centroids for the t-digest must be positive")));
+	return double_to_array(fcinfo, result, nedges);
+}
 
-	if (ncentroids > BUFFER_SIZE(compression))
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("number of centroids for the t-digest exceeds buffer size")));
+/*
+ * Estimate a histogram with bins of equal width between the min and max
+ * value of a digest. Returns the bin edges (one more than the number of
+ * bins), and the estimated number of values in each bin.
+ *
+ * The counts are calculated from the cumulative distribution function at
+ * the edges, evaluated in a single sweep over the centroids. The first and
+ * last edge are the min/max, so all the values are in one of the bins.
+ */
+Datum
+tdigest_histogram(PG_FUNCTION_ARGS)
+{
+	tdigest_t  *digest;
+	int64	   *cumulative;
+	int			nbins = PG_GETARG_INT32(1);
+	double	   *edges;
+	double	   *cdf;
+	double	   *counts;
+	int			i;
 
-	digest = tdigest_allocate(ncentroids);
+	TupleDesc	tupdesc;
+	Datum		values[2];
+	bool		nulls[2];
 
-	digest->flags = flags;
-	digest->count = count;
-	digest->compression = compression;
-	digest->ncentroids = ncentroids;
+	if (nbins < 1)
+		elog(ERROR, "invalid number of bins %d", nbins);
 
-	total_count = 0;
-	for (i = 0; i < digest->ncentroids; i++)
-	{
-		digest->centroids[i].mean = pq_getmsgfloat8(buf);
-		digest->centroids[i].count = pq_getmsgint64(buf);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-		if (isnan(digest->centroids[i].mean))
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("mean value for all centroids in a t-digest must be valid")));
+	tupdesc = BlessTupleDesc(tupdesc);
 
-		if (digest->centroids[i].count <= 0)
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("count value for all centroids in a t-digest must be positive")));
-		else if (digest->centroids[i].count > digest->count)
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("count value of a centroid exceeds total count")));
+	digest = tdigest_get_cached(fcinfo, 0, &cumulative);
 
-		/* track the total count so that we can check later */
-		total_count += digest->centroids[i].count;
-	}
+	edges = palloc((nbins + 1) * sizeof(double));
+	cdf = palloc((nbins + 1) * sizeof(double));
+	counts = palloc(nbins * sizeof(double));
 
-	/* check that the total matches */
-	if (total_count != digest->count)
-		ereport(ERROR,
-				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-				 errmsg("total count does not match the data (%lld != %lld)",
-						(long long) total_count, (long long) digest->count)));
+	for (i = 0; i < nbins; i++)
+		edges[i] = digest->min + (digest->max - digest->min) * i / nbins;
+
+	edges[nbins] = digest->max;
+
+	tdigest_quantiles_of_sorted(digest->centroids, cumulative,
+								digest->ncentroids, digest->count,
+								digest->min, digest->max,
+								edges, nbins + 1, cdf);
 
 	/*
-	 * Make sure we return digest with the new format (it might be the
-	 * old format, in which case "mean" fields actually store "sum").
+	 * Values at the min/max would be counted only partially (e.g. half of
+	 * a centroid with the min value), so make sure to include all of them.
+	 * If all the values are the same, they all belong to the first bin.
 	 */
-	digest = tdigest_update_format(digest);
+	cdf[0] = 0;
+	cdf[nbins] = 1;
 
-	AssertCheckTDigest(digest);
+	if (digest->min == digest->max)
+	{
+		for (i = 1; i < nbins; i++)
+			cdf[i] = 1;
+	}
 
-	PG_RETURN_POINTER(digest);
+	for (i = 0; i < nbins; i++)
+		counts[i] = (cdf[i + 1] - cdf[i]) * digest->count;
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = double_to_array(fcinfo, edges, nbins + 1);
+	values[1] = double_to_array(fcinfo, counts, nbins);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
+/*
+ * Summary of a single digest - count, min, max, mean, an array of
+ * percentiles and an array of trimmed means, all computed from a single
+ * copy of the digest (detoasted and compacted only once).
+ *
+ * Each trim value t specifies the fraction removed from both tails, i.e.
+ * the trimmed mean is calculated for the [t, 1-t] range.
+ */
 Datum
-tdigest_send(PG_FUNCTION_ARGS)
+tdigest_summary(PG_FUNCTION_ARGS)
 {
-	tdigest_t  *digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-	StringInfoData buf;
+	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
+	double	   *percentiles;
+	int			npercentiles;
+	double	   *trims;
+	int			ntrims;
+	double	   *bands;
+	double	   *sums;
+	int64	   *counts;
+	double	   *result;
 	int			i;
 
-	pq_begintypsend(&buf);
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6];
 
-	pq_sendint(&buf, digest->flags, 4);
-	pq_sendint64(&buf, digest->count);
-	pq_sendint(&buf, digest->compression, 4);
-	pq_sendint(&buf, digest->ncentroids, 4);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-	for (i = 0; i < digest->ncentroids; i++)
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	percentiles = array_to_double(fcinfo,
+								  PG_GETARG_ARRAYTYPE_P(1),
+								  &npercentiles);
+
+	check_percentiles(percentiles, npercentiles);
+
+	trims = array_to_double(fcinfo,
+							PG_GETARG_ARRAYTYPE_P(2),
+							&ntrims);
+
+	/* translate the trims to bands, with low values followed by high ones */
+	bands = palloc(sizeof(double) * 2 * ntrims);
+
+	for (i = 0; i < ntrims; i++)
 	{
-		pq_sendfloat8(&buf, digest->centroids[i].mean);
-		pq_sendint64(&buf, digest->centroids[i].count);
+		if ((trims[i] < 0.0) || (trims[i] >= 0.5))
+			elog(ERROR, "invalid trim value %f, should be in [0.0, 0.5)",
+				 trims[i]);
+
+		bands[i] = trims[i];
+		bands[ntrims + i] = 1.0 - trims[i];
 	}
 
-	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+	digest = tdigest_get_compacted(digest);
+
+	AssertCheckTDigest(digest);
+
+	result = palloc(sizeof(double) * npercentiles);
+	sums = palloc(sizeof(double) * ntrims);
+	counts = palloc(sizeof(int64) * ntrims);
+
+	tdigest_quantiles(digest->centroids, digest->ncentroids, digest->count,
+					  digest->min, digest->max, percentiles, npercentiles,
+					  result);
+
+	tdigest_trimmed_agg_bands(digest->centroids, digest->ncentroids,
+							  digest->count, bands, bands + ntrims, ntrims,
+							  sums, counts);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = Int64GetDatum(digest->count);
+	values[1] = Float8GetDatum(digest->min);
+	values[2] = Float8GetDatum(digest->max);
+	values[3] = Float8GetDatum(digest->sum / digest->count);
+	values[4] = double_to_array(fcinfo, result, npercentiles);
+	values[5] = trimmed_bands_to_array(fcinfo, sums, counts, ntrims, true);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
+/*
+ * Final functions for the ordered-set aggregates.
+ *
+ * The percentiles (or values, or trim limits) are direct arguments of the
+ * ordered-set aggregate, so they are passed to the final function instead
+ * of the transition function. That means the transition function (and
+ * arguments) is the same for all the aggregates in a query, so they can
+ * share a single aggregate state, built by tdigest_add_double.
+ *
+ * Multiple final functions may be called on the same state, so they must
+ * not make the state unusable for the following ones. Compaction is fine,
+ * but it means the results must not depend on whether the state was already
+ * compacted or not - so all the final functions compact the state first.
+ */
+
+/*
+ * Compute percentile from a shared aggregate state. Final function for the
+ * ordered-set aggregate with a single percentile.
+ */
 Datum
-tdigest_count(PG_FUNCTION_ARGS)
+tdigest_ordered_percentiles(PG_FUNCTION_ARGS)
 {
-	tdigest_t  *digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+	tdigest_aggstate_t	   *state;
+	MemoryContext	aggcontext;
+	double			percentile;
+	double			ret;
 
-	PG_RETURN_INT64(digest->count);
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_ordered_percentiles called in non-aggregate context");
+
+	/* if there's no digest (or percentile), return NULL */
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	percentile = PG_GETARG_FLOAT8(1);
+
+	check_percentiles(&percentile, 1);
+
+	tdigest_compute_quantiles(state, &percentile, 1, &ret);
+
+	PG_RETURN_FLOAT8(ret);
 }
 
 /*
- * tdigest_to_json
- *		Transform the tdigest into a JSON value.
- *
- * We make sure to always print mean, even for tdigests in the older format
- * storing sum for centroids. Otherwise the "mean" key would be confusing.
- * But we don't call tdigest_update_format, and instead we simply update the
- * flags and convert the sum/mean values.
- *
- * The centroids are stored in two separate arrays - one for means, one for
- * counts. That makes it easier to process, because it's clear the i-th
- * in each array is for i-th centroid. We might store it in a single array,
- * but then we'd have to walk it in pairs. And it'd mix float and int
- * values in the same array.
+ * Compute percentiles from a shared aggregate state. Final function for the
+ * ordered-set aggregate with an array of percentiles.
  */
 Datum
-tdigest_to_json(PG_FUNCTION_ARGS)
+tdigest_ordered_array_percentiles(PG_FUNCTION_ARGS)
 {
-	int				i;
-	StringInfoData	str;
-	tdigest_t	   *digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-	int32			flags = digest->flags;
+	tdigest_aggstate_t	   *state;
+	MemoryContext	aggcontext;
+	double		   *percentiles;
+	int				npercentiles;
+	double		   *result;
 
-	initStringInfo(&str);
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_ordered_array_percentiles called in non-aggregate context");
 
-	appendStringInfoChar(&str, '{');
+	/* if there's no digest (or percentiles), return NULL */
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		PG_RETURN_NULL();
 
-	flags |= TDIGEST_STORES_MEAN;
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
-	appendStringInfo(&str, "\"flags\": %d, ", flags);
-	appendStringInfo(&str, "\"count\": " INT64_FORMAT ", ", digest->count);
-	appendStringInfo(&str, "\"compression\": %d, ", digest->compression);
-	appendStringInfo(&str, "\"centroids\": %d, ", digest->ncentroids);
+	percentiles = array_to_double(fcinfo,
+								  PG_GETARG_ARRAYTYPE_P(1),
+								  &npercentiles);
 
-	appendStringInfoString(&str, "\"mean\": [");
+	check_percentiles(percentiles, npercentiles);
 
-	for (i = 0; i < digest->ncentroids; i++)
-	{
-		double	mean = digest->centroids[i].mean;
+	result = palloc(npercentiles * sizeof(double));
 
-		if (i > 0)
-			appendStringInfoString(&str, ", ");
+	tdigest_compute_quantiles(state, percentiles, npercentiles, result);
 
-		/*
-		 * When the TDIGEST_STORES_MEAN flags is not set, the value is
-		 * actually a sum, so convert it to mean now. We have to check the
-		 * diget->flags, not the local variable.
-		 */
-		if (! (digest->flags & TDIGEST_STORES_MEAN))
-			mean = mean / digest->centroids[i].count;
+	return double_to_array(fcinfo, result, npercentiles);
+}
 
-		/* don't print insignificant zeroes to the right of decimal point */
-		appendStringInfo(&str, "%g", mean);
-	}
+/*
+ * Compute percentile of a value from a shared aggregate state. Final function
+ * for the ordered-set aggregate with a single value.
+ */
+Datum
+tdigest_ordered_percentiles_of(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t	   *state;
+	MemoryContext	aggcontext;
+	double			value;
+	double			ret;
 
-	appendStringInfoString(&str, "], ");
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_ordered_percentiles_of called in non-aggregate context");
 
-	appendStringInfoString(&str, "\"count\": [");
+	/* if there's no digest (or value), return NULL */
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		PG_RETURN_NULL();
 
-	for (i = 0; i < digest->ncentroids; i++)
-	{
-		if (i > 0)
-			appendStringInfoString(&str, ", ");
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	value = PG_GETARG_FLOAT8(1);
 
-		appendStringInfo(&str, INT64_FORMAT, digest->centroids[i].count);
-	}
+	tdigest_compute_quantiles_of(state, &value, 1, &ret);
 
-	appendStringInfoString(&str, "]");
+	PG_RETURN_FLOAT8(ret);
+}
 
-	appendStringInfoChar(&str, '}');
+/*
+ * Compute percentiles of values from a shared aggregate state. Final function
+ * for the ordered-set aggregate with an array of values.
+ */
+Datum
+tdigest_ordered_array_percentiles_of(PG_FUNCTION_ARGS)
+{
+	tdigest_aggstate_t	   *state;
+	MemoryContext	aggcontext;
+	double		   *values;
+	int				nvalues;
+	double		   *result;
 
-	PG_RETURN_TEXT_P(cstring_to_text(str.data));
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_ordered_array_percentiles_of called in non-aggregate context");
+
+	/* if there's no digest (or values), return NULL */
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+
+	values = array_to_double(fcinfo,
+							 PG_GETARG_ARRAYTYPE_P(1),
+							 &nvalues);
+
+	result = palloc(nvalues * sizeof(double));
+
+	tdigest_compute_quantiles_of(state, values, nvalues, result);
+
+	return double_to_array(fcinfo, result, nvalues);
 }
 
 /*
- * tdigest_to_array
- *		Transform the tdigest into an array of double values.
- *
- * The whole digest is stored in a single "double precision" array, which
- * may be a bit confusing and perhaps fragile if more fields need to be
- * added in the future. The initial elements are flags, count (number of
- * items added to the digest), compression (determines the limit on number
- * of centroids) and current number of centroids. Follows stream of values
- * encoding the centroids in pairs of (mean, count).
- *
- * We make sure to always print mean, even for tdigests in the older format
- * storing sum for centroids. Otherwise the "mean" key would be confusing.
- * But we don't call tdigest_update_format, and instead we simply update the
- * flags and convert the sum/mean values.
+ * Calculate trimmed aggregate from a shared aggregate state, with the trim
+ * values passed as direct arguments. Returns false if there's nothing to
+ * calculate the result from (no state or no data in the range).
  */
-Datum
-tdigest_to_array(PG_FUNCTION_ARGS)
+static bool
+tdigest_ordered_trimmed_agg(FunctionCallInfo fcinfo, double *sump, int64 *countp)
 {
-	int				i,
-					idx;
-	tdigest_t	   *digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-	int32			flags = digest->flags;
-	double		   *values;
-	int				nvalues;
-
-	flags |= TDIGEST_STORES_MEAN;
-
-	/* number of values to store in the array */
-	nvalues = 4 + (digest->ncentroids * 2);
-	values = (double *) palloc(sizeof(double) * nvalues);
+	tdigest_aggstate_t	   *state;
+	double			low,
+					high;
 
-	idx = 0;
-	values[idx++] = flags;
-	values[idx++] = digest->count;
-	values[idx++] = digest->compression;
-	values[idx++] = digest->ncentroids;
+	/* if there's no digest (or trim values), return NULL */
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+		return false;
 
-	for (i = 0; i < digest->ncentroids; i++)
-	{
-		double	mean = digest->centroids[i].mean;
+	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	low = PG_GETARG_FLOAT8(1);
+	high = PG_GETARG_FLOAT8(2);
 
-		/*
-		 * When the TDIGEST_STORES_MEAN flags is not set, the value is
-		 * actually a sum, so convert it to mean now. We have to check the
-		 * diget->flags, not the local variable.
-		 */
-		if (! (digest->flags & TDIGEST_STORES_MEAN))
-			mean = mean / digest->centroids[i].count;
+	check_trim_values(low, high);
 
-		/* don't print insignificant zeroes to the right of decimal point */
-		values[idx++] = mean;
-		values[idx++] = digest->centroids[i].count;
-	}
+	/* compacting also sorts the centroids */
+	tdigest_compact(state);
 
-	Assert(idx == nvalues);
+	tdigest_trimmed_agg(state->centroids, state->ncentroids,
+						state->count, low, high, sump, countp);
 
-	return double_to_array(fcinfo, values, nvalues);
+	return (*countp > 0);
 }
 
+/*
+ * Compute trimmed average from a shared aggregate state. Final function for
+ * the ordered-set aggregate.
+ */
 Datum
-tdigest_add_double_trimmed(PG_FUNCTION_ARGS)
+tdigest_ordered_trimmed_avg(PG_FUNCTION_ARGS)
 {
-	tdigest_aggstate_t *state;
-
-	MemoryContext aggcontext;
+	MemoryContext	aggcontext;
+	double			sum;
+	int64			count;
 
 	/* cannot be called directly because of internal-type argument */
 	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double_mean called in non-aggregate context");
+		elog(ERROR, "tdigest_ordered_trimmed_avg called in non-aggregate context");
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest (if it already exists) or NULL.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+	if (!tdigest_ordered_trimmed_agg(fcinfo, &sum, &count))
+		PG_RETURN_NULL();
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+	PG_RETURN_FLOAT8(sum / count);
+}
 
-	/* if there's no digest allocated, create it now */
-	if (PG_ARGISNULL(0))
-	{
-		MemoryContext oldcontext;
-		int		compression = PG_GETARG_INT32(2);
-		double	low = PG_GETARG_FLOAT8(3);
-		double	high = PG_GETARG_FLOAT8(4);
+/*
+ * Compute trimmed sum from a shared aggregate state. Final function for the
+ * ordered-set aggregate.
+ */
+Datum
+tdigest_ordered_trimmed_sum(PG_FUNCTION_ARGS)
+{
+	MemoryContext	aggcontext;
+	double			sum;
+	int64			count;
 
-		check_compression(compression);
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tdigest_ordered_trimmed_sum called in non-aggregate context");
 
-		check_trim_values(low, high);
+	if (!tdigest_ordered_trimmed_agg(fcinfo, &sum, &count))
+		PG_RETURN_NULL();
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+	PG_RETURN_FLOAT8(sum);
+}
 
-		state = tdigest_aggstate_allocate(0, 0, compression);
-		state->trim_low = low;
-		state->trim_high = high;
+/*
+ * Return the per-backend statistics collected with tdigest.track_stats.
+ */
+Datum
+tdigest_stats_info(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[10];
+	bool		nulls[10];
 
-		MemoryContextSwitchTo(oldcontext);
-	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-	tdigest_add(state, PG_GETARG_FLOAT8(1));
+	tupdesc = BlessTupleDesc(tupdesc);
 
-	AssertCheckTDigestAggState(state);
+	memset(nulls, 0, sizeof(nulls));
 
-	PG_RETURN_POINTER(state);
+	values[0] = Int64GetDatum(tdigest_stats.compactions);
+	values[1] = Int64GetDatum(tdigest_stats.sorts);
+	values[2] = Int64GetDatum(tdigest_stats.sorted);
+	values[3] = Int64GetDatum(tdigest_stats.combines);
+	values[4] = Int64GetDatum(tdigest_stats.serialized);
+	values[5] = Int64GetDatum(tdigest_stats.serialized_bytes);
+	values[6] = Int64GetDatum(tdigest_stats.deserialized);
+	values[7] = Int64GetDatum(tdigest_stats.deserialized_bytes);
+	values[8] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(tdigest_stats.compact_time));
+	values[9] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(tdigest_stats.sort_time));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
+/*
+ * Reset the per-backend statistics.
+ */
 Datum
-tdigest_add_double_count_trimmed(PG_FUNCTION_ARGS)
+tdigest_stats_reset(PG_FUNCTION_ARGS)
 {
-	int		i;
-	int64	count;
-	tdigest_aggstate_t *state;
+	memset(&tdigest_stats, 0, sizeof(tdigest_stats_t));
 
-	MemoryContext aggcontext;
+	PG_RETURN_VOID();
+}
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_double_mean called in non-aggregate context");
+/*
+ * Size of the shared memory for the shared t-digests.
+ */
+static Size
+tdigest_shm_size(void)
+{
+	return add_size(MAXALIGN(sizeof(tdigest_shm_t)),
+					mul_size(tdigest_shm_max_digests,
+							 TDIGEST_SHM_ENTRY_SIZE(tdigest_shm_compression)));
+}
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest (if it already exists) or NULL.
-	 */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+/*
+ * Request the shared memory and locks for the shared t-digests.
+ */
+static void
+tdigest_shm_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+	RequestAddinShmemSpace(tdigest_shm_size());
+	RequestNamedLWLockTranche("tdigest", tdigest_shm_max_digests + 1);
+}
 
-	/* if there's no digest allocated, create it now */
-	if (PG_ARGISNULL(0))
-	{
-		MemoryContext oldcontext;
-		int		compression = PG_GETARG_INT32(3);
-		double	low = PG_GETARG_FLOAT8(4);
-		double	high = PG_GETARG_FLOAT8(5);
+/*
+ * Reset the aggregate state of a shared t-digest (discard all the values).
+ */
+static void
+tdigest_shm_reset_state(tdigest_shm_entry_t *entry)
+{
+	tdigest_aggstate_t *state = &entry->state;
 
-		check_compression(compression);
+	memset(state, 0, sizeof(tdigest_aggstate_t));
 
-		check_trim_values(low, high);
+	state->compression = tdigest_shm->compression;
+	state->nallocated = BUFFER_SIZE(state->compression);
+	state->min = INFINITY;
+	state->max = -INFINITY;
+}
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
+/*
+ * Get the aggregate state of a shared t-digest, with the centroid buffer
+ * set for this backend. The caller has to hold the entry lock.
+ */
+static tdigest_aggstate_t *
+tdigest_shm_state(tdigest_shm_entry_t *entry)
+{
+	entry->state.centroids = (centroid_t *) ((char *) entry +
+								MAXALIGN(sizeof(tdigest_shm_entry_t)));
 
-		state = tdigest_aggstate_allocate(0, 0, compression);
-		state->trim_low = low;
-		state->trim_high = high;
+	AssertCheckTDigestAggState(&entry->state);
 
-		MemoryContextSwitchTo(oldcontext);
-	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	return &entry->state;
+}
 
-	if (PG_ARGISNULL(2))
-		count = 1;
-	else
-		count = PG_GETARG_INT64(2);
+/*
+ * Allocate or attach to the shared memory for the shared t-digests.
+ */
+static void
+tdigest_shm_startup(void)
+{
+	bool		found;
+	int			i;
 
-	/* can't add values with non-positive counts */
-	if (count <= 0)
-		elog(ERROR, "invalid count value %lld, must be a positive value",
-			 (long long) count);
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
 
-	/*
-	 * When adding too many values (than would fit into an empty buffer, and
-	 * thus likely causing too many compactions), we instead build a t-digest
-	 * and then merge it into the existing state.
-	 *
-	 * This is much faster, because the t-digest can be generated in one go,
-	 * so there can be only one compaction at most.
-	 */
-	if (count > BUFFER_SIZE(state->compression))
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	tdigest_shm = ShmemInitStruct("tdigest", tdigest_shm_size(), &found);
+
+	if (!found)
 	{
-		tdigest_t  *new;
-		double		value = PG_GETARG_FLOAT8(1);
+		tdigest_shm->locks = GetNamedLWLockTranche("tdigest");
+		tdigest_shm->ndigests = tdigest_shm_max_digests;
+		tdigest_shm->compression = tdigest_shm_compression;
+		tdigest_shm->entry_size = TDIGEST_SHM_ENTRY_SIZE(tdigest_shm_compression);
 
-		new = tdigest_generate(state->compression, value, count);
+		for (i = 0; i < tdigest_shm->ndigests; i++)
+		{
+			tdigest_shm_entry_t *entry = TDIGEST_SHM_ENTRY(i);
 
-		for (i = 0; i < new->ncentroids; i++)
-			tdigest_add_centroid(state, value, new->centroids[i].count);
+			entry->name[0] = '\0';
+			entry->generation = 0;
 
-		count = 0;
+			tdigest_shm_reset_state(entry);
+		}
 	}
 
-	/*
-	 * If there are only a couple values, just add them one by one, so that
-	 * we do proper compaction and sizing of centroids. Otherwise we might end
-	 * up with oversized centroid on the tails etc.
-	 */
-	for (i = 0; i < count; i++)
-		tdigest_add(state, PG_GETARG_FLOAT8(1));
+	LWLockRelease(AddinShmemInitLock);
+}
 
-	AssertCheckTDigestAggState(state);
+/*
+ * Get the name of a shared t-digest from a text argument, and make sure the
+ * shared t-digests are available.
+ */
+static char *
+tdigest_shm_name(FunctionCallInfo fcinfo, int argno)
+{
+	char	   *name = text_to_cstring(PG_GETARG_TEXT_PP(argno));
 
-	PG_RETURN_POINTER(state);
+	if (tdigest_shm == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("shared t-digests are not available"),
+				 errhint("The tdigest library has to be loaded using shared_preload_libraries.")));
+
+	if (name[0] == '\0')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_NAME),
+				 errmsg("name of a shared t-digest must not be empty")));
+
+	if (strlen(name) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("name of a shared t-digest is too long (maximum is %d bytes)",
+						NAMEDATALEN - 1)));
+
+	return name;
 }
 
 /*
- * Add a value to the tdigest (create one if needed). Transition function
- * for tdigest aggregate with a single value.
+ * Find the shared entry for a t-digest, and remember the generation of the
+ * entry. If the t-digest does not exist, it's created (if requested), or
+ * we return -1.
  */
-Datum
-tdigest_add_digest_trimmed(PG_FUNCTION_ARGS)
+static int
+tdigest_shm_lookup(const char *name, bool create, uint64 *generation)
 {
-	int					i;
-	tdigest_aggstate_t *state;
-	tdigest_t		   *digest;
+	int			i;
+	int			slot = -1;
+	int			free_slot = -1;
 
-	MemoryContext aggcontext;
+	LWLockAcquire(TDIGEST_SHM_REGISTRY_LOCK, create ? LW_EXCLUSIVE : LW_SHARED);
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_add_digest called in non-aggregate context");
+	for (i = 0; i < tdigest_shm->ndigests; i++)
+	{
+		tdigest_shm_entry_t *entry = TDIGEST_SHM_ENTRY(i);
 
-	/*
-	 * We want to skip NULL values altogether - we return either the existing
-	 * t-digest (if it already exists) or NULL.
-	 */
-	if (PG_ARGISNULL(1))
+		if (entry->name[0] == '\0')
+		{
+			if (free_slot == -1)
+				free_slot = i;
+			continue;
+		}
+
+		if (strcmp(entry->name, name) == 0)
+		{
+			slot = i;
+			break;
+		}
+	}
+
+	if ((slot == -1) && create)
 	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+		tdigest_shm_entry_t *entry;
 
-		/* if there already is a state accumulated, don't forget it */
-		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+		if (free_slot == -1)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+					 errmsg("too many shared t-digests"),
+					 errhint("Increase tdigest.shm_max_digests, or drop unused t-digests.")));
+
+		slot = free_slot;
+		entry = TDIGEST_SHM_ENTRY(slot);
+
+		/* unused entries are always empty (reset when dropped) */
+		Assert(entry->state.count == 0);
+
+		strlcpy(entry->name, name, NAMEDATALEN);
 	}
 
-	digest = (tdigest_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+	if (slot != -1)
+		*generation = TDIGEST_SHM_ENTRY(slot)->generation;
 
-	/* make sure we get digest with the new format */
-	digest = tdigest_update_format(digest);
+	LWLockRelease(TDIGEST_SHM_REGISTRY_LOCK);
 
-	/* make sure the t-digest format is supported */
-	if (digest->flags != TDIGEST_STORES_MEAN)
-		elog(ERROR, "unsupported t-digest on-disk format");
+	return slot;
+}
 
-	/* if there's no aggregate state allocated, create it now */
-	if (PG_ARGISNULL(0))
+/*
+ * Find the local buffer for a shared t-digest (and the shared entry). If
+ * there's no local buffer yet, we create it, which may also create the
+ * shared t-digest.
+ */
+static tdigest_shm_local_t *
+tdigest_shm_local_entry(const char *name, bool create)
+{
+	int			i;
+	int			slot;
+	uint64		generation;
+	tdigest_shm_local_t *local;
+
+	for (i = 0; i < tdigest_shm_nlocal; i++)
 	{
-		MemoryContext oldcontext;
-		double	low = PG_GETARG_FLOAT8(2);
-		double	high = PG_GETARG_FLOAT8(3);
+		if (strcmp(tdigest_shm_local[i].name, name) == 0)
+			return &tdigest_shm_local[i];
+	}
 
-		check_trim_values(low, high);
+	if (!create)
+		return NULL;
 
-		oldcontext = MemoryContextSwitchTo(aggcontext);
-		state = tdigest_aggstate_allocate(0, 0, digest->compression);
-		state->trim_low = low;
-		state->trim_high = high;
+	slot = tdigest_shm_lookup(name, true, &generation);
 
-		MemoryContextSwitchTo(oldcontext);
+	if (tdigest_shm_context == NULL)
+	{
+		tdigest_shm_context = AllocSetContextCreate(TopMemoryContext,
+													"tdigest shared buffers",
+													ALLOCSET_DEFAULT_SIZES);
+
+		tdigest_shm_local = MemoryContextAllocZero(tdigest_shm_context,
+												   sizeof(tdigest_shm_local_t) * tdigest_shm->ndigests);
 	}
-	else
-		state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
 
 	/*
-	 * XXX should it be allowed to add digest to a state with a different
-	 * compression value? Will it produce a "good" t-digest or does it break
-	 * the assumptions and produce much worse estimates?
+	 * Each entry refers to a different shared t-digest, so we can run out
+	 * of local entries only when some of the t-digests were dropped (and
+	 * other t-digests created). All the local buffers are flushed at the
+	 * end of a transaction, so we can simply forget the empty entries.
 	 */
+	if (tdigest_shm_nlocal == tdigest_shm->ndigests)
+	{
+		int		n = 0;
 
-	for (i = 0; i < digest->ncentroids; i++)
-		tdigest_add_centroid(state, digest->centroids[i].mean,
-									digest->centroids[i].count);
+		for (i = 0; i < tdigest_shm_nlocal; i++)
+		{
+			if (tdigest_shm_local[i].state != NULL)
+				tdigest_shm_local[n++] = tdigest_shm_local[i];
+		}
 
-	AssertCheckTDigestAggState(state);
+		tdigest_shm_nlocal = n;
 
-	PG_RETURN_POINTER(state);
+		if (tdigest_shm_nlocal == tdigest_shm->ndigests)
+			elog(ERROR, "no free local buffer for shared t-digest \"%s\"", name);
+	}
+
+	local = &tdigest_shm_local[tdigest_shm_nlocal++];
+
+	strlcpy(local->name, name, NAMEDATALEN);
+	local->slot = slot;
+	local->generation = generation;
+	local->state = NULL;
+
+	return local;
 }
 
 /*
- * Calculate trimmed aggregates from centroids.
+ * Discard values in the local buffer of a shared t-digest.
  */
 static void
-tdigest_trimmed_agg(centroid_t *centroids, int ncentroids,
-					int64 count, double low, double high,
-					double *sump, int64 *countp)
+tdigest_shm_discard(tdigest_shm_local_t *local)
 {
-	int		i;
-	double	sum = 0;
-	int64	count_done = 0,
-			count_low,
-			count_high;
+	tdigest_aggstate_t *state = local->state;
 
-	/* translate the percentiles to counts */
-	count_low = floor(count * low);
-	count_high = ceil(count * high);
+	if (state == NULL)
+		return;
 
-	count = 0;
-	for (i = 0; i < ncentroids; i++)
+	if (state->centroids != INLINE_BUFFER(state))
+		pfree(state->centroids);
+
+	pfree(state);
+
+	local->state = NULL;
+}
+
+/*
+ * Merge values from the local buffer into the shared t-digest.
+ *
+ * The local buffer is compacted first (without holding the lock), so that
+ * we only add a small number of sorted centroids to the shared state. If
+ * the t-digest was dropped in the meantime, it's created again.
+ */
+static void
+tdigest_shm_flush(tdigest_shm_local_t *local)
+{
+	int			i;
+	tdigest_aggstate_t *pending = local->state;
+
+	if (pending == NULL)
+		return;
+
+	tdigest_leave_exact(pending);
+	tdigest_compact(pending);
+
+	while (true)
 	{
-		int64	count_add = 0;
+		tdigest_shm_entry_t *entry = TDIGEST_SHM_ENTRY(local->slot);
+		tdigest_aggstate_t *state;
 
-		/* Assume the whole centroid falls into the range. */
-		count_add = centroids[i].count;
+		LWLockAcquire(TDIGEST_SHM_ENTRY_LOCK(local->slot), LW_EXCLUSIVE);
 
-		/*
-		 * If we haven't reached the low threshold yet, skip appropriate
-		 * part of the centroid.
-		 */
-		count_add -= Min(Max(0, count_low - count_done),
-						 count_add);
+		if (entry->generation != local->generation)
+		{
+			LWLockRelease(TDIGEST_SHM_ENTRY_LOCK(local->slot));
 
-		/*
-		 * If we have reached the upper threshold, ignore the overflowing
-		 * part of the centroid.
-		 */
-		count_add = Min(Max(0, count_high - count_done),
-						 count_add);
+			local->slot = tdigest_shm_lookup(local->name, true,
+											 &local->generation);
+			continue;
+		}
 
-		/* consider the whole centroid processed */
-		count_done += centroids[i].count;
+		state = tdigest_shm_state(entry);
 
-		/* increment the sum / count */
-		sum += centroids[i].mean * count_add;
-		count += count_add;
+		tdigest_merge_stats(state, pending->min, pending->max, pending->sum);
 
-		/* break once we cross the high threshold */
-		if (count_done >= count_high)
-			break;
+		for (i = 0; i < pending->ncentroids; i++)
+			tdigest_add_centroid(state, pending->centroids[i].mean,
+								 pending->centroids[i].count);
+
+		LWLockRelease(TDIGEST_SHM_ENTRY_LOCK(local->slot));
+
+		break;
 	}
 
-	*sump = sum;
-	*countp = count;
+	tdigest_shm_discard(local);
 }
 
+/*
+ * Flush the local buffers at commit, and discard them on abort. The shared
+ * t-digests are not transactional, but this way values added by aborted
+ * transactions are (mostly) not included.
+ */
+static void
+tdigest_shm_xact_callback(XactEvent event, void *arg)
+{
+	int		i;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PARALLEL_PRE_COMMIT:
+		case XACT_EVENT_PRE_PREPARE:
+			for (i = 0; i < tdigest_shm_nlocal; i++)
+				tdigest_shm_flush(&tdigest_shm_local[i]);
+			break;
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			for (i = 0; i < tdigest_shm_nlocal; i++)
+				tdigest_shm_discard(&tdigest_shm_local[i]);
+			break;
+
+		default:
+			break;
+	}
+}
 
 /*
- * Compute percentile from a tdigest. Final function for tdigest aggregate
- * with a single percentile.
+ * Add a value to a shared t-digest (created if it does not exist).
+ *
+ * The value is added to a local buffer first, and merged into the shared
+ * t-digest only when the buffer fills up or at commit. So we only acquire
+ * the lock for the shared t-digest once per many values, and most of the
+ * work (sorting, compaction) happens without holding it.
  */
 Datum
-tdigest_trimmed_avg(PG_FUNCTION_ARGS)
+tdigest_shm_add(PG_FUNCTION_ARGS)
 {
-	tdigest_aggstate_t	   *state;
-	MemoryContext	aggcontext;
-	double			sum;
-	int64			count;
+	static bool	callback_registered = false;
+	char	   *name = tdigest_shm_name(fcinfo, 0);
+	tdigest_shm_local_t *local;
+	MemoryContext	oldcontext;
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_percentiles called in non-aggregate context");
+	local = tdigest_shm_local_entry(name, true);
 
-	/* if there's no digest, return NULL */
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	if (!callback_registered)
+	{
+		RegisterXactCallback(tdigest_shm_xact_callback, NULL);
+		callback_registered = true;
+	}
 
-	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	oldcontext = MemoryContextSwitchTo(tdigest_shm_context);
 
-	/* make sure the centroids are sorted */
-	tdigest_sort(state);
+	if (local->state == NULL)
+		local->state = tdigest_aggstate_allocate(0, 0, tdigest_shm->compression);
 
-	tdigest_trimmed_agg(state->centroids, state->ncentroids,
-						state->count, state->trim_low, state->trim_high,
-						&sum, &count);
+	tdigest_add(local->state, PG_GETARG_FLOAT8(1));
 
-	if (count > 0)
-		PG_RETURN_FLOAT8(sum / count);
+	MemoryContextSwitchTo(oldcontext);
 
-	PG_RETURN_NULL();
+	/* flush after collecting a full buffer of values */
+	if (local->state->count >= BUFFER_SIZE(local->state->compression))
+		tdigest_shm_flush(local);
+
+	PG_RETURN_VOID();
 }
 
 /*
- * Compute percentile from a tdigest. Final function for tdigest aggregate
- * with a single percentile.
+ * Get a shared t-digest (NULL if it does not exist or is empty), and
+ * optionally reset it. The values still in local buffers of other backends
+ * are not included.
  */
 Datum
-tdigest_trimmed_sum(PG_FUNCTION_ARGS)
+tdigest_shm_get(PG_FUNCTION_ARGS)
 {
-	tdigest_aggstate_t	   *state;
-	MemoryContext	aggcontext;
-	double			sum;
-	int64			count;
+	char	   *name = tdigest_shm_name(fcinfo, 0);
+	bool		reset = PG_GETARG_BOOL(1);
+	tdigest_shm_local_t *local;
+	tdigest_shm_entry_t *entry;
+	tdigest_aggstate_t *state;
+	tdigest_t  *digest = NULL;
+	uint64		generation;
+	int			slot;
 
-	/* cannot be called directly because of internal-type argument */
-	if (!AggCheckCallContext(fcinfo, &aggcontext))
-		elog(ERROR, "tdigest_percentiles called in non-aggregate context");
+	/* make our own values visible */
+	local = tdigest_shm_local_entry(name, false);
+	if (local != NULL)
+		tdigest_shm_flush(local);
 
-	/* if there's no digest, return NULL */
-	if (PG_ARGISNULL(0))
+	slot = tdigest_shm_lookup(name, false, &generation);
+	if (slot == -1)
 		PG_RETURN_NULL();
 
-	state = (tdigest_aggstate_t *) PG_GETARG_POINTER(0);
+	entry = TDIGEST_SHM_ENTRY(slot);
 
-	/* make sure the centroids are sorted */
-	tdigest_sort(state);
+	/* exclusive lock, as building the digest compacts the state */
+	LWLockAcquire(TDIGEST_SHM_ENTRY_LOCK(slot), LW_EXCLUSIVE);
 
-	tdigest_trimmed_agg(state->centroids, state->ncentroids,
-						state->count, state->trim_low, state->trim_high,
-						&sum, &count);
+	/* dropped since the lookup */
+	if (entry->generation != generation)
+	{
+		LWLockRelease(TDIGEST_SHM_ENTRY_LOCK(slot));
+		PG_RETURN_NULL();
+	}
 
-	if (count > 0)
-		PG_RETURN_FLOAT8(sum);
+	state = tdigest_shm_state(entry);
 
-	PG_RETURN_NULL();
+	if (state->count > 0)
+		digest = tdigest_aggstate_to_digest(state, true);
+
+	if (reset)
+		tdigest_shm_reset_state(entry);
+
+	LWLockRelease(TDIGEST_SHM_ENTRY_LOCK(slot));
+
+	if (digest == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_POINTER(digest);
 }
 
 /*
- * Trimmed sum of a single digest (non-aggregate function).
+ * Drop a shared t-digest, releasing the entry for other t-digests. Returns
+ * false if the t-digest does not exist.
  */
 Datum
-tdigest_digest_sum(PG_FUNCTION_ARGS)
+tdigest_shm_drop(PG_FUNCTION_ARGS)
 {
-	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
-	double		low = PG_GETARG_FLOAT8(1);
-	double		high = PG_GETARG_FLOAT8(2);
-
-	double		sum;
-	int64		count;
+	char	   *name = tdigest_shm_name(fcinfo, 0);
+	tdigest_shm_local_t *local;
+	int			i;
+	bool		found = false;
 
-	AssertCheckTDigest(digest);
+	/* forget our own values not flushed yet */
+	local = tdigest_shm_local_entry(name, false);
+	if (local != NULL)
+		tdigest_shm_discard(local);
 
-	tdigest_trimmed_agg(digest->centroids, digest->ncentroids,
-						digest->count, low, high, &sum, &count);
+	LWLockAcquire(TDIGEST_SHM_REGISTRY_LOCK, LW_EXCLUSIVE);
 
-	if (count > 0)
-		PG_RETURN_FLOAT8(sum);
+	for (i = 0; i < tdigest_shm->ndigests; i++)
+	{
+		tdigest_shm_entry_t *entry = TDIGEST_SHM_ENTRY(i);
 
-	PG_RETURN_NULL();
-}
+		if (strcmp(entry->name, name) != 0)
+			continue;
 
-/*
- * Trimmed average of a single digest (non-aggregate function)
- */
-Datum
-tdigest_digest_avg(PG_FUNCTION_ARGS)
-{
-	tdigest_t  *digest = PG_GETARG_TDIGEST(0);
-	double		low = PG_GETARG_FLOAT8(1);
-	double		high = PG_GETARG_FLOAT8(2);
+		LWLockAcquire(TDIGEST_SHM_ENTRY_LOCK(i), LW_EXCLUSIVE);
 
-	double		sum;
-	int64		count;
+		entry->name[0] = '\0';
+		entry->generation++;
+		tdigest_shm_reset_state(entry);
 
-	AssertCheckTDigest(digest);
+		LWLockRelease(TDIGEST_SHM_ENTRY_LOCK(i));
 
-	tdigest_trimmed_agg(digest->centroids, digest->ncentroids,
-						digest->count, low, high, &sum, &count);
+		found = true;
+		break;
+	}
 
-	if (count > 0)
-		PG_RETURN_FLOAT8(sum / count);
+	LWLockRelease(TDIGEST_SHM_REGISTRY_LOCK);
 
-	PG_RETURN_NULL();
+	PG_RETURN_BOOL(found);
 }
 
 /*
@@ -3548,6 +7936,84 @@ array_to_double(FunctionCallInfo fcinfo, ArrayType *v, int *len)
 	return result;
 }
 
+/*
+ * Deconstruct an input array of t-digests, without copying the elements.
+ * The elements may be NULL.
+ *
+ * This expects a single-dimensional array, fails otherwise. Empty arrays
+ * (with no dimensions) are accepted.
+ */
+static Datum *
+array_to_tdigests(FunctionCallInfo fcinfo, ArrayType *v, bool **nulls,
+				  int *len)
+{
+	int16	typlen;
+	bool	typbyval;
+	char	typalign;
+	Datum  *elements;
+
+	if (ARR_NDIM(v) > 1)
+		elog(ERROR, "expected a single-dimensional array (dims = %d)",
+			 ARR_NDIM(v));
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(v), &typlen, &typbyval, &typalign);
+
+	deconstruct_array(v, ARR_ELEMTYPE(v), typlen, typbyval, typalign,
+					  &elements, nulls, len);
+
+	return elements;
+}
+
+/*
+ * Transform an input INT8 SQL array to a plain int64 C array.
+ *
+ * This expects a single-dimensional int8 array without NULLs, fails
+ * otherwise.
+ */
+static int64 *
+array_to_int64(FunctionCallInfo fcinfo, ArrayType *v, int *len)
+{
+	int64  *result;
+	int		ndims;
+	int16	typlen;
+	bool	typbyval;
+	char	typalign;
+	int		i;
+
+	/* deconstruct_array */
+	Datum	   *elements;
+	bool	   *nulls;
+	int			nelements;
+
+	ndims = ARR_NDIM(v);
+
+	/* this is a special-purpose function for single-dimensional arrays */
+	if (ndims != 1)
+		elog(ERROR, "expected a single-dimensional array (dims = %d)", ndims);
+
+	if (ARR_ELEMTYPE(v) != INT8OID)
+		elog(ERROR, "array_to_int64 expects INT8 array");
+
+	get_typlenbyvalalign(INT8OID, &typlen, &typbyval, &typalign);
+
+	deconstruct_array(v, INT8OID, typlen, typbyval, typalign,
+					  &elements, &nulls, &nelements);
+
+	result = (int64 *) palloc(Max(1, nelements) * sizeof(int64));
+
+	for (i = 0; i < nelements; i++)
+	{
+		if (nulls[i])
+			elog(ERROR, "NULL not allowed as a count value");
+
+		result[i] = DatumGetInt64(elements[i]);
+	}
+
+	(*len) = nelements;
+
+	return result;
+}
+
 /*
  * construct an SQL array from a simple C double array
  */
@@ -3570,3 +8036,68 @@ double_to_array(FunctionCallInfo fcinfo, double *d, int len)
 	PG_RETURN_ARRAYTYPE_P(DatumGetPointer(makeArrayResult(astate,
 										  CurrentMemoryContext)));
 }
+
+/*
+ * Transform arrays of low/high percentiles (trim bands) into a single array
+ * of doubles, with low values for all bands followed by the high values.
+ * The arrays have to be of the same length, with valid trim values.
+ */
+static double *
+array_to_trim_bands(FunctionCallInfo fcinfo, ArrayType *low, ArrayType *high,
+					int *nbands)
+{
+	int		i;
+	int		nlow,
+			nhigh;
+	double *lows,
+		   *highs,
+		   *result;
+
+	lows = array_to_double(fcinfo, low, &nlow);
+	highs = array_to_double(fcinfo, high, &nhigh);
+
+	if (nlow != nhigh)
+		elog(ERROR, "number of low and high percentiles does not match (%d != %d)",
+			 nlow, nhigh);
+
+	for (i = 0; i < nlow; i++)
+		check_trim_values(lows[i], highs[i]);
+
+	result = palloc(sizeof(double) * 2 * nlow);
+
+	memcpy(result, lows, sizeof(double) * nlow);
+	memcpy(result + nlow, highs, sizeof(double) * nlow);
+
+	pfree(lows);
+	pfree(highs);
+
+	*nbands = nlow;
+
+	return result;
+}
+
+/*
+ * Build a FLOAT8 array with trimmed sums (or averages) for multiple bands.
+ * Bands without any data are represented by NULL elements.
+ */
+static Datum
+trimmed_bands_to_array(FunctionCallInfo fcinfo, double *sums, int64 *counts,
+					   int nbands, bool avg)
+{
+	ArrayBuildState *astate = NULL;
+	int		 i;
+
+	for (i = 0; i < nbands; i++)
+	{
+		double	value = (avg && counts[i] > 0) ? sums[i] / counts[i] : sums[i];
+
+		astate = accumArrayResult(astate,
+								  Float8GetDatum(value),
+								  (counts[i] == 0),
+								  FLOAT8OID,
+								  CurrentMemoryContext);
+	}
+
+	PG_RETURN_ARRAYTYPE_P(DatumGetPointer(makeArrayResult(astate,
+										  CurrentMemoryContext)));
+}
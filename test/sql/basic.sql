@@ -9,6 +9,9 @@ SET client_min_messages = 'WARNING';
 \i tdigest--1.3.0--1.4.0.sql
 \i tdigest--1.4.0--1.4.1.sql
 \i tdigest--1.4.1--1.4.2.sql
+\i tdigest--1.4.2--1.4.3.sql
+\i tdigest--1.4.3--1.4.4.sql
+\i tdigest--1.4.4--1.5.0.sql
 SET client_min_messages = 'NOTICE';
 SET extra_float_digits = 0;
 
@@ -17,3 +17,8 @@ SELECT array_agg(round(v::numeric,3)) FROM (
 SELECT array_agg(round(v::numeric,3)) FROM (
   SELECT unnest(cast(tdigest(i / 1000.0, 100) as double precision[])) AS v from generate_series(1,1000) s(i)
 ) foo;
+
+-- min/max/sum in JSON are exact, even when "%g" is not enough
+SELECT j->'min' AS min, j->'max' AS max, j->'sum' AS sum FROM (
+  SELECT cast(tdigest(v, 10) as json) AS j FROM (VALUES (1e-9), (0.1), (400080400)) foo(v)
+) bar;
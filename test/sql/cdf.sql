@@ -0,0 +1,31 @@
+SET extra_float_digits = 0;
+
+CREATE TABLE cdf_test (d tdigest);
+
+INSERT INTO cdf_test SELECT tdigest(i, 100) FROM generate_series(1,10000) s(i);
+
+-- CDF at sorted values
+SELECT (SELECT array_agg(round(v::numeric, 5)) FROM unnest(tdigest_cdf(d, ARRAY[0, 2500, 5000, 10000, 20000])) v) AS cdf FROM cdf_test;
+
+-- the results match tdigest_digest_percentile_of
+SELECT
+    tdigest_cdf(d, ARRAY[-1, 1, 10, 100, 1234.5, 5000, 9999, 10000, 10001]) = tdigest_digest_percentile_of(d, ARRAY[-1, 1, 10, 100, 1234.5, 5000, 9999, 10000, 10001]) AS cdf,
+    tdigest_cdf(d, (SELECT array_agg(i * 10.0) FROM generate_series(0,1000) s(i))) = tdigest_digest_percentile_of(d, (SELECT array_agg(i * 10.0) FROM generate_series(0,1000) s(i))) AS bins
+FROM cdf_test;
+
+-- histogram with bins of equal width
+SELECT edges, (SELECT array_agg(round(c::numeric)) FROM unnest(counts) c) AS counts FROM cdf_test, tdigest_histogram(d, 4);
+
+-- all values are in one of the bins
+SELECT (SELECT sum(c) FROM unnest(counts) c) AS total FROM cdf_test, tdigest_histogram(d, 100);
+
+-- all values are the same
+SELECT * FROM tdigest_histogram((SELECT tdigest(1, 100) FROM generate_series(1,10)), 3);
+
+-- the values have to be sorted
+SELECT tdigest_cdf(d, ARRAY[1, 100, 10]) FROM cdf_test;
+
+-- invalid number of bins
+SELECT tdigest_histogram(d, 0) FROM cdf_test;
+
+DROP TABLE cdf_test;
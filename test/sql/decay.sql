@@ -0,0 +1,40 @@
+SET extra_float_digits = 0;
+
+-- decay halves the counts, percentiles remain the same
+WITH data AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,10000) s(i)),
+     decayed AS (SELECT tdigest_decay(d, 0.5) AS d FROM data)
+SELECT
+    tdigest_count(d),
+    (SELECT array_agg(round(v::numeric)) FROM unnest(tdigest_digest_percentile(d, ARRAY[0.01, 0.25, 0.5, 0.75, 0.99])) v) AS percentiles
+FROM decayed;
+
+-- factor 1.0 does not change the digest
+WITH data AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,10000) s(i))
+SELECT tdigest_decay(d, 1.0)::text = d::text AS unchanged FROM data;
+
+-- small digests lose centroids
+WITH data AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,10) s(i))
+SELECT tdigest_count(tdigest_decay(d, 0.5)) FROM data;
+
+-- repeated decay with new data, the old values disappear
+CREATE TABLE decay_t (d tdigest);
+INSERT INTO decay_t SELECT tdigest(i, 100) FROM generate_series(1,10000) s(i);
+
+DO $$
+BEGIN
+    FOR n IN 1..30 LOOP
+        UPDATE decay_t SET d = tdigest_union(tdigest_decay(d, 0.5), (SELECT tdigest(100000 + i, 100) FROM generate_series(1,1000) s(i)));
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+SELECT
+    tdigest_count(d), tdigest_min(d), tdigest_max(d),
+    abs(tdigest_digest_percentile(d, 0.5) - 100500) < 10 AS median
+FROM decay_t;
+
+DROP TABLE decay_t;
+
+-- invalid decay factors
+SELECT tdigest_decay(tdigest(i, 100), 0.0) FROM generate_series(1,10) s(i);
+SELECT tdigest_decay(tdigest(i, 100), 1.5) FROM generate_series(1,10) s(i);
@@ -0,0 +1,64 @@
+DO $$
+DECLARE
+    v_version numeric;
+BEGIN
+
+    SELECT substring(setting from '\d+')::numeric INTO v_version FROM pg_settings WHERE name = 'server_version';
+
+    -- GUCs common for all versions
+    PERFORM set_config('extra_float_digits', '0', false);
+    PERFORM set_config('parallel_setup_cost', '0', false);
+    PERFORM set_config('parallel_tuple_cost', '0', false);
+    PERFORM set_config('max_parallel_workers_per_gather', '2', false);
+
+    -- 9.6 used somewhat different GUC name for relation size
+    IF v_version < 10 THEN
+        PERFORM set_config('min_parallel_relation_size', '1kB', false);
+    ELSE
+        PERFORM set_config('min_parallel_table_scan_size', '1kB', false);
+    END IF;
+
+END;
+$$ LANGUAGE plpgsql;
+
+SET tdigest.deduplicate = on;
+
+-- quantised data, with many repeated values
+CREATE TABLE dedup_test (v double precision);
+INSERT INTO dedup_test SELECT mod(i, 50) * 10 FROM generate_series(1,100000) s(i);
+ANALYZE dedup_test;
+
+-- the results are the same with and without parallelism
+SELECT
+    tdigest_count(tdigest(v, 100)) AS count,
+    abs(tdigest_percentile(v, 100, 0.5) - 245) < 10 AS median,
+    abs(tdigest_percentile(v, 100, 0.99) - 490) < 10 AS p99,
+    abs(tdigest_percentile_of(v, 100, 250) - 0.5) < 0.02 AS median_of
+FROM dedup_test;
+
+SET max_parallel_workers_per_gather = 0;
+
+SELECT
+    tdigest_count(tdigest(v, 100)) AS count,
+    abs(tdigest_percentile(v, 100, 0.5) - 245) < 10 AS median,
+    abs(tdigest_percentile(v, 100, 0.99) - 490) < 10 AS p99,
+    abs(tdigest_percentile_of(v, 100, 250) - 0.5) < 0.02 AS median_of
+FROM dedup_test;
+
+-- deduplication works with counts and the exact mode too
+SET tdigest.exact_threshold = 100;
+
+SELECT
+    tdigest_percentile(v, 3, 100, ARRAY[0.01, 0.5, 0.9]) = percentile_cont(ARRAY[0.01, 0.5, 0.9]) WITHIN GROUP (ORDER BY v) AS percentiles
+FROM dedup_test;
+
+-- mostly distinct values (the hash table gets flushed often)
+SELECT
+    tdigest_count(tdigest(i, 100)) AS count,
+    abs(tdigest_percentile(i, 100, 0.5) - 50000) < 500 AS median
+FROM generate_series(1,100000) s(i);
+
+RESET tdigest.exact_threshold;
+RESET tdigest.deduplicate;
+
+DROP TABLE dedup_test;
@@ -0,0 +1,35 @@
+SET extra_float_digits = 0;
+
+-- per-minute digests
+CREATE TABLE digest_array_test (m int, d tdigest);
+
+INSERT INTO digest_array_test SELECT m, tdigest(m * 1000 + i, 100) FROM generate_series(1,5) m, generate_series(1,1000) s(i) GROUP BY m;
+
+-- a percentile for each digest in the array
+SELECT tdigest_digest_percentile(array_agg(d ORDER BY m), 0.5) FROM digest_array_test;
+
+-- an array of percentiles for each digest in the array
+SELECT tdigest_digest_percentile(array_agg(d ORDER BY m), ARRAY[0.0, 0.5, 1.0]) FROM digest_array_test;
+
+-- the results match the per-digest function
+SELECT
+    tdigest_digest_percentile(array_agg(d ORDER BY m), 0.99) = array_agg(tdigest_digest_percentile(d, 0.99) ORDER BY m) AS percentile,
+    tdigest_digest_percentile(array_agg(d ORDER BY m), ARRAY[0.01, 0.5, 0.99]) = array_agg(tdigest_digest_percentile(d, ARRAY[0.01, 0.5, 0.99]) ORDER BY m) AS percentiles
+FROM digest_array_test;
+
+-- NULL digests produce NULL values
+SELECT tdigest_digest_percentile(ARRAY[NULL, d, NULL], 0.5) FROM digest_array_test WHERE m = 1;
+SELECT tdigest_digest_percentile(ARRAY[NULL, d, NULL], ARRAY[0.5, 1.0]) FROM digest_array_test WHERE m = 1;
+
+-- empty array
+SELECT tdigest_digest_percentile(ARRAY[]::tdigest[], 0.5);
+SELECT tdigest_digest_percentile(ARRAY[]::tdigest[], ARRAY[0.5]);
+
+-- invalid percentiles
+SELECT tdigest_digest_percentile(array_agg(d), 1.5) FROM digest_array_test;
+SELECT tdigest_digest_percentile(array_agg(d), ARRAY[0.5, -0.5]) FROM digest_array_test;
+
+-- multi-dimensional arrays are not supported
+SELECT tdigest_digest_percentile(ARRAY[[d, d]], 0.5) FROM digest_array_test WHERE m = 1;
+
+DROP TABLE digest_array_test;
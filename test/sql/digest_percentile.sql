@@ -0,0 +1,57 @@
+-- percentiles estimated directly from a single digest
+CREATE TABLE digest_percentile_test (d tdigest);
+
+INSERT INTO digest_percentile_test SELECT tdigest(i, 100) FROM generate_series(1,10000) s(i);
+
+-- digests built by the aggregate are marked as compacted
+SELECT (cast(d AS double precision[]))[1] AS flags FROM digest_percentile_test;
+
+-- the results match the aggregates on the same digest
+SELECT
+    tdigest_digest_percentile(d, 0.95) = (SELECT tdigest_percentile(d, 0.95) FROM digest_percentile_test) AS percentile,
+    tdigest_digest_percentile(d, ARRAY[0.01, 0.5, 0.99]) = (SELECT tdigest_percentile(d, ARRAY[0.01, 0.5, 0.99]) FROM digest_percentile_test) AS percentiles,
+    tdigest_digest_percentile_of(d, 950) = (SELECT tdigest_percentile_of(d, 950) FROM digest_percentile_test) AS percentile_of,
+    tdigest_digest_percentile_of(d, ARRAY[100, 5000, 9900]) = (SELECT tdigest_percentile_of(d, ARRAY[100, 5000, 9900]) FROM digest_percentile_test) AS percentiles_of
+FROM digest_percentile_test;
+
+-- sanity check of the estimates
+SELECT
+    abs(tdigest_digest_percentile(d, 0.5) - 5000) < 50 AS median,
+    abs(tdigest_digest_percentile(d, 0.99) - 9900) < 50 AS p99,
+    abs(tdigest_digest_percentile_of(d, 5000) - 0.5) < 0.01 AS median_of,
+    tdigest_digest_percentile(d, 0.0) = 1 AS min,
+    tdigest_digest_percentile(d, 1.0) = 10000 AS max
+FROM digest_percentile_test;
+
+-- digests not marked as compacted get compacted first
+WITH data AS (SELECT 'flags 1 count 20 compression 10 centroids 8 (1000.000000, 1) (2000.000000, 1) (3500.000000, 2) (6500.000000, 4) (14000.000000, 5) (29000.000000, 4) (40000.000000, 2) (44000.000000, 1)'::tdigest AS d)
+SELECT
+    tdigest_digest_percentile(d, 0.5) = (SELECT tdigest_percentile(d, 0.5) FROM data) AS percentile,
+    tdigest_digest_percentile_of(d, 20000) = (SELECT tdigest_percentile_of(d, 20000) FROM data) AS percentile_of
+FROM data;
+
+-- compacted digests have to use the new format
+SELECT tdigest_count(v::tdigest) FROM (VALUES ('flags 2 count 2 compression 10 centroids 2 (1.000000, 1) (2.000000, 1)')) foo(v);
+
+-- repeated calls with the same digest (cached) and with changing digests
+WITH data AS (SELECT g, tdigest(i, 100) AS d FROM (SELECT mod(i, 3) AS g, i FROM generate_series(1,10000) s(i)) foo GROUP BY g),
+     vals AS (SELECT i AS v FROM generate_series(1,100) s(i)),
+     a AS (SELECT g, v, tdigest_digest_percentile(d, v / 100.0) AS p, tdigest_digest_percentile_of(d, v * 100) AS p_of FROM (SELECT * FROM data, vals ORDER BY g, v) foo),
+     b AS (SELECT g, v, tdigest_digest_percentile(d, v / 100.0) AS p, tdigest_digest_percentile_of(d, v * 100) AS p_of FROM (SELECT * FROM data, vals ORDER BY v, g) foo)
+SELECT count(*), bool_and(a.p = b.p) AS percentile, bool_and(a.p_of = b.p_of) AS percentile_of FROM a JOIN b USING (g, v);
+
+-- invalid percentile
+SELECT tdigest_digest_percentile(d, 1.5) FROM digest_percentile_test;
+
+DROP TABLE digest_percentile_test;
+
+-- digests with full buffer can't be marked as compacted, adding data works
+CREATE TABLE digest_full_test AS SELECT ('flags 3 count 100 compression 10 centroids 100' || string_agg(format(' (%s, 1)', i), '' ORDER BY i))::tdigest AS d FROM generate_series(1,100) s(i);
+
+SELECT (cast(d AS double precision[]))[1] AS flags FROM digest_full_test;
+
+SELECT tdigest_count(tdigest_add(d, 50.5)) AS added, tdigest_count(tdigest_union(d, d)) AS merged FROM digest_full_test;
+
+SELECT tdigest_count(tdigest(d)), abs(tdigest_percentile(d, 0.5) - 50.5) < 5 AS median FROM (SELECT d FROM digest_full_test UNION ALL SELECT d FROM digest_full_test) foo;
+
+DROP TABLE digest_full_test;
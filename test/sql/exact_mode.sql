@@ -0,0 +1,48 @@
+-- exact mode for low-cardinality data
+SET tdigest.exact_threshold = 100;
+
+-- with few distinct values the percentiles match percentile_cont
+WITH data AS (SELECT mod(i, 17) AS v FROM generate_series(1,100000) s(i))
+SELECT
+    tdigest_percentile(v, 100, ARRAY[0.0, 0.01, 0.1, 0.33, 0.5, 0.9, 0.99, 1.0]) = percentile_cont(ARRAY[0.0, 0.01, 0.1, 0.33, 0.5, 0.9, 0.99, 1.0]) WITHIN GROUP (ORDER BY v) AS percentiles
+FROM data;
+
+-- the same with counts
+WITH data AS (SELECT mod(i, 17) AS v, 1 + mod(i, 3) AS c FROM generate_series(1,10000) s(i))
+SELECT
+    tdigest_percentile(v, c, 100, 0.9) = (SELECT percentile_cont(0.9) WITHIN GROUP (ORDER BY v) FROM data, generate_series(1, c)) AS percentile
+FROM data;
+
+-- per-group percentiles
+WITH data AS (SELECT mod(i, 100) AS g, mod(i, 7) * mod(i, 13) AS v FROM generate_series(1,100000) s(i)),
+     agg AS (SELECT g, tdigest_percentile(v, 100, 0.95) AS a, percentile_cont(0.95) WITHIN GROUP (ORDER BY v) AS b FROM data GROUP BY g)
+SELECT bool_and(a = b) AS percentiles FROM agg;
+
+-- small groups with one or two percentiles (calculated by selection)
+WITH data AS (SELECT mod(i, 2000) AS g, mod(i * 7919, 1009) AS v FROM generate_series(1,100000) s(i)),
+     agg AS (SELECT g,
+                    tdigest_percentile(v, 100, 0.3) AS a1,
+                    percentile_cont(0.3) WITHIN GROUP (ORDER BY v) AS b1,
+                    tdigest_percentile(v, 100, ARRAY[0.05, 0.77]) AS a2,
+                    percentile_cont(ARRAY[0.05, 0.77]) WITHIN GROUP (ORDER BY v) AS b2
+               FROM data GROUP BY g)
+SELECT bool_and(a1 = b1) AS percentile, bool_and(a2 = b2) AS percentiles FROM agg;
+
+-- relative ranks are exact too
+WITH data AS (SELECT mod(i, 17) AS v FROM generate_series(1,100000) s(i))
+SELECT
+    abs(tdigest_percentile_of(v, 100, 8) - (count(*) FILTER (WHERE v < 8) + count(*) FILTER (WHERE v = 8) / 2.0) / count(*)) < 0.000001 AS percentile_of,
+    tdigest_percentile_of(v, 100, -1) = 0 AS below_min,
+    tdigest_percentile_of(v, 100, 100) = 1 AS above_max
+FROM data;
+
+-- too many distinct values, switch to regular t-digest
+SET tdigest.exact_threshold = 10;
+
+WITH data AS (SELECT mod(i, 17) AS v FROM generate_series(1,100000) s(i))
+SELECT
+    abs(tdigest_percentile(v, 100, 0.5) - 8) < 1 AS median,
+    tdigest_count(tdigest(v, 100)) AS count
+FROM data;
+
+RESET tdigest.exact_threshold;
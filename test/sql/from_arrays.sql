@@ -0,0 +1,25 @@
+SET extra_float_digits = 0;
+
+-- sorted centroids are used directly
+SELECT tdigest_from_arrays(ARRAY[1.0, 2.0, 3.5], ARRAY[1, 1, 2], 10);
+
+-- unsorted centroids get sorted and compacted
+WITH data AS (SELECT tdigest_from_arrays(ARRAY[3.5, 1.0, 2.0], ARRAY[2, 1, 1], 10) AS d)
+SELECT d::text LIKE 'flags 7 %' AS compacted, tdigest_count(d), tdigest_min(d), tdigest_max(d), tdigest_sum(d) FROM data;
+
+-- round trip through the array cast
+WITH data AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,10000) s(i)),
+     arrays AS (SELECT d::double precision[] AS a FROM data)
+SELECT (tdigest_from_arrays(
+            ARRAY(SELECT a[i] FROM generate_series(5, array_length(a, 1), 2) s(i)),
+            ARRAY(SELECT a[i]::bigint FROM generate_series(6, array_length(a, 1), 2) s(i)),
+            100)::double precision[])[2:] = a[2:] AS round_trip
+FROM arrays;
+
+-- invalid inputs
+SELECT tdigest_from_arrays(ARRAY[1.0, 2.0], ARRAY[1], 10);
+SELECT tdigest_from_arrays(ARRAY[1.0, 2.0], ARRAY[1, 0], 10);
+SELECT tdigest_from_arrays(ARRAY[1.0, 'NaN'], ARRAY[1, 1], 10);
+SELECT tdigest_from_arrays(ARRAY[1.0, NULL], ARRAY[1, 1], 10);
+SELECT tdigest_from_arrays(ARRAY[1.0, 2.0], ARRAY[1, NULL], 10);
+SELECT tdigest_from_arrays(ARRAY[1.0, 2.0], ARRAY[1, 1], 5);
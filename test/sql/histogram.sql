@@ -0,0 +1,28 @@
+SET extra_float_digits = 0;
+
+-- uniform histogram
+WITH data AS (SELECT tdigest_from_histogram(ARRAY[0, 10, 20, 30, 40, 50, 60, 70, 80, 90, 100], ARRAY[1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000], 100) AS d)
+SELECT
+    tdigest_count(d), tdigest_min(d), tdigest_max(d), round(tdigest_mean(d)::numeric, 6) AS mean,
+    (SELECT array_agg(round(v::numeric, 2)) FROM unnest(tdigest_digest_percentile(d, ARRAY[0.01, 0.25, 0.5, 0.75, 0.99])) v) AS percentiles
+FROM data;
+
+-- cumulative counts produce the same digest
+SELECT
+    tdigest_from_histogram(ARRAY[0, 10, 20, 30, 40], ARRAY[100, 200, 50, 1000], 100)::text =
+    tdigest_from_histogram(ARRAY[0, 10, 20, 30, 40], ARRAY[100, 300, 350, 1350], 100, true)::text AS cumulative;
+
+-- empty buckets at the beginning and at the end
+WITH data AS (SELECT tdigest_from_histogram(ARRAY[0, 10, 20, 30, 40, 50, 60, 70, 80, 90, 100], ARRAY[0, 0, 5, 0, 0, 0, 0, 7, 0, 0], 100) AS d)
+SELECT
+    tdigest_count(d), tdigest_min(d), tdigest_max(d),
+    (SELECT array_agg(round(v::numeric, 2)) FROM unnest(tdigest_digest_percentile(d, ARRAY[0.01, 0.25, 0.5, 0.75, 0.99])) v) AS percentiles
+FROM data;
+
+-- invalid histograms
+SELECT tdigest_from_histogram(ARRAY[0, 10, 20], ARRAY[1, 2, 3], 100);
+SELECT tdigest_from_histogram(ARRAY[0, 20, 10], ARRAY[1, 2], 100);
+SELECT tdigest_from_histogram(ARRAY[0, 10, 'Infinity'::float8], ARRAY[1, 2], 100);
+SELECT tdigest_from_histogram(ARRAY[0, 10, 20], ARRAY[1, -2], 100);
+SELECT tdigest_from_histogram(ARRAY[0, 10, 20], ARRAY[5, 2], 100, true);
+SELECT tdigest_from_histogram(ARRAY[0, 10, 20], ARRAY[0, 0], 100);
@@ -0,0 +1,32 @@
+SET extra_float_digits = 0;
+
+-- one digest per group, each covering a distinct range of values
+CREATE TABLE index_test (g int, d tdigest);
+INSERT INTO index_test SELECT g, tdigest(v, 100) FROM (SELECT i / 100 AS g, i AS v FROM generate_series(0,9999) s(i)) foo GROUP BY g ORDER BY g;
+
+-- BRIN index on the exact min/max stored in the header
+CREATE INDEX index_test_brin ON index_test USING brin (tdigest_min(d), tdigest_max(d));
+ANALYZE index_test;
+
+SET enable_seqscan = off;
+
+EXPLAIN (COSTS OFF) SELECT g FROM index_test WHERE tdigest_max(d) > 9500;
+SELECT g FROM index_test WHERE tdigest_max(d) > 9500 ORDER BY g;
+
+-- the containment operators get inlined, and use the same index
+EXPLAIN (COSTS OFF) SELECT g FROM index_test WHERE d @> 4250;
+SELECT g FROM index_test WHERE d @> 4250;
+SELECT g FROM index_test WHERE 4250 <@ d;
+SELECT g FROM index_test WHERE d @> 4199.5;
+SELECT g FROM index_test WHERE d @> -1;
+
+-- percentiles are bounded by the maximum, which can be used to prune
+SELECT g FROM index_test WHERE tdigest_max(d) > 9500 AND tdigest_digest_percentile(d, 0.99) > 9500 ORDER BY g;
+
+RESET enable_seqscan;
+
+-- same results without the index
+SELECT count(*) FROM index_test WHERE tdigest_max(d) > 9500;
+SELECT count(*) FROM index_test WHERE d @> 4250;
+
+DROP TABLE index_test;
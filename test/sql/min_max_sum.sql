@@ -0,0 +1,60 @@
+SET extra_float_digits = 0;
+
+CREATE TABLE min_max_sum_test (g int, v double precision);
+INSERT INTO min_max_sum_test SELECT mod(i, 10), mod(i * 7919, 10007) - 5000 FROM generate_series(1,100000) s(i);
+
+-- exact min/max/mean/sum stored in the digest
+WITH data AS (SELECT tdigest(v, 100) AS d FROM min_max_sum_test)
+SELECT tdigest_min(d), tdigest_max(d), tdigest_mean(d), tdigest_sum(d) FROM data;
+
+SELECT min(v), max(v), avg(v), sum(v) FROM min_max_sum_test;
+
+-- combining digests keeps the exact values
+WITH data AS (SELECT g, tdigest(v, 100) AS d FROM min_max_sum_test GROUP BY g)
+SELECT tdigest_min(tdigest(d)), tdigest_max(tdigest(d)), tdigest_sum(tdigest(d)) FROM data;
+
+-- values added with a count
+WITH data AS (SELECT tdigest(v, 10, 100) AS d FROM min_max_sum_test)
+SELECT tdigest_min(d), tdigest_max(d), tdigest_sum(d) FROM data;
+
+-- incremental updates
+WITH data AS (SELECT tdigest(v, 100) AS d FROM min_max_sum_test)
+SELECT tdigest_min(tdigest_add(d, -10000)), tdigest_max(tdigest_add(d, 10000)), tdigest_sum(tdigest_add(d, 100)) FROM data;
+
+-- extreme percentiles are the exact min/max
+SELECT
+    tdigest_percentile(v, 100, 0.0) = min(v) AS p0,
+    tdigest_percentile(v, 100, 1.0) = max(v) AS p100,
+    tdigest_percentile_of(v, 100, -5001) AS below_min,
+    tdigest_percentile_of(v, 100, 5007) AS above_max
+FROM min_max_sum_test;
+
+-- text round trip
+WITH data AS (SELECT tdigest(v, 100) AS d FROM min_max_sum_test)
+SELECT tdigest_min(d::text::tdigest), tdigest_max(d::text::tdigest), tdigest_sum(d::text::tdigest) FROM data;
+
+-- digests without the stats derive them from centroids
+SELECT tdigest_min(v::tdigest), tdigest_max(v::tdigest), tdigest_sum(v::tdigest), tdigest_mean(v::tdigest) FROM (VALUES ('flags 1 count 4 compression 10 centroids 3 (1.000000, 1) (2.500000, 2) (7.000000, 1)')) foo(v);
+
+-- the extremes are used to interpolate on the tails
+SELECT
+    tdigest_percentile(v::tdigest, 0.0) AS p0,
+    tdigest_percentile(v::tdigest, 0.125) AS p125,
+    tdigest_percentile(v::tdigest, 0.875) AS p875,
+    tdigest_percentile(v::tdigest, 1.0) AS p100
+FROM (VALUES ('flags 7 count 8 compression 10 centroids 2 min 0.000000 max 20.000000 sum 44.000000 (1.000000, 4) (10.000000, 4)')) foo(v);
+
+-- invalid extended header
+SELECT tdigest_count(v::tdigest) FROM (VALUES ('flags 7 count 2 compression 10 centroids 2 min 3.000000 max 1.000000 sum 3.000000 (1.000000, 1) (2.000000, 1)')) foo(v);
+SELECT tdigest_count(v::tdigest) FROM (VALUES ('flags 4 count 2 compression 10 centroids 2 min 1.000000 max 2.000000 sum 3.000000 (1.000000, 1) (2.000000, 1)')) foo(v);
+
+-- min/max/sum survive a text round trip exactly
+WITH data AS (SELECT tdigest(v, 100) AS d FROM (VALUES (1e-9), (0.1), (0.2)) foo(v))
+SELECT
+    tdigest_min(d::text::tdigest) = tdigest_min(d) AS min,
+    tdigest_max(d::text::tdigest) = tdigest_max(d) AS max,
+    tdigest_sum(d::text::tdigest) = tdigest_sum(d) AS sum,
+    tdigest_min(d::text::tdigest) AS min_value
+FROM data;
+
+DROP TABLE min_max_sum_test;
@@ -0,0 +1,53 @@
+SET extra_float_digits = 0;
+
+CREATE TABLE ordered_set_test (g int, v double precision);
+INSERT INTO ordered_set_test SELECT mod(i, 10), mod(i * 7919, 10007) / 10007.0 FROM generate_series(1,100000) s(i);
+
+-- ordered-set aggregates match the regular ones
+SELECT
+    tdigest_ordered_percentile(0.5) WITHIN GROUP (ORDER BY v, 100) = tdigest_percentile(v, 100, 0.5) AS p50,
+    tdigest_ordered_percentile(0.9) WITHIN GROUP (ORDER BY v, 100) = tdigest_percentile(v, 100, 0.9) AS p90,
+    tdigest_ordered_percentile(0.99) WITHIN GROUP (ORDER BY v, 100) = tdigest_percentile(v, 100, 0.99) AS p99,
+    tdigest_ordered_percentile(ARRAY[0.01, 0.5]) WITHIN GROUP (ORDER BY v, 100) = tdigest_percentile(v, 100, ARRAY[0.01, 0.5]) AS parray,
+    tdigest_ordered_percentile_of(0.3) WITHIN GROUP (ORDER BY v, 100) = tdigest_percentile_of(v, 100, 0.3) AS pof,
+    tdigest_ordered_percentile_of(ARRAY[0.3, 0.7]) WITHIN GROUP (ORDER BY v, 100) = tdigest_percentile_of(v, 100, ARRAY[0.3, 0.7]) AS pofarray
+FROM ordered_set_test;
+
+-- trimmed aggregates match the results calculated from a t-digest
+SELECT
+    tdigest_ordered_avg(0.1, 0.9) WITHIN GROUP (ORDER BY v, 100) = tdigest_digest_avg(tdigest(v, 100), 0.1, 0.9) AS avg,
+    tdigest_ordered_sum(0.1, 0.9) WITHIN GROUP (ORDER BY v, 100) = tdigest_digest_sum(tdigest(v, 100), 0.1, 0.9) AS sum
+FROM ordered_set_test;
+
+-- multiple aggregates sharing the same state, per group
+WITH agg AS (
+    SELECT
+        g,
+        tdigest_ordered_percentile(0.5) WITHIN GROUP (ORDER BY v, 100) AS a1,
+        tdigest_ordered_percentile(0.9) WITHIN GROUP (ORDER BY v, 100) AS a2,
+        tdigest_ordered_avg(0.1, 0.9) WITHIN GROUP (ORDER BY v, 100) AS a3,
+        tdigest_ordered_percentile_of(0.5) WITHIN GROUP (ORDER BY v, 100) AS a4,
+        tdigest_percentile(v, 100, 0.5) AS b1,
+        tdigest_percentile(v, 100, 0.9) AS b2,
+        tdigest_digest_avg(tdigest(v, 100), 0.1, 0.9) AS b3,
+        tdigest_percentile_of(v, 100, 0.5) AS b4
+    FROM ordered_set_test GROUP BY g
+)
+SELECT bool_and(a1 = b1) AS p50, bool_and(a2 = b2) AS p90, bool_and(a3 = b3) AS avg, bool_and(a4 = b4) AS pof FROM agg;
+
+-- the estimates are reasonably accurate
+SELECT
+    abs(tdigest_ordered_percentile(0.5) WITHIN GROUP (ORDER BY v, 100) - 0.5) < 0.01 AS median,
+    abs(tdigest_ordered_avg(0.0, 1.0) WITHIN GROUP (ORDER BY v, 100) - avg(v)) < 0.000001 AS avg,
+    abs(tdigest_ordered_sum(0.0, 1.0) WITHIN GROUP (ORDER BY v, 100) - sum(v)) < 0.001 AS sum
+FROM ordered_set_test;
+
+-- NULL direct arguments and empty input
+SELECT tdigest_ordered_percentile(NULL::double precision) WITHIN GROUP (ORDER BY v, 100) FROM ordered_set_test;
+SELECT tdigest_ordered_percentile(0.5) WITHIN GROUP (ORDER BY v, 100) FROM ordered_set_test WHERE v < 0;
+
+-- invalid percentiles / trim values
+SELECT tdigest_ordered_percentile(1.5) WITHIN GROUP (ORDER BY v, 100) FROM ordered_set_test;
+SELECT tdigest_ordered_avg(0.9, 0.1) WITHIN GROUP (ORDER BY v, 100) FROM ordered_set_test;
+
+DROP TABLE ordered_set_test;
@@ -0,0 +1,39 @@
+SET extra_float_digits = 0;
+
+-- recompress a small digest
+SELECT tdigest_recompress(tdigest(i, 100), 10) FROM generate_series(1,10) s(i);
+
+-- same compression does not change the digest
+WITH data AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,10000) s(i))
+SELECT tdigest_recompress(d, 100)::text = d::text AS unchanged FROM data;
+
+-- lower compression, fewer centroids but same count, min/max and sum
+WITH data AS (SELECT tdigest(i, 1000) AS d FROM generate_series(1,100000) s(i)),
+     recompressed AS (SELECT d, tdigest_recompress(d, 100) AS r FROM data)
+SELECT
+    tdigest_count(r), tdigest_min(r), tdigest_max(r), tdigest_sum(r),
+    pg_column_size(r) < pg_column_size(d) / 4 AS smaller,
+    (SELECT bool_and(abs(v - p * 100000) < 100)
+       FROM unnest(ARRAY[0.01, 0.1, 0.5, 0.9, 0.99],
+                   tdigest_digest_percentile(r, ARRAY[0.01, 0.1, 0.5, 0.9, 0.99])) x(p, v)) AS accurate
+FROM recompressed;
+
+-- merge digests with different compressions into a chosen compression
+CREATE TABLE recompress_t (d tdigest);
+INSERT INTO recompress_t SELECT tdigest(i, 1000) FROM generate_series(1,50000) s(i);
+INSERT INTO recompress_t SELECT tdigest(i, 100) FROM generate_series(50001,100000) s(i);
+
+WITH merged AS (SELECT tdigest(d, 50) AS d FROM recompress_t)
+SELECT
+    tdigest_count(d), tdigest_min(d), tdigest_max(d),
+    d::text LIKE 'flags 7 count 100000 compression 50 %' AS compression,
+    (SELECT bool_and(abs(v - p * 100000) < 200)
+       FROM unnest(ARRAY[0.01, 0.1, 0.5, 0.9, 0.99],
+                   tdigest_digest_percentile(d, ARRAY[0.01, 0.1, 0.5, 0.9, 0.99])) x(p, v)) AS accurate
+FROM merged;
+
+DROP TABLE recompress_t;
+
+-- invalid compression
+SELECT tdigest_recompress(tdigest(i, 100), 5) FROM generate_series(1,10) s(i);
+SELECT tdigest(d, 20000) FROM (SELECT tdigest(i, 100) AS d FROM generate_series(1,10) s(i)) foo;
@@ -0,0 +1,8 @@
+-- shared t-digests are available only with shared_preload_libraries
+SELECT tdigest_shm_add('latency', 1.0);
+
+SELECT tdigest_shm_get('latency');
+
+SELECT tdigest_shm_get('latency', true);
+
+SELECT tdigest_shm_drop('latency');
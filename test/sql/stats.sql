@@ -0,0 +1,25 @@
+-- statistics are collected only when enabled
+SELECT tdigest_stats_reset();
+
+SELECT tdigest_count(tdigest(i, 100)) FROM generate_series(1,100000) s(i);
+
+SELECT compactions, sorts, sorted_centroids, combines, serialized, deserialized, compact_time, sort_time FROM tdigest_stats();
+
+SET tdigest.track_stats = on;
+
+SELECT tdigest_count(tdigest(i, 100)) FROM generate_series(1,100000) s(i);
+
+SELECT
+    compactions > 0 AS compactions,
+    sorts >= compactions AS sorts,
+    sorted_centroids >= 100000 AS sorted_centroids,
+    compact_time > 0 AS compact_time,
+    sort_time > 0 AS sort_time
+FROM tdigest_stats();
+
+-- reset the statistics
+SELECT tdigest_stats_reset();
+
+SELECT compactions, sorts, sorted_centroids, combines, serialized, deserialized, compact_time, sort_time FROM tdigest_stats();
+
+RESET tdigest.track_stats;
@@ -0,0 +1,37 @@
+SET extra_float_digits = 0;
+
+-- subtract a small digest
+WITH a AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,10) s(i)),
+     b AS (SELECT tdigest(i, 100) AS d FROM generate_series(3,5) s(i))
+SELECT tdigest_subtract(a.d, b.d) FROM a, b;
+
+-- remove the lowest values
+WITH a AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,10000) s(i)),
+     b AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,1000) s(i)),
+     r AS (SELECT tdigest_subtract(a.d, b.d) AS d FROM a, b)
+SELECT
+    tdigest_count(d), tdigest_sum(d), tdigest_max(d),
+    (SELECT bool_and(abs(v - (1000 + p * 9000)) < 100)
+       FROM unnest(ARRAY[0.1, 0.25, 0.5, 0.75, 0.99],
+                   tdigest_digest_percentile(d, ARRAY[0.1, 0.25, 0.5, 0.75, 0.99])) x(p, v)) AS accurate
+FROM r;
+
+-- remove every other value
+WITH a AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,10000) s(i)),
+     b AS (SELECT tdigest(i, 100) AS d FROM generate_series(2,10000,2) s(i)),
+     r AS (SELECT tdigest_subtract(a.d, b.d) AS d FROM a, b)
+SELECT
+    tdigest_count(d), tdigest_sum(d),
+    (SELECT bool_and(abs(v - p * 10000) < 100)
+       FROM unnest(ARRAY[0.01, 0.25, 0.5, 0.75, 0.99],
+                   tdigest_digest_percentile(d, ARRAY[0.01, 0.25, 0.5, 0.75, 0.99])) x(p, v)) AS accurate
+FROM r;
+
+-- subtracting all values gives NULL
+WITH a AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,1000) s(i))
+SELECT tdigest_subtract(d, d) IS NULL AS is_null FROM a;
+
+-- can't subtract more values than there are in the digest
+WITH a AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,10) s(i)),
+     b AS (SELECT tdigest(i, 100) AS d FROM generate_series(1,100) s(i))
+SELECT tdigest_subtract(a.d, b.d) FROM a, b;
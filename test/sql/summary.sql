@@ -0,0 +1,33 @@
+SET extra_float_digits = 0;
+
+CREATE TABLE summary_test (g int, v double precision);
+INSERT INTO summary_test SELECT mod(i, 10), mod(i * 7919, 10007) / 10007.0 FROM generate_series(1,100000) s(i);
+
+-- simple digest
+SELECT * FROM tdigest_summary((SELECT tdigest(i, 100) FROM generate_series(1,10) s(i)), ARRAY[0.0, 1.0], ARRAY[0.0]);
+
+-- the summary matches the separate functions
+WITH data AS (SELECT tdigest(v, 100) AS d FROM summary_test)
+SELECT
+    s.count = tdigest_count(d) AS count,
+    s.min = tdigest_min(d) AS min,
+    s.max = tdigest_max(d) AS max,
+    s.mean = tdigest_mean(d) AS mean,
+    s.percentiles = tdigest_digest_percentile(d, ARRAY[0.01, 0.5, 0.95, 0.99]) AS percentiles,
+    s.trimmed_means = tdigest_digest_avg(d, ARRAY[0.0, 0.05, 0.25], ARRAY[1.0, 0.95, 0.75]) AS trimmed_means
+FROM data, LATERAL tdigest_summary(d, ARRAY[0.01, 0.5, 0.95, 0.99], ARRAY[0.0, 0.05, 0.25]) s;
+
+-- per group
+WITH data AS (SELECT g, tdigest(v, 100) AS d FROM summary_test GROUP BY g)
+SELECT
+    bool_and(s.count = tdigest_count(d)) AS count,
+    bool_and(s.percentiles = tdigest_digest_percentile(d, ARRAY[0.1, 0.9])) AS percentiles,
+    bool_and(s.trimmed_means = ARRAY[tdigest_digest_avg(d, 0.1, 0.9)]) AS trimmed_means
+FROM data, LATERAL tdigest_summary(d, ARRAY[0.1, 0.9], ARRAY[0.1]) s;
+
+-- invalid percentiles and trims
+SELECT tdigest_summary(tdigest(v, 100), ARRAY[1.5], ARRAY[0.1]) FROM summary_test;
+SELECT tdigest_summary(tdigest(v, 100), ARRAY[0.5], ARRAY[0.5]) FROM summary_test;
+SELECT tdigest_summary(tdigest(v, 100), ARRAY[0.5], ARRAY[-0.1]) FROM summary_test;
+
+DROP TABLE summary_test;
@@ -0,0 +1,53 @@
+SET extra_float_digits = 0;
+
+CREATE TABLE trimmed_bands_test (g int, v double precision);
+INSERT INTO trimmed_bands_test SELECT mod(i, 10), mod(i * 7919, 10007) / 10007.0 FROM generate_series(1,100000) s(i);
+
+-- multi-band results match the single-band non-aggregate functions
+WITH data AS (SELECT tdigest(v, 100) AS d FROM trimmed_bands_test)
+SELECT
+    tdigest_digest_avg(d, ARRAY[0.0, 0.05, 0.1], ARRAY[1.0, 0.95, 0.9]) = ARRAY[tdigest_digest_avg(d, 0.0, 1.0), tdigest_digest_avg(d, 0.05, 0.95), tdigest_digest_avg(d, 0.1, 0.9)] AS avg,
+    tdigest_digest_sum(d, ARRAY[0.0, 0.05, 0.1], ARRAY[1.0, 0.95, 0.9]) = ARRAY[tdigest_digest_sum(d, 0.0, 1.0), tdigest_digest_sum(d, 0.05, 0.95), tdigest_digest_sum(d, 0.1, 0.9)] AS sum
+FROM data;
+
+-- overlapping and disjoint bands, in arbitrary order
+WITH data AS (SELECT tdigest(v, 100) AS d FROM trimmed_bands_test)
+SELECT
+    tdigest_digest_avg(d, ARRAY[0.5, 0.0, 0.25, 0.9], ARRAY[0.75, 0.3, 0.5, 1.0]) = ARRAY[tdigest_digest_avg(d, 0.5, 0.75), tdigest_digest_avg(d, 0.0, 0.3), tdigest_digest_avg(d, 0.25, 0.5), tdigest_digest_avg(d, 0.9, 1.0)] AS avg,
+    tdigest_digest_sum(d, ARRAY[0.5, 0.0, 0.25, 0.9], ARRAY[0.75, 0.3, 0.5, 1.0]) = ARRAY[tdigest_digest_sum(d, 0.5, 0.75), tdigest_digest_sum(d, 0.0, 0.3), tdigest_digest_sum(d, 0.25, 0.5), tdigest_digest_sum(d, 0.9, 1.0)] AS sum
+FROM data;
+
+-- multi-band aggregates match the single-band aggregates, per group
+WITH agg AS (
+    SELECT
+        g,
+        tdigest_avg(v, 100, ARRAY[0.05, 0.1], ARRAY[0.95, 0.9]) AS a1,
+        tdigest_sum(v, 100, ARRAY[0.05, 0.1], ARRAY[0.95, 0.9]) AS a2,
+        ARRAY[tdigest_avg(v, 100, 0.05, 0.95), tdigest_avg(v, 100, 0.1, 0.9)] AS b1,
+        ARRAY[tdigest_sum(v, 100, 0.05, 0.95), tdigest_sum(v, 100, 0.1, 0.9)] AS b2
+    FROM trimmed_bands_test GROUP BY g
+)
+SELECT bool_and(a1 = b1) AS avg, bool_and(a2 = b2) AS sum FROM agg;
+
+-- aggregates on pre-built digests
+WITH digests AS (SELECT g, tdigest(v, 100) AS d FROM trimmed_bands_test GROUP BY g)
+SELECT
+    tdigest_avg(d, ARRAY[0.05, 0.1], ARRAY[0.95, 0.9]) = ARRAY[tdigest_avg(d, 0.05, 0.95), tdigest_avg(d, 0.1, 0.9)] AS avg,
+    tdigest_sum(d, ARRAY[0.05, 0.1], ARRAY[0.95, 0.9]) = ARRAY[tdigest_sum(d, 0.05, 0.95), tdigest_sum(d, 0.1, 0.9)] AS sum
+FROM digests;
+
+-- the estimates are reasonably accurate
+SELECT
+    abs((tdigest_avg(v, 100, ARRAY[0.0], ARRAY[1.0]))[1] - avg(v)) < 0.000001 AS avg,
+    abs((tdigest_sum(v, 100, ARRAY[0.0], ARRAY[1.0]))[1] - sum(v)) < 0.001 AS sum
+FROM trimmed_bands_test;
+
+-- empty input
+SELECT tdigest_avg(v, 100, ARRAY[0.1], ARRAY[0.9]) FROM trimmed_bands_test WHERE v < 0;
+
+-- invalid bands
+SELECT tdigest_digest_avg(tdigest(v, 100), ARRAY[0.1, 0.2], ARRAY[0.9]) FROM trimmed_bands_test;
+SELECT tdigest_digest_avg(tdigest(v, 100), ARRAY[0.1, 0.5], ARRAY[0.9, 0.4]) FROM trimmed_bands_test;
+SELECT tdigest_avg(v, 100, ARRAY[-0.1], ARRAY[0.9]) FROM trimmed_bands_test;
+
+DROP TABLE trimmed_bands_test;
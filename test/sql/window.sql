@@ -0,0 +1,46 @@
+SET extra_float_digits = 0;
+
+-- empty window
+SELECT tdigest_window(3, 100);
+
+SELECT tdigest_window_digest(tdigest_window(3, 100)) IS NULL AS empty;
+
+-- the newest bucket is listed last
+SELECT tdigest_window_add(tdigest_window(2, 100), 5, (SELECT tdigest(1.0, 100)));
+
+-- add per-minute digests, the old buckets get evicted
+CREATE TABLE window_t (w tdigest_window);
+INSERT INTO window_t VALUES (tdigest_window(3, 100));
+
+UPDATE window_t SET w = tdigest_window_add(w, 100, (SELECT tdigest(i, 100) FROM generate_series(1, 100) s(i)));
+SELECT tdigest_count(w::tdigest), tdigest_min(w::tdigest), tdigest_max(w::tdigest) FROM window_t;
+
+UPDATE window_t SET w = tdigest_window_add(w, 101, (SELECT tdigest(i, 100) FROM generate_series(101, 200) s(i)));
+UPDATE window_t SET w = tdigest_window_add(w, 101, (SELECT tdigest(i, 100) FROM generate_series(201, 300) s(i)));
+SELECT tdigest_count(w::tdigest), tdigest_min(w::tdigest), tdigest_max(w::tdigest) FROM window_t;
+
+-- buckets already out of the window are ignored
+UPDATE window_t SET w = tdigest_window_add(w, 98, (SELECT tdigest(i, 100) FROM generate_series(1, 1000) s(i)));
+SELECT tdigest_count(w::tdigest), tdigest_min(w::tdigest), tdigest_max(w::tdigest) FROM window_t;
+
+-- moving the window evicts the oldest buckets
+UPDATE window_t SET w = tdigest_window_add(w, 103, (SELECT tdigest(i, 100) FROM generate_series(301, 400) s(i)));
+SELECT tdigest_count(w::tdigest), tdigest_min(w::tdigest), tdigest_max(w::tdigest) FROM window_t;
+
+UPDATE window_t SET w = tdigest_window_advance(w, 104);
+SELECT tdigest_count(w::tdigest), tdigest_min(w::tdigest), tdigest_max(w::tdigest), tdigest_digest_percentile(w::tdigest, 0.5) FROM window_t;
+
+-- text round trip
+SELECT w::text::tdigest_window::text = w::text AS roundtrip FROM window_t;
+
+-- moving past all the buckets makes the window empty
+UPDATE window_t SET w = tdigest_window_advance(w, 200);
+SELECT w, tdigest_window_digest(w) IS NULL AS empty FROM window_t;
+
+DROP TABLE window_t;
+
+-- invalid windows
+SELECT tdigest_window(0, 100);
+SELECT tdigest_window(3, 5);
+SELECT 'buckets 2 compression 100 position 0 []'::tdigest_window;
+SELECT 'buckets 1 compression 100 position 0 [] []'::tdigest_window;